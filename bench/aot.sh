@@ -0,0 +1,51 @@
+#!/bin/sh
+# 提前编译（--emit-cpp）与解释器的对比：score/data 中的每个程序先翻译成 C++，
+# 再用系统编译器编译并链接运行时库，比较两者的输出与运行时间
+# 用法：bench/aot.sh [构建目录]，默认 build（需已构建 code 与 libscheme_runtime.a）
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BUILD=${1:-$ROOT/build}
+CXX=${CXX:-c++}
+DATA=$ROOT/score/data
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+now() { date +%s.%N; }
+total_interp=0
+total_aot=0
+same=0
+diff=0
+for input in "$DATA"/*.in; do
+    name=$(basename "$input" .in)
+    # 与评测一致：程序末尾补一个 (exit)
+    { cat "$input"; echo; echo "(exit)"; } > "$TMP/$name.scm"
+
+    start=$(now)
+    "$BUILD/code" < "$TMP/$name.scm" > "$TMP/$name.interp" 2>/dev/null
+    end=$(now)
+    t_interp=$(awk "BEGIN { print $end - $start }")
+
+    "$BUILD/code" --emit-cpp < "$TMP/$name.scm" > "$TMP/$name.cpp"
+    start=$(now)
+    $CXX -std=c++11 -O2 -I "$ROOT/src" "$TMP/$name.cpp" "$BUILD/libscheme_runtime.a" -o "$TMP/$name" || exit 1
+    end=$(now)
+    t_compile=$(awk "BEGIN { print $end - $start }")
+
+    start=$(now)
+    "$TMP/$name" > "$TMP/$name.aot" 2>/dev/null
+    end=$(now)
+    t_aot=$(awk "BEGIN { print $end - $start }")
+
+    if cmp -s "$TMP/$name.interp" "$TMP/$name.aot"; then
+        result=same
+        same=$((same + 1))
+    else
+        result=DIFF
+        diff=$((diff + 1))
+    fi
+    total_interp=$(awk "BEGIN { print $total_interp + $t_interp }")
+    total_aot=$(awk "BEGIN { print $total_aot + $t_aot }")
+    printf '%-6s interp %8.3fs  aot %8.3fs  (compile %6.2fs)  %s\n' \
+        "$name" "$t_interp" "$t_aot" "$t_compile" "$result"
+done
+printf 'total  interp %8.3fs  aot %8.3fs  same %d  different %d\n' \
+    "$total_interp" "$total_aot" "$same" "$diff"
@@ -0,0 +1,98 @@
+/**
+ * @file call_bench.cpp
+ * @brief Benchmark: heap allocations per procedure call of the tree walker
+ *
+ * Defines fib and tak, runs each once to warm the inline caches, then runs
+ * it again while counting every global operator new (std::vector buffers,
+ * pool pages, ...) and every object allocated by the collector; first
+ * interpreted, then once the JIT has compiled the bodies.
+ * The call count is that of the same recursion done in C++, so the last
+ * column is the allocations made per Scheme procedure call.
+ *
+ * Usage: call_bench [fib-n] [tak-x tak-y tak-z]
+ */
+
+#include "../src/Def.hpp"
+#include "../src/syntax.hpp"
+#include "../src/expr.hpp"
+#include "../src/value.hpp"
+#include "../src/gc.hpp"
+#include "../src/optimize.hpp"
+#include "../src/jit.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <sstream>
+
+static std::size_t news = 0;
+
+void *operator new(std::size_t size) {
+    news++;
+    void *p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+static Expr parse(const std::string &source, Assoc &env) {
+    std::istringstream is(source);
+    return optimize(readSyntax(is)->parse(env));
+}
+
+static long fibCalls(int n) {
+    return n < 2 ? 1 : 1 + fibCalls(n - 1) + fibCalls(n - 2);
+}
+
+static long takCalls(int x, int y, int z, int &result) {
+    if (!(y < x)) {
+        result = z;
+        return 1;
+    }
+    int a, b, c;
+    long calls = 1 + takCalls(x - 1, y, z, a) + takCalls(y - 1, z, x, b) + takCalls(z - 1, x, y, c);
+    return calls + takCalls(a, b, c, result);
+}
+
+static void measure(const std::string &name, const std::string &call, long calls, Assoc &env) {
+    Expr expr = parse(call, env);
+    expr->eval(env);
+    std::size_t news_before = news;
+    std::size_t objects_before = gcObjectsAllocated();
+    auto start = std::chrono::steady_clock::now();
+    Value v = expr->eval(env);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::size_t allocations = (news - news_before) + (gcObjectsAllocated() - objects_before);
+    std::cout << (jit_threshold > 0 ? "jit    " : "interp ") << name << " = ";
+    v.show(std::cout);
+    std::cout << ": " << seconds << " s, " << calls << " calls, "
+              << news - news_before << " operator new, "
+              << gcObjectsAllocated() - objects_before << " gc objects, "
+              << (double)allocations / calls << " allocations per call" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? std::atoi(argv[1]) : 25;
+    int x = argc > 4 ? std::atoi(argv[2]) : 18;
+    int y = argc > 4 ? std::atoi(argv[3]) : 12;
+    int z = argc > 4 ? std::atoi(argv[4]) : 6;
+    Assoc env = empty();
+    parse("(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))", env)->eval(env);
+    parse("(define (tak x y z) (if (not (< y x)) z (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))))", env)->eval(env);
+    std::string tak = std::to_string(x) + " " + std::to_string(y) + " " + std::to_string(z);
+    int result;
+    long fib_calls = fibCalls(n), tak_calls = takCalls(x, y, z, result);
+    for (int threshold = 0; threshold <= 1; threshold++) {
+        jit_threshold = threshold;
+        measure("fib " + std::to_string(n), "(fib " + std::to_string(n) + ")", fib_calls, env);
+        measure("tak " + tak, "(tak " + tak + ")", tak_calls, env);
+    }
+    return 0;
+}
@@ -0,0 +1,16 @@
+#!/bin/sh
+# 各执行引擎的运行时间对比
+# 用法：bench/engines.sh [解释器路径] [引擎...]，默认 build/code，tree、vm、closure 与 cek
+BIN=${1:-$(dirname "$0")/../build/code}
+[ $# -gt 0 ] && shift
+ENGINES=${*:-tree vm closure cek}
+DIR=$(dirname "$0")/scheme
+for prog in "$DIR"/*.scm; do
+    for engine in $ENGINES; do
+        start=$(date +%s.%N)
+        out=$("$BIN" --engine="$engine" < "$prog" | tr -d '\n' | sed 's/scm> //g')
+        end=$(date +%s.%N)
+        printf '%-10s %-8s %8.3fs  %s\n' "$(basename "$prog" .scm)" "$engine" \
+            "$(awk "BEGIN { print $end - $start }")" "$out"
+    done
+done
@@ -0,0 +1,14 @@
+#!/bin/sh
+# 融合节点（superinstruction）的触发次数与运行时间
+# 用法：bench/fusion.sh [解释器路径]，默认 build/code；只统计 tree 引擎的 eval，
+# JIT 编译后的代码不经过融合节点，故关闭 JIT
+BIN=${1:-$(dirname "$0")/../build/code}
+DIR=$(dirname "$0")/scheme
+for prog in "$DIR"/*.scm; do
+    start=$(date +%s.%N)
+    stats=$("$BIN" --engine=tree --no-jit --fusion-stats < "$prog" 2>&1 >/dev/null)
+    end=$(date +%s.%N)
+    printf '%s: %.3fs\n' "$(basename "$prog" .scm)" "$(awk "BEGIN { print $end - $start }")"
+    # 只列出触发过的形状
+    echo "$stats" | awk -F': ' '$2 > 0 { printf "    %-22s %12d\n", $1, $2 }'
+done
@@ -0,0 +1,74 @@
+/**
+ * @file pool_bench.cpp
+ * @brief Microbenchmark: list construction and teardown, pool vs operator new
+ *
+ * Builds a singly linked list of cons-cell sized nodes and then frees every
+ * node, once through the global operator new/delete and once through the
+ * size-class pool used for GCObjects.
+ *
+ * Usage: pool_bench [cells] [rounds]
+ */
+
+#include "../src/pool.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+// Same size as a Pair: vtable, GC link, mark/type word, car, cdr
+struct Cell {
+    Cell *next;
+    uintptr_t car;
+    uintptr_t header[3];
+};
+
+struct GlobalNew {
+    static const char *name() { return "operator new"; }
+    static void *allocate(std::size_t size) { return ::operator new(size); }
+    static void release(void *p, std::size_t) { ::operator delete(p); }
+};
+
+struct Pool {
+    static const char *name() { return "size-class pool"; }
+    static void *allocate(std::size_t size) { return poolAllocate(size); }
+    static void release(void *p, std::size_t size) { poolFree(p, size); }
+};
+
+template <class Alloc>
+void run(long cells, int rounds) {
+    double build_ms = 0, teardown_ms = 0;
+    uintptr_t checksum = 0;
+    for (int r = 0; r < rounds; r++) {
+        auto t0 = std::chrono::steady_clock::now();
+        Cell *head = nullptr;
+        for (long i = 0; i < cells; i++) {
+            Cell *c = static_cast<Cell *>(Alloc::allocate(sizeof(Cell)));
+            c->car = i;
+            c->next = head;
+            head = c;
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        while (head != nullptr) {
+            Cell *next = head->next;
+            checksum += head->car;
+            Alloc::release(head, sizeof(Cell));
+            head = next;
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        build_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        teardown_ms += std::chrono::duration<double, std::milli>(t2 - t1).count();
+    }
+    std::cout << Alloc::name() << ": build " << build_ms / rounds << " ms"
+              << ", teardown " << teardown_ms / rounds << " ms"
+              << " (per round, " << cells << " cells, checksum " << checksum << ")"
+              << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    long cells = argc > 1 ? atol(argv[1]) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    run<GlobalNew>(cells, rounds);
+    run<Pool>(cells, rounds);
+    return 0;
+}
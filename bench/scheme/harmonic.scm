@@ -0,0 +1,4 @@
+(define (harmonic n acc) (if (= n 0) acc (harmonic (- n 1) (+ acc (/ 1 n)))))
+(define h (harmonic 100000 0))
+(< 12 h 13)
+(exit)
@@ -0,0 +1,6 @@
+(define (square x) (* x x))
+(define (add1 n) (+ n 1))
+(define (sum-squares n acc) (if (= n 0) acc (sum-squares (- n 1) (+ acc (square (add1 n))))))
+(define (run k acc) (if (= k 0) acc (run (- k 1) (sum-squares 1000 0))))
+(run 300 0)
+(exit)
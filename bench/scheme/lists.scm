@@ -0,0 +1,7 @@
+(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))
+(define (map1 f l) (if (null? l) '() (cons (f (car l)) (map1 f (cdr l)))))
+(define (rev l acc) (if (null? l) acc (rev (cdr l) (cons (car l) acc))))
+(define (sum l acc) (if (null? l) acc (sum (cdr l) (+ acc (car l)))))
+(define (round k acc) (if (= k 0) acc (round (- k 1) (+ acc (sum (rev (map1 (lambda (x) (* x 2)) (build 2000 '())) '()) 0)))))
+(round 200 0)
+(exit)
@@ -0,0 +1,22 @@
+#!/bin/bash
+# 常量内存测试：memory/ 下每个程序循环 10^7 次并不断产生垃圾，
+# 在每个执行引擎上的峰值堆（--gc-stats）都不应超过 LIMIT 字节
+# 用法：score/memory.sh [解释器路径]，默认 ../build/code
+
+cd "$(dirname "$0")"
+BIN=${1:-../build/code}
+LIMIT=$((32 * 1024 * 1024))
+fail=0
+for prog in memory/*.in; do
+    for engine in tree vm closure cek; do
+        stats=$({ cat "$prog"; echo "(exit)"; } | "$BIN" --engine="$engine" --gc-stats 2>&1 >/dev/null)
+        peak=$(echo "$stats" | sed -n 's/.*peak heap \([0-9]*\) bytes.*/\1/p')
+        if [ -z "$peak" ] || [ "$peak" -gt "$LIMIT" ]; then
+            echo "Memory grows in $prog ($engine): peak heap ${peak:-unknown} bytes"
+            fail=1
+        else
+            echo "$prog ($engine): peak heap $peak bytes"
+        fi
+    done
+done
+exit $fail
@@ -7,7 +7,7 @@ echo "--------------------------------------------------------------------------
 cd "$(dirname "$0")"
 
 L=1
-R=118
+R=128
 for ((i = $L; i <= $R; i = i + 1))
 do
     echo ""
@@ -21,7 +21,12 @@ do
         echo "Output file data/$i.out not found, skipping TEST $i"
         continue
     fi
-    ../build/code << EOF > scm.out
+    # data/$i.flags（可选）给出该测试的命令行参数，例如 --engine=cek
+    FLAGS=""
+    if [ -f "data/$i.flags" ]; then
+        FLAGS=$(cat "data/$i.flags")
+    fi
+    ../build/code $FLAGS << EOF > scm.out
     $(cat data/$i.in)
     (exit)
 EOF
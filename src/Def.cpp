@@ -8,6 +8,42 @@
  */
 
 #include "Def.hpp"
+#include <unordered_map>
+#include <deque>
+
+/**
+ * @brief Global symbol intern table
+ *
+ * Names are stored once in `names` (a deque, so references returned by
+ * symbolName stay valid); `ids` maps a name back to its index. Both live in
+ * function-local statics so that interning from other static initializers
+ * is safe.
+ */
+static std::deque<std::string> &symbolNames() {
+    static std::deque<std::string> names;
+    return names;
+}
+
+static std::unordered_map<std::string, SymbolId> &symbolIds() {
+    static std::unordered_map<std::string, SymbolId> ids;
+    return ids;
+}
+
+SymbolId intern(const std::string &name) {
+    auto &ids = symbolIds();
+    auto it = ids.find(name);
+    if (it != ids.end()) {
+        return it->second;
+    }
+    SymbolId id = symbolNames().size();
+    symbolNames().push_back(name);
+    ids.emplace(name, id);
+    return id;
+}
+
+const std::string &symbolName(SymbolId id) {
+    return symbolNames()[id];
+}
 
 /**
  * @brief Mapping of primitive function names to expression types
@@ -17,7 +53,7 @@
  * and can be used in function application contexts.
  * 
  * Categories:
- * - Arithmetic: +, -, *, /, modulo, expt
+ * - Arithmetic: +, -, *, /, modulo, expt, exact->inexact, inexact->exact
  * - Comparison: <, <=, =, >=, >
  * - List operations: cons, car, cdr, list, set-car!, set-cdr!
  * - Logic: not, and, or (and/or support short-circuit evaluation)
@@ -33,6 +69,8 @@ std::map<std::string, ExprType> primitives = {
     {"/",        E_DIV},
     {"modulo",   E_MODULO},
     {"expt",     E_EXPT},
+    {"exact->inexact", E_EXACT_TO_INEXACT},
+    {"inexact->exact", E_INEXACT_TO_EXACT},
     
     // Comparison operations
     {"<",        E_LT},
@@ -73,6 +111,18 @@ std::map<std::string, ExprType> primitives = {
     {"exit",      E_EXIT}
 };
 
+/**
+ * @brief Names bound to a native procedure that has no primitive form
+ *
+ * A call of one is an ordinary call of the global variable, so a define
+ * rebinds the name like any other global; until then the variable holds
+ * the native procedure (see primitiveProcedure).
+ */
+std::map<std::string, ExprType> native_procedures = {
+    {"call/cc",   E_CALLCC},
+    {"call-with-current-continuation", E_CALLCC}
+};
+
 /**
  * @brief Mapping of reserved words (special forms) to expression types
  * 
@@ -109,6 +159,7 @@ std::map<std::string, ExprType> reserved_words = {
     // Binding constructs
     {"let",     E_LET},      
     {"letrec",  E_LETREC},   
+    {"do",      E_DO},       
     
     // Assignment
     {"set!",    E_SET}      
@@ -20,8 +20,25 @@
 struct Syntax;
 struct Expr;
 struct Value;
+struct ValueBase;
 struct AssocList;
 struct Assoc;
+struct GlobalCell;
+struct Primitive;
+struct Chunk;
+struct Compiled;
+struct JitState;
+
+/**
+ * @brief Interned symbol identifier
+ *
+ * The reader maps every distinct symbol name to a small integer once; after
+ * that, symbols, variable names and environment keys compare as integers.
+ */
+typedef int SymbolId;
+
+SymbolId intern(const std::string &);
+const std::string &symbolName(SymbolId);
 
 /**
  * @brief Expression types enumeration
@@ -33,11 +50,14 @@ enum ExprType {
     // Basic types and literals
     E_FIXNUM,          
     E_RATIONAL,        
+    E_BIGNUM,
+    E_FLONUM,
     E_STRING,         
     E_TRUE,            
     E_FALSE,           
     E_VOID,          
     E_EXIT,         
+    E_CALLCC,
 
     // Arithmetic operations
     E_PLUS,
@@ -46,6 +66,8 @@ enum ExprType {
     E_DIV,
     E_MODULO,
     E_EXPT,
+    E_EXACT_TO_INEXACT,
+    E_INEXACT_TO_EXACT,
 
     // Comparison operations
     E_LT,              
@@ -95,6 +117,7 @@ enum ExprType {
     // Binding constructs
     E_LET,            
     E_LETREC,          
+    E_DO,              
 
     // Assignment
     E_SET,             
@@ -112,6 +135,8 @@ enum ExprType {
 enum ValueType {
     V_INT,              
     V_RATIONAL,         
+    V_BIGNUM,
+    V_FLONUM,
     V_BOOL,             
     V_SYM,              
     V_NULL,             
@@ -119,7 +144,10 @@ enum ValueType {
     V_PAIR,             
     V_PROC,             
     V_VOID,            
-    V_TERMINATE        
+    V_TERMINATE,
+    V_PRIMITIVE,
+    V_CONTINUATION,
+    V_BOX               // internal: cell of an assigned local variable
 };
 
 #endif // DEF_HPP
@@ -0,0 +1,692 @@
+/**
+ * @file aot.cpp
+ * @brief Ahead-of-time compiler and the runtime support of its output
+ *
+ * The emitter walks each expression once, writing C++ statements into the
+ * function being generated. value() gives a C++ expression for the value of
+ * a node, a temporary unless it is a constant, so operands are evaluated in
+ * order and exactly once; emit() stores the value into a target variable,
+ * or returns it when there is no target (tail position), where calls become
+ * aotTailCall. Symbols, global cells, constants, parameter lists and the
+ * nodes whose evaluators the primitives use are file-scope statics of the
+ * output, set up by aotInit() before the first form runs.
+ */
+
+#include "aot.hpp"
+#include "gc.hpp"
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <sstream>
+
+// ============================================================================
+// Code generation
+// ============================================================================
+
+// C++ literal of s, safe for any byte
+static std::string cppString(const std::string &s) {
+    std::string out = "\"";
+    for (int i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\' || c == '?') {//'?' could start a trigraph
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (c < 32 || c >= 127) {
+            char buf[8];
+            std::snprintf(buf, sizeof buf, "\\%03o", c);
+            out += buf;
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out + "\"";
+}
+
+// node classes whose evaluator a primitive of type t uses, by operand count
+static const char *unaryClass(ExprType t) {
+    switch (t) {
+        case E_EXACT_TO_INEXACT: return "ExactToInexact";
+        case E_INEXACT_TO_EXACT: return "InexactToExact";
+        case E_CAR:     return "Car";
+        case E_CDR:     return "Cdr";
+        case E_NOT:     return "Not";
+        case E_BOOLQ:   return "IsBoolean";
+        case E_INTQ:    return "IsFixnum";
+        case E_NULLQ:   return "IsNull";
+        case E_PAIRQ:   return "IsPair";
+        case E_PROCQ:   return "IsProcedure";
+        case E_SYMBOLQ: return "IsSymbol";
+        case E_LISTQ:   return "IsList";
+        case E_STRINGQ: return "IsString";
+        case E_DISPLAY: return "Display";
+        default:        return nullptr;
+    }
+}
+
+static const char *binaryClass(ExprType t) {
+    switch (t) {
+        case E_PLUS:   return "Plus";
+        case E_MINUS:  return "Minus";
+        case E_MUL:    return "Mult";
+        case E_DIV:    return "Div";
+        case E_MODULO: return "Modulo";
+        case E_EXPT:   return "Expt";
+        case E_LT:     return "Less";
+        case E_LE:     return "LessEq";
+        case E_EQ:     return "Equal";
+        case E_GE:     return "GreaterEq";
+        case E_GT:     return "Greater";
+        case E_CONS:   return "Cons";
+        case E_SETCAR: return "SetCar";
+        case E_SETCDR: return "SetCdr";
+        case E_EQQ:    return "IsEq";
+        default:       return nullptr;
+    }
+}
+
+static const char *variadicClass(ExprType t) {
+    switch (t) {
+        case E_PLUS:  return "PlusVar";
+        case E_MINUS: return "MinusVar";
+        case E_MUL:   return "MultVar";
+        case E_DIV:   return "DivVar";
+        case E_LT:    return "LessVar";
+        case E_LE:    return "LessEqVar";
+        case E_EQ:    return "EqualVar";
+        case E_GE:    return "GreaterEqVar";
+        case E_GT:    return "GreaterVar";
+        case E_LIST:  return "ListFunc";
+        default:      return nullptr;
+    }
+}
+
+// inline fast path of a primitive, see aot.hpp
+static const char *fastPath(ExprType t) {
+    switch (t) {
+        case E_CAR:   return "aotCar";
+        case E_CDR:   return "aotCdr";
+        case E_PLUS:  return "aotAdd";
+        case E_MINUS: return "aotSub";
+        case E_MUL:   return "aotMul";
+        case E_LT:    return "aotLess";
+        case E_LE:    return "aotLessEq";
+        case E_EQ:    return "aotNumEq";
+        case E_GE:    return "aotGreaterEq";
+        case E_GT:    return "aotGreater";
+        default:      return nullptr;
+    }
+}
+
+static const std::string VOID_VALUE = "Value::fromBits(Value::VOID_BITS)";
+
+/**
+ * @brief Body of one generated C++ function
+ */
+struct CppFunction {
+    std::ostringstream body;
+    int indent;
+    CppFunction() : indent(1) {}
+};
+
+struct CppEmitter {
+    std::ostringstream decls;       ///< File-scope statics
+    std::ostringstream init;        ///< Body of aotInit()
+    std::ostringstream functions;   ///< Lambda bodies and forms, callees first
+    std::map<SymbolId, std::string> symbols;
+    std::map<GlobalCell*, std::string> cells;
+    std::map<std::string, std::string> ops;
+    int counter;
+    CppEmitter() : counter(0) {}
+
+    std::string fresh(const std::string &prefix) {
+        return prefix + std::to_string(counter++);
+    }
+
+    void line(CppFunction &f, const std::string &s) {
+        f.body << std::string(4 * f.indent, ' ') << s << '\n';
+    }
+
+    // store v into target, or return it when there is none
+    void assign(CppFunction &f, const std::string &target, const std::string &v) {
+        line(f, (target.empty() ? "return " : target + " = ") + v + ";");
+    }
+
+    std::string symbol(SymbolId x);
+    std::string cell(GlobalCell *c);
+    std::string op(const char *cls, int operands);
+    std::string datum(const Value &v);
+    std::string constant(const Value &v);
+    std::string slot(const std::string &env, int depth, int slot);
+    std::string lambda(Lambda *x);
+    std::string value(ExprBase *x, CppFunction &f, const std::string &env);
+    std::string primitive(ExprBase *x, CppFunction &f, const std::string &env);
+    void emit(ExprBase *x, CppFunction &f, const std::string &env, const std::string &target);
+};
+
+std::string CppEmitter::symbol(SymbolId x) {
+    auto found = symbols.find(x);
+    if (found != symbols.end()) return found->second;
+    std::string name = fresh("sym");
+    decls << "static SymbolId " << name << ";\n";
+    init << "    " << name << " = intern(" << cppString(symbolName(x)) << ");\n";
+    symbols.emplace(x, name);
+    return name;
+}
+
+std::string CppEmitter::cell(GlobalCell *c) {
+    auto found = cells.find(c);
+    if (found != cells.end()) return found->second;
+    std::string sym = symbol(c->name);
+    std::string name = fresh("cell");
+    decls << "static GlobalCell *" << name << ";\n";
+    init << "    " << name << " = globalCell(" << sym << ");\n";
+    cells.emplace(c, name);
+    return name;
+}
+
+// a node of class cls, used only for its evaluator
+std::string CppEmitter::op(const char *cls, int operands) {
+    auto found = ops.find(cls);
+    if (found != ops.end()) return found->second;
+    std::string name = std::string("op") + cls;
+    decls << "static " << cls << " " << name;
+    if (operands == 1) decls << "(Expr(nullptr));\n";
+    else if (operands == 2) decls << "(Expr(nullptr), Expr(nullptr));\n";
+    else decls << "(std::vector<Expr>{});\n";
+    ops.emplace(cls, name);
+    return name;
+}
+
+// C++ expression building v, valid in aotInit(); lists are built by statements there
+std::string CppEmitter::datum(const Value &v) {
+    switch (v.type()) {
+        case V_INT:
+            return "aotFixnum(" + std::to_string(v.fixnum()) + ")";
+        case V_BOOL:
+        case V_NULL:
+        case V_VOID:
+            return "Value::fromBits(" + std::to_string(v.bits) + "u)";
+        case V_SYM:
+            return "SymbolV(" + symbol(v.symbol()) + ")";
+        case V_FLONUM: {
+            double d = flonumValue(v);
+            uint64_t bits;
+            std::memcpy(&bits, &d, sizeof bits);
+            return "aotDouble(" + std::to_string(bits) + "ull)";
+        }
+        case V_BIGNUM:
+            return "IntegerV(BigInt::fromString(\"" + static_cast<Bignum*>(v.get())->n.toString() + "\"))";
+        case V_RATIONAL: {
+            Rational *r = static_cast<Rational*>(v.get());
+            BigInt num = r->big ? r->big_numerator : BigInt(r->numerator);
+            BigInt den = r->big ? r->big_denominator : BigInt(r->denominator);
+            return "RationalV(BigInt::fromString(\"" + num.toString() + "\"), BigInt::fromString(\"" +
+                   den.toString() + "\"))";
+        }
+        case V_STRING:
+            return "StringV(" + cppString(static_cast<String*>(v.get())->s) + ")";
+        case V_PAIR: {
+            //the spine is built back to front by statements, so long lists do not nest
+            std::vector<Value> elements;
+            Value rest = v;
+            while (rest.type() == V_PAIR) {
+                elements.push_back(static_cast<Pair*>(rest.get())->car);
+                rest = static_cast<Pair*>(rest.get())->cdr;
+            }
+            std::string list = fresh("list");
+            std::string tail = datum(rest);
+            init << "    Value " << list << " = " << tail << ";\n";
+            for (int i = (int)elements.size() - 1; i >= 0; i--) {
+                std::string car = datum(elements[i]);
+                init << "    " << list << " = PairV(" << car << ", " << list << ");\n";
+            }
+            return list;
+        }
+        default:
+            throw RuntimeError("Constant cannot be compiled");
+    }
+}
+
+std::string CppEmitter::constant(const Value &v) {
+    if (v.isFixnum() || v.type() == V_BOOL || v.type() == V_NULL) return datum(v);
+    std::string name = fresh("k");
+    std::string built = datum(v);
+    decls << "static Value " << name << "(nullptr);\n";
+    init << "    " << name << " = aotConstant(" << built << ");\n";
+    return name;
+}
+
+std::string CppEmitter::slot(const std::string &env, int depth, int slot) {
+    std::string frame = env + ".ptr";
+    while (depth-- > 0) frame += "->next.ptr";
+    return frame + "->slots[" + std::to_string(slot) + "]";
+}
+
+// the body as a function taking the call frame; returns its name
+std::string CppEmitter::lambda(Lambda *x) {
+    CppFunction f;
+    std::string name = fresh("lambda");
+    emit(x->e.get(), f, "env", "");
+    functions << "static Value " << name << "(Assoc &env) {\n" << f.body.str() << "}\n\n";
+    return name;
+}
+
+// the primitive node x, with its operands evaluated left to right
+std::string CppEmitter::primitive(ExprBase *x, CppFunction &f, const std::string &env) {
+    std::string result = fresh("v");
+    const char *fast = fastPath(x->e_type);
+    if (Unary *unary = dynamic_cast<Unary*>(x)) {
+        std::string a = value(unary->rand.get(), f, env);
+        if (x->e_type == E_NULLQ) {
+            line(f, "Value " + result + " = aotBoolean(" + a + ".isNull());");
+        } else if (x->e_type == E_NOT) {
+            line(f, "Value " + result + " = aotBoolean(" + a + ".isFalse());");
+        } else {
+            std::string node = op(unaryClass(x->e_type), 1);
+            line(f, "Value " + result + " = " + (fast != nullptr ? std::string(fast) + "(" + node + ", " + a + ")"
+                                                                : node + ".evalRator(" + a + ")") + ";");
+        }
+        return result;
+    }
+    if (Binary *binary = dynamic_cast<Binary*>(x)) {
+        std::string a = value(binary->rand1.get(), f, env);
+        std::string b = value(binary->rand2.get(), f, env);
+        std::string node = op(binaryClass(x->e_type), 2);
+        line(f, "Value " + result + " = " + (fast != nullptr ? std::string(fast) + "(" + node + ", " + a + ", " + b + ")"
+                                                            : node + ".evalRator(" + a + ", " + b + ")") + ";");
+        return result;
+    }
+    Variadic *variadic = static_cast<Variadic*>(x);
+    std::string args;
+    for (int i = 0; i < variadic->rands.size(); i++) {
+        if (i > 0) args += ", ";
+        args += value(variadic->rands[i].get(), f, env);
+    }
+    std::string node = op(variadicClass(x->e_type), -1);
+    line(f, "Value " + result + " = " + node + ".evalRator(std::vector<Value>{" + args + "});");
+    return result;
+}
+
+std::string CppEmitter::value(ExprBase *x, CppFunction &f, const std::string &env) {
+    switch (x->e_type) {
+        case E_FIXNUM:
+            return "aotFixnum(" + std::to_string(static_cast<Fixnum*>(x)->n) + ")";
+        case E_TRUE:
+            return "aotBoolean(true)";
+        case E_FALSE:
+            return "aotBoolean(false)";
+        case E_VOID:
+            return VOID_VALUE;
+        case E_EXIT:
+            return "TerminateV()";
+        case E_RATIONAL: {
+            RationalNum *node = static_cast<RationalNum*>(x);
+            if (node->denominator.isZero()) {
+                line(f, "throw RuntimeError(\"Denominator cannot be zero\");");
+                return "Value(nullptr)";
+            }
+            return constant(node->value.get());
+        }
+        case E_BIGNUM:
+            return constant(static_cast<BignumNum*>(x)->value.get());
+        case E_FLONUM:
+            return constant(static_cast<FlonumNum*>(x)->value.get());
+        case E_STRING:
+            return constant(static_cast<StringExpr*>(x)->value.get());
+        case E_QUOTE:
+            return constant(static_cast<Quote*>(x)->value.get());
+        case E_VAR: {
+            Var *var = static_cast<Var*>(x);
+            if (!validName(var->x)) {
+                line(f, "checkName(" + symbol(var->x) + ");");
+                return "Value(nullptr)";
+            }
+            std::string result = fresh("v");
+            if (var->depth < 0) {
+                line(f, "Value " + result + " = aotGlobal(" + cell(var->cell) + ");");
+                return result;
+            }
+            std::string place = slot(env, var->depth, var->slot);
+            if (var->boxed) place = "static_cast<Box*>(" + place + ".get())->v";
+            line(f, "Value " + result + " = " + place + ";");
+            line(f, "if (" + result + ".empty()) aotUndefined(" + symbol(var->x) + ");");
+            return result;
+        }
+        case E_LAMBDA: {
+            Lambda *node = static_cast<Lambda*>(x);
+            std::string code = lambda(node);
+            std::string params = fresh("params");
+            std::string boxed = fresh("boxed");
+            decls << "static std::vector<SymbolId> " << params << ";\n";
+            decls << "static std::vector<bool> " << boxed << ";\n";
+            for (int i = 0; i < node->x.size(); i++) {
+                std::string sym = symbol(node->x[i]);
+                init << "    " << params << ".push_back(" << sym << ");\n";
+            }
+            for (int i = 0; i < node->boxed.size(); i++) {
+                init << "    " << boxed << ".push_back(" << (node->boxed[i] ? "true" : "false") << ");\n";
+            }
+            std::string captured = "empty()";
+            if (!node->captures.empty()) {
+                //flat closure: copy only the free variables (boxes are shared, not copied)
+                captured = fresh("captured");
+                line(f, "Assoc " + captured + " = extend(" + std::to_string(node->captures.size()) + ", empty());");
+                for (int i = 0; i < node->captures.size(); i++) {
+                    line(f, slot(captured, 0, i) + " = " +
+                            slot(env, node->captures[i].first, node->captures[i].second) + ";");
+                }
+            }
+            std::string result = fresh("v");
+            line(f, "Value " + result + " = aotProcedure(" + code + ", " + params + ", " + boxed + ", " +
+                    captured + ");");
+            return result;
+        }
+        case E_DEFINE: {
+            Define *node = static_cast<Define*>(x);
+            if (!validName(node->var)) {
+                line(f, "checkName(" + symbol(node->var) + ");");
+                return VOID_VALUE;
+            }
+            std::string v = value(node->e.get(), f, env);
+            if (node->depth < 0) {
+                line(f, cell(node->cell) + "->v = " + v + ";");
+            } else if (node->boxed) {
+                line(f, "static_cast<Box*>(" + slot(env, node->depth, node->slot) + ".get())->v = " + v + ";");
+            } else {
+                line(f, slot(env, node->depth, node->slot) + " = " + v + ";");
+            }
+            return VOID_VALUE;
+        }
+        case E_SET: {
+            Set *node = static_cast<Set*>(x);
+            std::string place = node->depth < 0 ? cell(node->cell) + "->v" : slot(env, node->depth, node->slot);
+            if (node->depth >= 0 && node->boxed) place = "static_cast<Box*>(" + place + ".get())->v";
+            line(f, "if (" + place + ".empty()) throw RuntimeError(\"Unbound variable in set!\");");
+            std::string v = value(node->e.get(), f, env);
+            line(f, place + " = " + v + ";");
+            return VOID_VALUE;
+        }
+        case E_BEGIN: case E_IF: case E_COND: case E_AND: case E_OR:
+        case E_LET: case E_LETREC: case E_APPLY: {
+            std::string result = fresh("v");
+            line(f, "Value " + result + "(nullptr);");
+            emit(x, f, env, result);
+            return result;
+        }
+        default:
+            return primitive(x, f, env);
+    }
+}
+
+void CppEmitter::emit(ExprBase *x, CppFunction &f, const std::string &env, const std::string &target) {
+    switch (x->e_type) {
+        case E_BEGIN: {
+            Begin *node = static_cast<Begin*>(x);
+            if (node->es.empty()) {
+                assign(f, target, VOID_VALUE);
+                return;
+            }
+            for (int i = 0; i + 1 < node->es.size(); i++) {
+                value(node->es[i].get(), f, env);
+            }
+            emit(node->es.back().get(), f, env, target);
+            return;
+        }
+        case E_IF: {
+            If *node = static_cast<If*>(x);
+            std::string test = value(node->cond.get(), f, env);
+            line(f, "if (!" + test + ".isFalse()) {");
+            f.indent++;
+            emit(node->conseq.get(), f, env, target);
+            f.indent--;
+            line(f, "} else {");
+            f.indent++;
+            emit(node->alter.get(), f, env, target);
+            f.indent--;
+            line(f, "}");
+            return;
+        }
+        case E_COND: {
+            //clauses are tried in a do-while(0), left by break once one is taken
+            Cond *node = static_cast<Cond*>(x);
+            line(f, "do {");
+            f.indent++;
+            for (int k = 0; k < node->clauses.size(); k++) {
+                const std::vector<Expr> &clause = node->clauses[k];
+                std::string test = value(clause[0].get(), f, env);
+                line(f, "if (!" + test + ".isFalse()) {");
+                f.indent++;
+                if (clause.size() == 1) {
+                    assign(f, target, test);
+                } else {
+                    for (int i = 1; i + 1 < clause.size(); i++) {
+                        value(clause[i].get(), f, env);
+                    }
+                    emit(clause.back().get(), f, env, target);
+                }
+                if (!target.empty()) line(f, "break;");
+                f.indent--;
+                line(f, "}");
+            }
+            assign(f, target, VOID_VALUE);
+            f.indent--;
+            line(f, "} while (0);");
+            return;
+        }
+        case E_AND:
+        case E_OR: {
+            bool is_and = x->e_type == E_AND;
+            const std::vector<Expr> &rands = is_and ? static_cast<AndVar*>(x)->rands : static_cast<OrVar*>(x)->rands;
+            if (rands.empty()) {
+                assign(f, target, is_and ? "aotBoolean(true)" : "aotBoolean(false)");
+                return;
+            }
+            line(f, "do {");
+            f.indent++;
+            for (int i = 0; i + 1 < rands.size(); i++) {
+                std::string v = value(rands[i].get(), f, env);
+                line(f, std::string(is_and ? "if (" : "if (!") + v + ".isFalse()) {");
+                f.indent++;
+                assign(f, target, is_and ? "aotBoolean(false)" : v);
+                if (!target.empty()) line(f, "break;");
+                f.indent--;
+                line(f, "}");
+            }
+            emit(rands.back().get(), f, env, target);
+            f.indent--;
+            line(f, "} while (0);");
+            return;
+        }
+        case E_LET: {
+            Let *node = static_cast<Let*>(x);
+            std::string frame = fresh("env");
+            line(f, "{");
+            f.indent++;
+            line(f, "Assoc " + frame + " = extend(" + std::to_string(node->bind.size()) + ", " + env + ");");
+            for (int i = 0; i < node->bind.size(); i++) {
+                if (!validName(node->bind[i].first)) line(f, "checkName(" + symbol(node->bind[i].first) + ");");
+                std::string v = value(node->bind[i].second.get(), f, env);
+                line(f, slot(frame, 0, i) + " = " + (node->boxed[i] ? "BoxV(" + v + ")" : v) + ";");
+            }
+            emit(node->body.get(), f, frame, target);
+            f.indent--;
+            line(f, "}");
+            return;
+        }
+        case E_LETREC: {
+            //the slots stay unbound until every init has been evaluated
+            Letrec *node = static_cast<Letrec*>(x);
+            std::string frame = fresh("env");
+            line(f, "{");
+            f.indent++;
+            line(f, "Assoc " + frame + " = extend(" + std::to_string(node->bind.size()) + ", " + env + ");");
+            for (int i = 0; i < node->bind.size(); i++) {
+                if (!validName(node->bind[i].first)) line(f, "checkName(" + symbol(node->bind[i].first) + ");");
+                if (node->boxed[i]) line(f, slot(frame, 0, i) + " = BoxV(Value(nullptr));");
+            }
+            std::vector<std::string> values;
+            for (int i = 0; i < node->bind.size(); i++) {
+                values.push_back(value(node->bind[i].second.get(), f, frame));
+            }
+            for (int i = 0; i < node->bind.size(); i++) {
+                if (node->boxed[i]) line(f, "static_cast<Box*>(" + slot(frame, 0, i) + ".get())->v = " + values[i] + ";");
+                else line(f, slot(frame, 0, i) + " = " + values[i] + ";");
+            }
+            emit(node->body.get(), f, frame, target);
+            f.indent--;
+            line(f, "}");
+            return;
+        }
+        case E_APPLY: {
+            Apply *node = static_cast<Apply*>(x);
+            std::string rator = value(node->rator.get(), f, env);
+            line(f, "aotCheckApplicable(" + rator + ");");
+            std::string args;
+            for (int i = 0; i < node->rand.size(); i++) {
+                if (i > 0) args += ", ";
+                args += value(node->rand[i].get(), f, env);
+            }
+            std::string n = std::to_string(node->rand.size());
+            std::string array = "nullptr";
+            if (!node->rand.empty()) {
+                array = fresh("args");
+                line(f, "Value " + array + "[] = {" + args + "};");
+            }
+            if (target.empty()) line(f, "return aotTailCall(" + rator + ", " + array + ", " + n + ");");
+            else line(f, target + " = aotCall(" + rator + ", " + array + ", " + n + ");");
+            return;
+        }
+        default:
+            assign(f, target, value(x, f, env));
+    }
+}
+
+void emitCpp(const std::vector<AotForm> &forms, std::ostream &os) {
+    CppEmitter emitter;
+    std::vector<std::string> names;
+    for (int i = 0; i < forms.size(); i++) {
+        CppFunction f;
+        if (forms[i].expr.get() == nullptr) {
+            emitter.line(f, "throw RuntimeError(" + cppString(forms[i].error) + ");");
+        } else {
+            emitter.emit(forms[i].expr.get(), f, "env", "");
+        }
+        names.push_back(emitter.fresh("form"));
+        emitter.functions << "static Value " << names.back() << "(Assoc &env) {\n" << f.body.str() << "}\n\n";
+    }
+
+    os << "// Generated by --emit-cpp; link with the scheme_runtime library\n"
+       << "#include \"aot.hpp\"\n\n"
+       << emitter.decls.str() << "\n"
+       << "static void aotInit() {\n" << emitter.init.str() << "}\n\n"
+       << emitter.functions.str();
+    if (forms.empty()) {
+        os << "int main() {\n    return aotMain(nullptr, nullptr, 0);\n}\n";
+        return;
+    }
+    os << "static const NativeCode forms[] = {";
+    for (int i = 0; i < names.size(); i++) {
+        os << (i > 0 ? ", " : "") << names[i];
+    }
+    os << "};\n\nstatic const bool explicit_void[] = {";
+    for (int i = 0; i < forms.size(); i++) {
+        os << (i > 0 ? ", " : "") << (forms[i].explicit_void ? "true" : "false");
+    }
+    os << "};\n\n"
+       << "int main() {\n"
+       << "    aotInit();\n"
+       << "    return aotMain(forms, explicit_void, " << forms.size() << ");\n"
+       << "}\n";
+}
+
+// ============================================================================
+// Runtime support
+// ============================================================================
+
+static Procedure *pending = nullptr;    ///< Callee of the pending tail call
+static Assoc pending_frame(nullptr);    ///< Its frame
+
+void aotUndefined(SymbolId x) {
+    throw RuntimeError("Undefined variable:" + symbolName(x));
+}
+
+Value aotUnbound(GlobalCell *cell) {
+    Value prim = primitiveProcedure(cell->name);
+    if (prim.empty()) aotUndefined(cell->name);
+    return prim;
+}
+
+Value aotProcedure(NativeCode native, const std::vector<SymbolId> &xs,
+                   const std::vector<bool> &boxed, const Assoc &captured) {
+    static const Expr no_body(nullptr);
+    Value proc = ProcedureV(xs, no_body, captured, boxed);
+    static_cast<Procedure*>(proc.get())->native = native;
+    return proc;
+}
+
+void aotCheckApplicable(const Value &f) {
+    if (f.type() != V_PROC && f.type() != V_PRIMITIVE) throw RuntimeError("Attempt to apply a non-procedure");
+}
+
+Value aotTailCall(const Value &f, const Value *args, int n) {
+    if (f.type() == V_PRIMITIVE) {
+        Primitive *prim = static_cast<Primitive*>(f.get());
+        if (prim->arity >= 0 && n != prim->arity) throw RuntimeError("Wrong number of arguments");
+        return prim->fn(std::vector<Value>(args, args + n));
+    }
+    Procedure *clos = static_cast<Procedure*>(f.get());
+    if (n != clos->parameters.size()) throw RuntimeError("Wrong number of arguments");
+    Assoc frame = extend(n, clos->env);
+    for (int i = 0; i < n; i++) {
+        frame->slots[i] = args[i];
+    }
+    for (int i = 0; i < clos->boxed.size(); i++) {
+        if (clos->boxed[i]) frame->slots[i] = BoxV(frame->slots[i]);
+    }
+    if (clos->native == nullptr) {//made by the tree walker
+        return trampoline(clos->e.get(), frame);
+    }
+    pending = clos;
+    pending_frame = frame;
+    return Value(nullptr);
+}
+
+Value aotResume() {
+    Assoc frame = pending_frame;
+    pending_frame = empty();
+    return pending->native(frame);
+}
+
+Value aotConstant(const Value &v) {
+    freezeConstant(v);
+    gcPin(v.get());
+    return v;
+}
+
+Value aotDouble(uint64_t bits) {
+    double d;
+    std::memcpy(&d, &bits, sizeof d);
+    return FlonumV(d);
+}
+
+int aotMain(const NativeCode *forms, const bool *explicit_void, std::size_t n) {
+    Assoc global_env = empty();
+    for (std::size_t i = 0; i < n; i++) {
+        #ifndef ONLINE_JUDGE
+            std::cout << "scm> ";
+        #endif
+        try {
+            Value val = aotFinish(forms[i](global_env));
+            if (val.type() == V_TERMINATE)
+                break;
+            if (!(val.type() == V_VOID && !explicit_void[i]))
+                val.show(std::cout);
+        }
+        catch (const RuntimeError &RE) {
+            std::cout << "RuntimeError";
+        }
+        puts("");
+        gcSafePoint(global_env); // nothing is live on the C++ stack here
+    }
+    return 0;
+}
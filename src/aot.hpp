@@ -0,0 +1,180 @@
+#ifndef AOT_HPP
+#define AOT_HPP
+
+/**
+ * @file aot.hpp
+ * @brief Ahead-of-time compilation to C++ (--emit-cpp)
+ *
+ * emitCpp() writes a whole program as one C++ translation unit: every
+ * lambda body and every top-level form becomes a C++ function, variables
+ * become direct slot and cell accesses, and the common primitives get
+ * inline fixnum and pair fast paths. The unit includes this header and is
+ * linked against the runtime library (every source but main.cpp), so
+ * values, frames, the collector and the primitive evaluators are the
+ * interpreter's own; the program prints exactly what the REPL would.
+ *
+ * The second half of this header is the runtime support the generated code
+ * calls. A generated function returns the empty Value when it ends in a
+ * tail call: the callee and its frame are then pending, and aotCall() (or
+ * aotFinish()) runs them in a loop, so tail calls take constant C++ stack.
+ */
+
+#include "Def.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "RE.hpp"
+#include <climits>
+#include <vector>
+
+// ============================================================================
+// Code generation
+// ============================================================================
+
+/**
+ * @brief One top-level form of the program, as the REPL would evaluate it
+ */
+struct AotForm {
+    Expr expr;              ///< Parsed and optimized, nullptr if it failed to parse
+    std::string error;      ///< Message of the parse error
+    bool explicit_void;     ///< A void result is shown (see isExplicitVoidCall)
+    AotForm(const Expr &expr, const std::string &error, bool explicit_void)
+        : expr(expr), error(error), explicit_void(explicit_void) {}
+};
+
+/**
+ * @brief Write the C++ translation unit running forms in order
+ *
+ * The forms must be parsed with the inliner off, as inlined calls depend on
+ * the global values at the time of parsing.
+ */
+void emitCpp(const std::vector<AotForm> &forms, std::ostream &os);
+
+// ============================================================================
+// Runtime support for the generated code
+// ============================================================================
+
+typedef Value (*NativeCode)(Assoc &);
+
+void aotUndefined(SymbolId x);      ///< Throws the unbound variable error
+Value aotUnbound(GlobalCell *cell); ///< The primitive of an unbound global's name, or the error
+
+/**
+ * @brief Value of a global, or its primitive while it is unbound
+ */
+inline Value aotGlobal(GlobalCell *cell) {
+    if (!cell->v.empty()) return cell->v;
+    return aotUnbound(cell);
+}
+
+/**
+ * @brief Procedure running native with its frame, for a lambda with parameters xs
+ */
+Value aotProcedure(NativeCode native, const std::vector<SymbolId> &xs,
+                   const std::vector<bool> &boxed, const Assoc &captured);
+
+void aotCheckApplicable(const Value &f);    ///< Throws unless f is a procedure or primitive
+
+/**
+ * @brief Call f on n arguments in tail position
+ *
+ * A primitive runs at once and gives its value; a procedure only gets its
+ * frame, becomes the pending call and the empty Value is returned.
+ */
+Value aotTailCall(const Value &f, const Value *args, int n);
+
+Value aotResume();     ///< Run the pending call, which may leave another one pending
+
+/**
+ * @brief Result of a generated function: runs the pending calls it left
+ */
+inline Value aotFinish(Value v) {
+    while (v.empty()) v = aotResume();
+    return v;
+}
+
+inline Value aotCall(const Value &f, const Value *args, int n) {
+    return aotFinish(aotTailCall(f, args, n));
+}
+
+/**
+ * @brief Value of a constant, pinned for the rest of the run
+ */
+Value aotConstant(const Value &v);
+
+Value aotDouble(uint64_t bits);     ///< Flonum with the bit pattern of a double
+
+// Fast paths of the common primitives; anything else goes to the node's evaluator
+
+inline Value aotBoolean(bool b) {
+    return Value::fromBits(b ? Value::TRUE_BITS : Value::FALSE_BITS);
+}
+
+inline Value aotFixnum(int n) {
+    return Value::fromBits(((uintptr_t)(intptr_t)n << 1) | Value::FIXNUM_TAG);
+}
+
+inline Value aotInteger(long long n) {
+    if (n >= INT_MIN && n <= INT_MAX) return aotFixnum((int)n);
+    return IntegerV(n);
+}
+
+inline bool aotIsPair(const Value &v) {
+    return v.isHeap() && reinterpret_cast<ValueBase*>(v.bits)->v_type == V_PAIR;
+}
+
+inline Value aotCar(Unary &op, const Value &v) {
+    if (aotIsPair(v)) return reinterpret_cast<Pair*>(v.bits)->car;
+    return op.evalRator(v);
+}
+
+inline Value aotCdr(Unary &op, const Value &v) {
+    if (aotIsPair(v)) return reinterpret_cast<Pair*>(v.bits)->cdr;
+    return op.evalRator(v);
+}
+
+inline Value aotAdd(Binary &op, const Value &a, const Value &b) {
+    if (a.isFixnum() && b.isFixnum()) return aotInteger((long long)a.fixnum() + b.fixnum());
+    return op.evalRator(a, b);
+}
+
+inline Value aotSub(Binary &op, const Value &a, const Value &b) {
+    if (a.isFixnum() && b.isFixnum()) return aotInteger((long long)a.fixnum() - b.fixnum());
+    return op.evalRator(a, b);
+}
+
+inline Value aotMul(Binary &op, const Value &a, const Value &b) {
+    if (a.isFixnum() && b.isFixnum()) return aotInteger((long long)a.fixnum() * b.fixnum());
+    return op.evalRator(a, b);
+}
+
+inline Value aotLess(Binary &op, const Value &a, const Value &b) {
+    if (a.isFixnum() && b.isFixnum()) return aotBoolean(a.fixnum() < b.fixnum());
+    return op.evalRator(a, b);
+}
+
+inline Value aotLessEq(Binary &op, const Value &a, const Value &b) {
+    if (a.isFixnum() && b.isFixnum()) return aotBoolean(a.fixnum() <= b.fixnum());
+    return op.evalRator(a, b);
+}
+
+inline Value aotNumEq(Binary &op, const Value &a, const Value &b) {
+    if (a.isFixnum() && b.isFixnum()) return aotBoolean(a.fixnum() == b.fixnum());
+    return op.evalRator(a, b);
+}
+
+inline Value aotGreaterEq(Binary &op, const Value &a, const Value &b) {
+    if (a.isFixnum() && b.isFixnum()) return aotBoolean(a.fixnum() >= b.fixnum());
+    return op.evalRator(a, b);
+}
+
+inline Value aotGreater(Binary &op, const Value &a, const Value &b) {
+    if (a.isFixnum() && b.isFixnum()) return aotBoolean(a.fixnum() > b.fixnum());
+    return op.evalRator(a, b);
+}
+
+/**
+ * @brief The REPL loop over the compiled forms
+ */
+int aotMain(const NativeCode *forms, const bool *explicit_void, std::size_t n);
+
+#endif // AOT_HPP
@@ -0,0 +1,422 @@
+/**
+ * @file bignum.cpp
+ * @brief Arbitrary-precision integer arithmetic
+ *
+ * The magnitude routines work on limb vectors and ignore signs; the
+ * operators combine them with the signs. Division is Knuth's algorithm D
+ * (a single-limb divisor takes a shortcut).
+ */
+
+#include "bignum.hpp"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+typedef std::vector<uint32_t> Limbs;
+
+static const std::size_t KARATSUBA_THRESHOLD = 32;     ///< Limbs below which schoolbook is faster
+static const uint32_t DECIMAL_CHUNK = 1000000000;      ///< 10^9, the most decimal digits in a limb
+
+// ============================================================================
+// Magnitudes
+// ============================================================================
+
+static void trim(Limbs &a) {
+    while (!a.empty() && a.back() == 0) a.pop_back();
+}
+
+static int compareMag(const Limbs &a, const Limbs &b) {
+    if (a.size() != b.size()) return a.size() < b.size() ? -1 : 1;
+    for (std::size_t i = a.size(); i-- > 0;) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static Limbs addMag(const Limbs &a, const Limbs &b) {
+    const Limbs &longer = a.size() >= b.size() ? a : b;
+    const Limbs &shorter = a.size() >= b.size() ? b : a;
+    Limbs sum(longer.size() + 1);
+    uint64_t carry = 0;
+    for (std::size_t i = 0; i < longer.size(); i++) {
+        uint64_t t = (uint64_t)longer[i] + (i < shorter.size() ? shorter[i] : 0) + carry;
+        sum[i] = (uint32_t)t;
+        carry = t >> 32;
+    }
+    sum[longer.size()] = (uint32_t)carry;
+    trim(sum);
+    return sum;
+}
+
+//a - b, for a >= b
+static Limbs subMag(const Limbs &a, const Limbs &b) {
+    Limbs diff(a.size());
+    int64_t borrow = 0;
+    for (std::size_t i = 0; i < a.size(); i++) {
+        int64_t t = (int64_t)a[i] - (i < b.size() ? b[i] : 0) - borrow;
+        borrow = t < 0;
+        diff[i] = (uint32_t)t;
+    }
+    trim(diff);
+    return diff;
+}
+
+//acc += x * 2^(32 * shift)
+static void addShifted(Limbs &acc, const Limbs &x, std::size_t shift) {
+    if (acc.size() < x.size() + shift + 1) acc.resize(x.size() + shift + 1, 0);
+    uint64_t carry = 0;
+    std::size_t i = 0;
+    for (; i < x.size(); i++) {
+        uint64_t t = (uint64_t)acc[i + shift] + x[i] + carry;
+        acc[i + shift] = (uint32_t)t;
+        carry = t >> 32;
+    }
+    for (i += shift; carry != 0; i++) {
+        if (i == acc.size()) acc.push_back(0);
+        uint64_t t = (uint64_t)acc[i] + carry;
+        acc[i] = (uint32_t)t;
+        carry = t >> 32;
+    }
+}
+
+static Limbs schoolbookMul(const Limbs &a, const Limbs &b) {
+    Limbs product(a.size() + b.size(), 0);
+    for (std::size_t i = 0; i < a.size(); i++) {
+        uint64_t carry = 0;
+        for (std::size_t j = 0; j < b.size(); j++) {
+            uint64_t t = (uint64_t)a[i] * b[j] + product[i + j] + carry;
+            product[i + j] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        product[i + b.size()] = (uint32_t)carry;
+    }
+    trim(product);
+    return product;
+}
+
+static Limbs slice(const Limbs &a, std::size_t from, std::size_t to) {
+    from = std::min(from, a.size());
+    to = std::min(to, a.size());
+    Limbs part(a.begin() + from, a.begin() + to);
+    trim(part);
+    return part;
+}
+
+static Limbs mulMag(const Limbs &a, const Limbs &b) {
+    if (a.empty() || b.empty()) return Limbs();
+    if (a.size() > b.size()) return mulMag(b, a);
+    if (a.size() < KARATSUBA_THRESHOLD) return schoolbookMul(a, b);
+    if (2 * a.size() <= b.size()) {
+        //unbalanced: multiply a by pieces of b of its own length
+        Limbs product;
+        for (std::size_t i = 0; i < b.size(); i += a.size()) {
+            addShifted(product, mulMag(a, slice(b, i, i + a.size())), i);
+        }
+        trim(product);
+        return product;
+    }
+    //(a1 B + a0)(b1 B + b0) = z2 B^2 + z1 B + z0 with z1 = (a1 + a0)(b1 + b0) - z2 - z0
+    std::size_t half = b.size() / 2;
+    Limbs a0 = slice(a, 0, half), a1 = slice(a, half, a.size());
+    Limbs b0 = slice(b, 0, half), b1 = slice(b, half, b.size());
+    Limbs z0 = mulMag(a0, b0);
+    Limbs z2 = mulMag(a1, b1);
+    Limbs z1 = subMag(subMag(mulMag(addMag(a0, a1), addMag(b0, b1)), z0), z2);
+    Limbs product = z0;
+    addShifted(product, z1, half);
+    addShifted(product, z2, 2 * half);
+    trim(product);
+    return product;
+}
+
+//a / d in place, returning the remainder
+static uint32_t divSmall(Limbs &a, uint32_t d) {
+    uint64_t rem = 0;
+    for (std::size_t i = a.size(); i-- > 0;) {
+        uint64_t t = (rem << 32) | a[i];
+        a[i] = (uint32_t)(t / d);
+        rem = t % d;
+    }
+    trim(a);
+    return (uint32_t)rem;
+}
+
+//a = a * m + c in place
+static void mulAddSmall(Limbs &a, uint32_t m, uint32_t c) {
+    uint64_t carry = c;
+    for (std::size_t i = 0; i < a.size(); i++) {
+        uint64_t t = (uint64_t)a[i] * m + carry;
+        a[i] = (uint32_t)t;
+        carry = t >> 32;
+    }
+    if (carry != 0) a.push_back((uint32_t)carry);
+}
+
+//a shifted left by s < 32 bits, with extra limbs to the given size
+static Limbs shiftLeft(const Limbs &a, int s, std::size_t size) {
+    Limbs r(size, 0);
+    for (std::size_t i = 0; i < a.size(); i++) {
+        r[i] |= a[i] << s;
+        if (s != 0 && i + 1 < size) r[i + 1] = a[i] >> (32 - s);
+    }
+    return r;
+}
+
+static void divMag(const Limbs &u, const Limbs &v, Limbs &q, Limbs &r) {
+    if (compareMag(u, v) < 0) {
+        q.clear();
+        r = u;
+        return;
+    }
+    if (v.size() == 1 && v[0] == 1) {//common in gcd reductions, where most gcds are 1
+        q = u;
+        r.clear();
+        return;
+    }
+    if (v.size() == 1) {
+        q = u;
+        uint32_t rem = divSmall(q, v[0]);
+        r.assign(rem != 0 ? 1 : 0, rem);
+        return;
+    }
+    //normalize so the top bit of the divisor is set, which keeps qhat within 2 of the digit
+    int s = 0;
+    while ((v.back() << s & 0x80000000u) == 0) s++;
+    std::size_t n = v.size(), m = u.size() - n;
+    Limbs vn = shiftLeft(v, s, n);
+    Limbs un = shiftLeft(u, s, u.size() + 1);
+    q.assign(m + 1, 0);
+    for (std::size_t j = m + 1; j-- > 0;) {
+        uint64_t num = ((uint64_t)un[j + n] << 32) | un[j + n - 1];
+        uint64_t qhat = num / vn[n - 1];
+        uint64_t rhat = num % vn[n - 1];
+        while (qhat >> 32 != 0 || qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2])) {
+            qhat--;
+            rhat += vn[n - 1];
+            if (rhat >> 32 != 0) break;
+        }
+        //un[j..j+n] -= qhat * vn
+        int64_t borrow = 0;
+        for (std::size_t i = 0; i < n; i++) {
+            uint64_t p = qhat * vn[i];
+            int64_t t = (int64_t)un[i + j] - borrow - (int64_t)(p & 0xffffffffu);
+            un[i + j] = (uint32_t)t;
+            borrow = (int64_t)(p >> 32) - (t >> 32);
+        }
+        int64_t t = (int64_t)un[j + n] - borrow;
+        un[j + n] = (uint32_t)t;
+        q[j] = (uint32_t)qhat;
+        if (t < 0) {//qhat was one too large: add the divisor back
+            q[j]--;
+            uint64_t carry = 0;
+            for (std::size_t i = 0; i < n; i++) {
+                uint64_t sum = (uint64_t)un[i + j] + vn[i] + carry;
+                un[i + j] = (uint32_t)sum;
+                carry = sum >> 32;
+            }
+            un[j + n] += (uint32_t)carry;
+        }
+    }
+    trim(q);
+    r.assign(n, 0);
+    for (std::size_t i = 0; i < n; i++) {
+        r[i] = un[i] >> s;
+        if (s != 0) r[i] |= un[i + 1] << (32 - s);
+    }
+    trim(r);
+}
+
+// ============================================================================
+// BigInt
+// ============================================================================
+
+BigInt::BigInt() : negative(false) {}
+
+BigInt::BigInt(long long n) : negative(n < 0) {
+    unsigned long long mag = negative ? 0ULL - (unsigned long long)n : (unsigned long long)n;
+    while (mag != 0) {
+        limbs.push_back((uint32_t)mag);
+        mag >>= 32;
+    }
+}
+
+bool BigInt::fitsInt() const {
+    if (limbs.size() > 1) return false;
+    if (limbs.empty()) return true;
+    return negative ? limbs[0] <= (uint32_t)INT_MAX + 1 : limbs[0] <= (uint32_t)INT_MAX;
+}
+
+int BigInt::toInt() const {
+    if (limbs.empty()) return 0;
+    return negative ? (int)(-(long long)limbs[0]) : (int)limbs[0];
+}
+
+bool BigInt::fitsLong() const {
+    if (limbs.size() > 2) return false;
+    return limbs.size() < 2 || limbs[1] <= (uint32_t)(LLONG_MAX >> 32);
+}
+
+long long BigInt::toLong() const {
+    unsigned long long mag = 0;
+    for (std::size_t i = limbs.size(); i-- > 0;) mag = mag << 32 | limbs[i];
+    return negative ? -(long long)mag : (long long)mag;
+}
+
+std::size_t BigInt::bitLength() const {
+    if (limbs.empty()) return 0;
+    std::size_t bits = 32 * (limbs.size() - 1);
+    for (uint32_t top = limbs.back(); top != 0; top >>= 1) bits++;
+    return bits;
+}
+
+double BigInt::toDouble() const {
+    //the top three limbs hold more bits than a double; the rest only scale
+    double d = 0;
+    std::size_t low = limbs.size() > 3 ? limbs.size() - 3 : 0;
+    for (std::size_t i = limbs.size(); i-- > low;) d = d * 4294967296.0 + limbs[i];
+    d = std::ldexp(d, (int)(32 * low));
+    return negative ? -d : d;
+}
+
+std::string BigInt::toString() const {
+    if (limbs.empty()) return "0";
+    std::vector<uint32_t> chunks;   // base 10^9 digits, least significant first
+    Limbs rest = limbs;
+    while (!rest.empty()) chunks.push_back(divSmall(rest, DECIMAL_CHUNK));
+    std::string s = negative ? "-" : "";
+    s += std::to_string(chunks.back());
+    for (std::size_t i = chunks.size() - 1; i-- > 0;) {
+        std::string digits = std::to_string(chunks[i]);
+        s.append(9 - digits.size(), '0');
+        s += digits;
+    }
+    return s;
+}
+
+BigInt BigInt::fromString(const std::string &s) {
+    BigInt n;
+    std::size_t i = 0;
+    if (i < s.size() && (s[i] == '-' || s[i] == '+')) i++;
+    //the leading chunk takes the odd digits so that every later one has nine
+    std::size_t len = (s.size() - i) % 9 == 0 ? 9 : (s.size() - i) % 9;
+    while (i < s.size()) {
+        uint32_t chunk = 0, scale = 1;
+        for (std::size_t k = 0; k < len; k++, i++) {
+            chunk = chunk * 10 + (s[i] - '0');
+            scale *= 10;
+        }
+        mulAddSmall(n.limbs, scale, chunk);
+        len = 9;
+    }
+    trim(n.limbs);
+    n.negative = !n.limbs.empty() && s[0] == '-';
+    return n;
+}
+
+BigInt operator-(const BigInt &a) {
+    BigInt r = a;
+    r.negative = !a.negative && !a.isZero();
+    return r;
+}
+
+BigInt operator+(const BigInt &a, const BigInt &b) {
+    BigInt r;
+    if (a.negative == b.negative) {
+        r.limbs = addMag(a.limbs, b.limbs);
+        r.negative = a.negative;
+    } else if (compareMag(a.limbs, b.limbs) >= 0) {
+        r.limbs = subMag(a.limbs, b.limbs);
+        r.negative = a.negative;
+    } else {
+        r.limbs = subMag(b.limbs, a.limbs);
+        r.negative = b.negative;
+    }
+    if (r.isZero()) r.negative = false;
+    return r;
+}
+
+BigInt operator-(const BigInt &a, const BigInt &b) {
+    return a + (-b);
+}
+
+BigInt operator*(const BigInt &a, const BigInt &b) {
+    BigInt r;
+    r.limbs = mulMag(a.limbs, b.limbs);
+    r.negative = !r.isZero() && a.negative != b.negative;
+    return r;
+}
+
+int compare(const BigInt &a, const BigInt &b) {
+    if (a.negative != b.negative) return a.negative ? -1 : 1;
+    int c = compareMag(a.limbs, b.limbs);
+    return a.negative ? -c : c;
+}
+
+void divide(const BigInt &a, const BigInt &b, BigInt &q, BigInt &r) {
+    Limbs quotient, remainder;
+    divMag(a.limbs, b.limbs, quotient, remainder);
+    q.limbs = quotient;
+    q.negative = !q.isZero() && a.negative != b.negative;
+    r.limbs = remainder;
+    r.negative = !r.isZero() && a.negative;
+}
+
+BigInt gcd(const BigInt &a, const BigInt &b) {
+    //Euclid while the operands are long, then the binary algorithm on machine words
+    Limbs x = a.limbs, y = b.limbs;
+    while (x.size() > 2 || y.size() > 2) {
+        if (y.empty()) break;
+        Limbs q, r;
+        divMag(x, y, q, r);
+        x.swap(y);
+        y.swap(r);
+    }
+    if (y.empty()) {
+        BigInt g;
+        g.limbs = x;
+        return g;
+    }
+    unsigned long long wx = 0, wy = 0;
+    for (std::size_t i = x.size(); i-- > 0;) wx = wx << 32 | x[i];
+    for (std::size_t i = y.size(); i-- > 0;) wy = wy << 32 | y[i];
+    unsigned long long g = binaryGcd(wx, wy);
+    BigInt result;
+    for (; g != 0; g >>= 32) result.limbs.push_back((uint32_t)g);
+    return result;
+}
+
+static int trailingZeros(unsigned long long x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while ((x & 1) == 0) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+unsigned long long binaryGcd(unsigned long long a, unsigned long long b) {
+    if (a == 0) return b;
+    if (b == 0) return a;
+    int shift = trailingZeros(a | b);
+    a >>= trailingZeros(a);
+    do {
+        b >>= trailingZeros(b);
+        if (a > b) std::swap(a, b);
+        b -= a;
+    } while (b != 0);
+    return a << shift;
+}
+
+BigInt power(const BigInt &base, unsigned exponent) {
+    BigInt result(1), b = base;
+    while (exponent != 0) {
+        if (exponent & 1) result = result * b;
+        exponent >>= 1;
+        if (exponent != 0) b = b * b;
+    }
+    return result;
+}
@@ -0,0 +1,59 @@
+#ifndef BIGNUM_HPP
+#define BIGNUM_HPP
+
+/**
+ * @file bignum.hpp
+ * @brief Arbitrary-precision integers
+ *
+ * Sign and magnitude; the magnitude is kept in base 2^32 limbs, least
+ * significant first, without leading zero limbs (zero has none). Products of
+ * long operands use Karatsuba instead of the schoolbook method, and decimal
+ * conversion handles nine digits per pass over the limbs.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct BigInt {
+    bool negative;
+    std::vector<uint32_t> limbs;    ///< Magnitude, least significant limb first
+    BigInt();
+    explicit BigInt(long long);
+    bool isZero() const { return limbs.empty(); }
+    bool fitsInt() const;
+    int toInt() const;              ///< Only meaningful when fitsInt()
+    bool fitsLong() const;          ///< Magnitude at most LLONG_MAX
+    long long toLong() const;       ///< Only meaningful when fitsLong()
+    std::size_t bitLength() const;  ///< Bits in the magnitude, 0 for zero
+    double toDouble() const;        ///< Nearest double, within an ulp; infinite if too large
+    std::string toString() const;   ///< Decimal, with a leading '-' if negative
+    static BigInt fromString(const std::string &);  ///< Optional sign followed by decimal digits
+};
+
+BigInt operator-(const BigInt &);
+BigInt operator+(const BigInt &, const BigInt &);
+BigInt operator-(const BigInt &, const BigInt &);
+BigInt operator*(const BigInt &, const BigInt &);
+
+/**
+ * @brief Compare a and b: -1, 0 or 1
+ */
+int compare(const BigInt &a, const BigInt &b);
+
+/**
+ * @brief Truncating division a = q * b + r, r having the sign of a; b must not be zero
+ */
+void divide(const BigInt &a, const BigInt &b, BigInt &q, BigInt &r);
+
+BigInt gcd(const BigInt &, const BigInt &);    ///< Non-negative
+
+/**
+ * @brief Greatest common divisor by the binary (Stein) algorithm; gcd(0, b) = b
+ */
+unsigned long long binaryGcd(unsigned long long a, unsigned long long b);
+
+BigInt power(const BigInt &base, unsigned exponent);
+
+#endif // BIGNUM_HPP
@@ -0,0 +1,556 @@
+/**
+ * @file cek.cpp
+ * @brief CEK machine implementation
+ *
+ * enter() takes one step into an expression: compound nodes push a frame
+ * for the rest of their work and go on with a subexpression, resume() pops
+ * a frame and hands it the value. Subexpressions that cannot call a
+ * procedure (variables, constants, primitives applied to such) are simply
+ * evaluated by their eval() on the spot, so only real calls cost a frame.
+ * The frame waiting for an operand of a call, primitive or let keeps the
+ * operands evaluated since the previous such frame and links to that frame
+ * for the earlier ones, so a combination copies each value once however
+ * many of its operands are calls. Frames are never changed after the push:
+ * a continuation re-entered twice sees the same operands both times.
+ *
+ * The collector may run at procedure entry: at that point everything live
+ * is reachable from the machine registers, which are pinned for the
+ * collection. Each frame also keeps the procedure whose body it belongs to,
+ * so code still to be run is never freed with an unreachable procedure.
+ */
+
+#include "cek.hpp"
+#include "RE.hpp"
+#include "pool.hpp"
+#include <vector>
+#include <algorithm>
+#include <new>
+
+/**
+ * @brief What a continuation frame does with the value it receives
+ */
+enum KontType {
+    K_IF,           ///< Choose a branch of node
+    K_BEGIN,        ///< Go on with es[index]
+    K_COND_TEST,    ///< Test result of clause index
+    K_COND_BODY,    ///< Go on with expression sub of clause index
+    K_AND,          ///< Go on with rands[index] unless the value is #f
+    K_OR,           ///< Go on with rands[index] if the value is #f
+    K_APPLY,        ///< Operand index of a call (0 is the rator)
+    K_PRIM,         ///< Operand index of a primitive node, sub is its PrimKind
+    K_LET,          ///< Init index of a let
+    K_LETREC,       ///< Init index of a letrec, env is the new frame
+    K_DEFINE,
+    K_SET
+};
+
+/**
+ * @brief Operand layout of a primitive node
+ */
+enum PrimKind {
+    P_NONE,
+    P_UNARY,
+    P_BINARY,
+    P_VARIADIC
+};
+
+struct Kont : GCObject {
+    KontType type;
+    ExprBase *node;
+    int index;
+    int sub;
+    Assoc env;          ///< Frame to resume in
+    Value proc;         ///< Procedure owning node
+    Value *vals;        ///< Operands after prior's and before index, allocated from the pool
+    std::size_t count;
+    Kont *prior;        ///< Latest earlier frame of the combination holding operands, if any
+    Kont *next;         ///< Rest of the continuation
+    Kont(KontType, ExprBase *, int, int, const Assoc &, const Value &,
+         const std::vector<Value> &, Kont *, Kont *);
+    virtual void trace() override;
+    virtual ~Kont();
+};
+
+Kont::Kont(KontType t, ExprBase *node, int index, int sub, const Assoc &env,
+           const Value &proc, const std::vector<Value> &values, Kont *prior, Kont *next)
+    : type(t), node(node), index(index), sub(sub), env(env), proc(proc),
+      vals(nullptr), count(values.size()), prior(prior), next(next) {
+    if (count > 0) {
+        vals = static_cast<Value *>(poolAllocate(count * sizeof(Value)));
+        for (std::size_t i = 0; i < count; i++) new (&vals[i]) Value(values[i]);
+    }
+}
+
+void Kont::trace() {
+    gcMark(env.get());
+    gcMark(proc.get());
+    for (std::size_t i = 0; i < count; i++) gcMark(vals[i].get());
+    gcMark(prior);
+    gcMark(next);
+}
+
+Kont::~Kont() {
+    if (vals != nullptr) poolFree(vals, count * sizeof(Value));
+}
+
+// Continuation
+Continuation::Continuation(Kont *k) : ValueBase(V_CONTINUATION), k(k) {}
+
+void Continuation::show(std::ostream &os) {
+    os << "#<continuation>";
+}
+
+void Continuation::trace() {
+    gcMark(k);
+}
+
+Value callWithCurrentContinuation(const std::vector<Value> &args) {
+    throw RuntimeError("call/cc needs --engine=cek");
+}
+
+/**
+ * @brief Machine registers
+ */
+struct Machine {
+    ExprBase *c;        ///< Expression to evaluate, unless returning
+    Assoc env;
+    Value proc;         ///< Procedure whose body c belongs to
+    Value val;          ///< Value being returned to k
+    Kont *k;            ///< nullptr: val is the result of cekEval
+    bool returning;
+};
+
+static const std::vector<Value> no_values;
+
+static void push(Machine &m, KontType t, ExprBase *node, int index, int sub = 0,
+                 const std::vector<Value> &vals = no_values, Kont *prior = nullptr) {
+    m.k = new Kont(t, node, index, sub, m.env, m.proc, vals, prior, m.k);
+}
+
+static void evaluate(Machine &m, ExprBase *x) {
+    m.c = x;
+    m.returning = false;
+}
+
+static void give(Machine &m, const Value &v) {
+    m.val = v;
+    m.returning = true;
+}
+
+static void collect(Machine &m) {
+    gcPin(m.k);
+    gcPin(m.proc.get());
+    gcCollect(m.env);
+    gcUnpin(m.proc.get());
+    gcUnpin(m.k);
+}
+
+// ============================================================================
+// Operands
+// ============================================================================
+
+static PrimKind primKind(ExprBase *x) {
+    if (dynamic_cast<Unary*>(x)) return P_UNARY;
+    if (dynamic_cast<Binary*>(x)) return P_BINARY;
+    if (dynamic_cast<Variadic*>(x)) return P_VARIADIC;
+    return P_NONE;
+}
+
+static ExprBase *primOperand(ExprBase *x, int kind, int i) {
+    switch (kind) {
+        case P_UNARY:
+            return i == 0 ? static_cast<Unary*>(x)->rand.get() : nullptr;
+        case P_BINARY:
+            return i == 0 ? static_cast<Binary*>(x)->rand1.get()
+                 : i == 1 ? static_cast<Binary*>(x)->rand2.get() : nullptr;
+        case P_VARIADIC: {
+            const std::vector<Expr> &rands = static_cast<Variadic*>(x)->rands;
+            return i < rands.size() ? rands[i].get() : nullptr;
+        }
+        default:
+            return nullptr;
+    }
+}
+
+/**
+ * @brief Whether x cannot call a procedure, so its eval() may run it
+ */
+static bool simple(ExprBase *x) {
+    switch (x->e_type) {
+        case E_VAR: case E_FIXNUM: case E_BIGNUM: case E_FLONUM: case E_RATIONAL: case E_STRING: case E_TRUE:
+        case E_FALSE: case E_QUOTE: case E_LAMBDA: case E_VOID: case E_EXIT:
+            return true;
+        case E_IF: case E_COND: case E_BEGIN: case E_AND: case E_OR: case E_APPLY:
+        case E_DEFINE: case E_SET: case E_LET: case E_LETREC:
+            return false;
+        default: {
+            int kind = primKind(x);
+            for (int i = 0; ExprBase *e = primOperand(x, kind, i); i++) {
+                if (!simple(e)) return false;
+            }
+            return true;
+        }
+    }
+}
+
+/**
+ * @brief Operand i of a combination, nullptr past the last one
+ */
+static ExprBase *operandOf(KontType t, ExprBase *x, int kind, int i) {
+    switch (t) {
+        case K_APPLY: {
+            Apply *call = static_cast<Apply*>(x);
+            if (i == 0) return call->rator.get();
+            return i <= call->rand.size() ? call->rand[i - 1].get() : nullptr;
+        }
+        case K_LET: {
+            Let *let = static_cast<Let*>(x);
+            return i < let->bind.size() ? let->bind[i].second.get() : nullptr;
+        }
+        case K_LETREC: {
+            Letrec *letrec = static_cast<Letrec*>(x);
+            return i < letrec->bind.size() ? letrec->bind[i].second.get() : nullptr;
+        }
+        default:
+            return primOperand(x, kind, i);
+    }
+}
+
+/**
+ * @brief All operands of a combination: those held by prior and its own priors, then vals
+ */
+static void gather(Kont *prior, std::vector<Value> &vals) {
+    if (prior == nullptr) return;
+    std::size_t own = vals.size(), total = own;
+    for (Kont *f = prior; f != nullptr; f = f->prior) total += f->count;
+    vals.resize(total, Value(nullptr));
+    std::copy_backward(vals.begin(), vals.begin() + own, vals.end());
+    //the priors run from the latest operands back to the first
+    std::size_t end = total - own;
+    for (Kont *f = prior; f != nullptr; f = f->prior) {
+        end -= f->count;
+        std::copy(f->vals, f->vals + f->count, vals.begin() + end);
+    }
+}
+
+/**
+ * @brief Evaluate operands i.. of x, in order
+ * @param prior Frame holding the operands before those in vals
+ * @param vals Operands since prior's; all the operands once this returns true
+ * @return true once all are there; false when a frame now waits for m.c
+ */
+static bool evalOperands(Machine &m, KontType t, ExprBase *x, int kind, int i, Kont *prior,
+                         std::vector<Value> &vals) {
+    while (ExprBase *e = operandOf(t, x, kind, i)) {
+        if (t == K_APPLY && i == 1) {//the rator is checked before the arguments are evaluated
+            ValueType type = vals[0].type();
+            if (type != V_PROC && type != V_PRIMITIVE && type != V_CONTINUATION) {
+                throw RuntimeError("Attempt to apply a non-procedure");
+            }
+        }
+        if (t == K_LET) checkName(static_cast<Let*>(x)->bind[i].first);
+        if (!simple(e)) {
+            push(m, t, x, i, kind, vals, prior);
+            evaluate(m, e);
+            return false;
+        }
+        vals.push_back(e->eval(m.env));
+        i++;
+    }
+    gather(prior, vals);
+    return true;
+}
+
+static void apply(Machine &m, const Value &f, std::vector<Value> &args);
+
+/**
+ * @brief Finish combination x, whose operands are all in vals
+ */
+static void combine(Machine &m, KontType t, ExprBase *x, int kind, std::vector<Value> &vals) {
+    switch (t) {
+        case K_APPLY: {
+            Value rator = vals[0];
+            vals.erase(vals.begin());
+            apply(m, rator, vals);
+            return;
+        }
+        case K_LET: {
+            Let *let = static_cast<Let*>(x);
+            Assoc let_env = extend(vals.size(), m.env);
+            for (int i = 0; i < vals.size(); i++) {
+                let_env->slots[i] = let->boxed[i] ? BoxV(vals[i]) : vals[i];
+            }
+            m.env = let_env;
+            evaluate(m, let->body.get());
+            return;
+        }
+        case K_LETREC: {
+            //the slots stay unbound until every init has been evaluated
+            Letrec *letrec = static_cast<Letrec*>(x);
+            for (int i = 0; i < vals.size(); i++) {
+                if (letrec->boxed[i]) static_cast<Box*>(m.env->slots[i].get())->v = vals[i];
+                else m.env->slots[i] = vals[i];
+            }
+            evaluate(m, letrec->body.get());
+            return;
+        }
+        default:
+            if (kind == P_UNARY) {
+                give(m, static_cast<Unary*>(x)->evalRator(vals[0]));
+            } else if (kind == P_BINARY) {
+                give(m, static_cast<Binary*>(x)->evalRator(vals[0], vals[1]));
+            } else {
+                give(m, static_cast<Variadic*>(x)->evalRator(vals));
+            }
+            return;
+    }
+}
+
+static void startCombination(Machine &m, KontType t, ExprBase *x, int kind) {
+    std::vector<Value> vals;
+    if (evalOperands(m, t, x, kind, 0, nullptr, vals)) combine(m, t, x, kind, vals);
+}
+
+// ============================================================================
+// Steps
+// ============================================================================
+
+/**
+ * @brief Call f with args; a procedure body becomes the next expression
+ */
+static void apply(Machine &m, const Value &f, std::vector<Value> &args) {
+    switch (f.type()) {
+        case V_PROC: {
+            Procedure *clos_ptr = static_cast<Procedure*>(f.get());
+            if (args.size() != clos_ptr->parameters.size()) throw RuntimeError("Wrong number of arguments");
+            Assoc param_env = extend(args.size(), clos_ptr->env);
+            for (int i = 0; i < args.size(); i++) {
+                param_env->slots[i] = args[i];
+            }
+            for (int i = 0; i < clos_ptr->boxed.size(); i++) {
+                if (clos_ptr->boxed[i]) param_env->slots[i] = BoxV(args[i]);
+            }
+            m.env = param_env;
+            m.proc = f;
+            evaluate(m, clos_ptr->e.get());
+            if (gcPending()) collect(m);
+            return;
+        }
+        case V_PRIMITIVE: {
+            Primitive *prim = static_cast<Primitive*>(f.get());
+            if (prim->arity >= 0 && args.size() != prim->arity) throw RuntimeError("Wrong number of arguments");
+            if (prim->fn == callWithCurrentContinuation) {
+                //the continuation of (call/cc g) is simply the current k
+                Value g = args[0];
+                std::vector<Value> k_args(1, Value(new Continuation(m.k)));
+                apply(m, g, k_args);
+                return;
+            }
+            give(m, prim->fn(args));
+            return;
+        }
+        case V_CONTINUATION:
+            if (args.size() != 1) throw RuntimeError("Wrong number of arguments");
+            m.k = static_cast<Continuation*>(f.get())->k;
+            give(m, args[0]);
+            return;
+        default:
+            throw RuntimeError("Attempt to apply a non-procedure");
+    }
+}
+
+static void condBody(Machine &m, Cond *x, int clause, int i) {
+    const std::vector<Expr> &es = x->clauses[clause];
+    if (i + 1 < es.size()) push(m, K_COND_BODY, x, clause, i + 1);
+    evaluate(m, es[i].get());
+}
+
+/**
+ * @brief One step into m.c
+ */
+static void enter(Machine &m) {
+    ExprBase *x = m.c;
+    switch (x->e_type) {
+        case E_IF: {
+            If *node = static_cast<If*>(x);
+            if (simple(node->cond.get())) {
+                evaluate(m, node->cond->eval(m.env).isFalse() ? node->alter.get() : node->conseq.get());
+                return;
+            }
+            push(m, K_IF, x, 0);
+            evaluate(m, node->cond.get());
+            return;
+        }
+        case E_BEGIN: {
+            Begin *b = static_cast<Begin*>(x);
+            if (b->es.empty()) {
+                give(m, VoidV());
+                return;
+            }
+            if (b->es.size() > 1) push(m, K_BEGIN, x, 1);
+            evaluate(m, b->es[0].get());
+            return;
+        }
+        case E_COND: {
+            Cond *cond = static_cast<Cond*>(x);
+            if (cond->clauses.empty()) {
+                give(m, VoidV());
+                return;
+            }
+            push(m, K_COND_TEST, x, 0);
+            evaluate(m, cond->clauses[0][0].get());
+            return;
+        }
+        case E_AND:
+        case E_OR: {
+            const std::vector<Expr> &rands = x->e_type == E_AND ? static_cast<AndVar*>(x)->rands
+                                                                : static_cast<OrVar*>(x)->rands;
+            if (rands.empty()) {
+                give(m, BooleanV(x->e_type == E_AND));
+                return;
+            }
+            if (rands.size() > 1) push(m, x->e_type == E_AND ? K_AND : K_OR, x, 1);
+            evaluate(m, rands[0].get());
+            return;
+        }
+        case E_DEFINE: {
+            Define *define = static_cast<Define*>(x);
+            checkName(define->var);
+            push(m, K_DEFINE, x, 0);
+            evaluate(m, define->e.get());
+            return;
+        }
+        case E_SET: {
+            Set *set = static_cast<Set*>(x);
+            Value *place = set->depth >= 0 ? &frameSlot(m.env, set->depth, set->slot) : &set->cell->v;
+            if (set->boxed) place = &static_cast<Box*>(place->get())->v;
+            if (place->empty()) throw RuntimeError("Unbound variable in set!");
+            push(m, K_SET, x, 0);
+            evaluate(m, set->e.get());
+            return;
+        }
+        case E_APPLY:
+            startCombination(m, K_APPLY, x, P_NONE);
+            return;
+        case E_LET:
+            startCombination(m, K_LET, x, P_NONE);
+            return;
+        case E_LETREC: {
+            Letrec *letrec = static_cast<Letrec*>(x);
+            Assoc env1 = extend(letrec->bind.size(), m.env);
+            for (int i = 0; i < letrec->bind.size(); i++) {
+                checkName(letrec->bind[i].first);
+                if (letrec->boxed[i]) env1->slots[i] = BoxV(Value(nullptr));
+            }
+            m.env = env1;
+            startCombination(m, K_LETREC, x, P_NONE);
+            return;
+        }
+        default:
+            if (simple(x)) {
+                give(m, x->eval(m.env));
+            } else {
+                startCombination(m, K_PRIM, x, primKind(x));
+            }
+            return;
+    }
+}
+
+/**
+ * @brief Pop the top frame and hand it m.val
+ */
+static void resume(Machine &m) {
+    Kont *f = m.k;
+    ExprBase *x = f->node;
+    m.k = f->next;
+    m.env = f->env;
+    m.proc = f->proc;
+    switch (f->type) {
+        case K_IF: {
+            If *node = static_cast<If*>(x);
+            evaluate(m, m.val.isFalse() ? node->alter.get() : node->conseq.get());
+            return;
+        }
+        case K_BEGIN: {
+            Begin *b = static_cast<Begin*>(x);
+            if (f->index + 1 < b->es.size()) push(m, K_BEGIN, x, f->index + 1);
+            evaluate(m, b->es[f->index].get());
+            return;
+        }
+        case K_COND_TEST: {
+            Cond *cond = static_cast<Cond*>(x);
+            if (m.val.isFalse()) {
+                int next = f->index + 1;
+                if (next == cond->clauses.size()) {
+                    give(m, VoidV());
+                    return;
+                }
+                push(m, K_COND_TEST, x, next);
+                evaluate(m, cond->clauses[next][0].get());
+                return;
+            }
+            //a clause with only a test returns its value
+            if (cond->clauses[f->index].size() > 1) condBody(m, cond, f->index, 1);
+            return;
+        }
+        case K_COND_BODY:
+            condBody(m, static_cast<Cond*>(x), f->index, f->sub);
+            return;
+        case K_AND:
+        case K_OR: {
+            if (m.val.isFalse() == (f->type == K_AND)) return;   //decided: and got #f, or got a true value
+            const std::vector<Expr> &rands = f->type == K_AND ? static_cast<AndVar*>(x)->rands
+                                                               : static_cast<OrVar*>(x)->rands;
+            if (f->index + 1 < rands.size()) push(m, f->type, x, f->index + 1);
+            evaluate(m, rands[f->index].get());
+            return;
+        }
+        case K_APPLY:
+        case K_PRIM:
+        case K_LET:
+        case K_LETREC: {
+            std::vector<Value> vals(1, m.val);
+            Kont *prior = f->count > 0 ? f : f->prior;
+            if (evalOperands(m, f->type, x, f->sub, f->index + 1, prior, vals)) {
+                combine(m, f->type, x, f->sub, vals);
+            }
+            return;
+        }
+        case K_DEFINE: {
+            Define *define = static_cast<Define*>(x);
+            if (define->depth < 0) {
+                define->cell->v = m.val;
+            } else if (define->boxed) {
+                static_cast<Box*>(frameSlot(m.env, define->depth, define->slot).get())->v = m.val;
+            } else {
+                frameSlot(m.env, define->depth, define->slot) = m.val;
+            }
+            give(m, VoidV());
+            return;
+        }
+        case K_SET: {
+            Set *set = static_cast<Set*>(x);
+            Value *place = set->depth >= 0 ? &frameSlot(m.env, set->depth, set->slot) : &set->cell->v;
+            if (set->boxed) place = &static_cast<Box*>(place->get())->v;
+            *place = m.val;
+            give(m, VoidV());
+            return;
+        }
+    }
+}
+
+Value cekEval(const Expr &x, Assoc &env) {
+    //top-level code is owned like a procedure body, since a continuation
+    //captured in it may be re-entered from a later form
+    Value top = ProcedureV(std::vector<SymbolId>(), x, env);
+    Machine m = {x.get(), env, top, Value(nullptr), nullptr, false};
+    while (true) {
+        if (!m.returning) {
+            enter(m);
+        } else if (m.k != nullptr) {
+            resume(m);
+        } else {
+            return m.val;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef CEK_HPP
+#define CEK_HPP
+
+/**
+ * @file cek.hpp
+ * @brief Explicit-stack CEK machine (--engine=cek)
+ *
+ * The machine state is the expression being evaluated (Control), its frame
+ * (Environment) and what to do with its value (Kontinuation). The
+ * continuation is a linked list of heap frames instead of the C++ stack, so
+ * non-tail recursion is only bounded by the heap, and call/cc captures it
+ * in O(1) by keeping a pointer to the current frame: frames are never
+ * modified after they are pushed.
+ */
+
+#include "Def.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+
+struct Kont;
+
+/**
+ * @brief Continuation captured by call/cc, applicable to one value
+ */
+struct Continuation : ValueBase {
+    Kont *k;    ///< Frames still to run, nullptr for the end of the top-level form
+    Continuation(Kont *);
+    virtual void show(std::ostream &) override;
+    virtual void trace() override;
+};
+
+/**
+ * @brief Native body of call/cc; only the CEK machine can capture a
+ * continuation, so calling it elsewhere is an error
+ */
+Value callWithCurrentContinuation(const std::vector<Value> &args);
+
+/**
+ * @brief Run x on the CEK machine
+ */
+Value cekEval(const Expr &x, Assoc &env);
+
+#endif // CEK_HPP
@@ -0,0 +1,507 @@
+/**
+ * @file closure.cpp
+ * @brief Closure-compilation engine implementation
+ *
+ * convert() turns every node into one of the functors below. Nodes that
+ * have a tail position implement step(), and runTail() loops over it, so
+ * tail calls run in constant C++ stack as with the tree walker. Compiled
+ * code is never freed: like the VM's chunks it grows with the source text,
+ * and a lambda's code keeps its source nodes alive.
+ */
+
+#include "closure.hpp"
+#include "RE.hpp"
+#include <vector>
+
+Compiled *Compiled::step(Assoc &env, Value &result) {
+    result = run(env);
+    return nullptr;
+}
+
+static Value runTail(Compiled *c, Assoc env) {
+    Value result(nullptr);
+    EnvRoot env_root(env);
+    ValueRoot result_root(result);
+    while (c != nullptr) {
+        c = c->step(env, result);
+    }
+    return result;
+}
+
+static Compiled *convert(ExprBase *x);
+
+static std::vector<Compiled*> convertAll(const std::vector<Expr> &xs) {
+    std::vector<Compiled*> cs;
+    for (int i = 0; i < xs.size(); i++) {
+        cs.push_back(convert(xs[i].get()));
+    }
+    return cs;
+}
+
+static void undefinedVariable(Var *var) {
+    throw RuntimeError("Undefined variable:" + symbolName(var->x));
+}
+
+// ============================================================================
+// Constants and variables
+// ============================================================================
+
+struct CConst : Compiled {
+    Value v;
+    CConst(const Value &v) : v(v) {}
+    Value run(Assoc &env) override { return v; }
+};
+
+// a node left to the tree walker
+struct CNode : Compiled {
+    ExprBase *node;
+    CNode(ExprBase *node) : node(node) {}
+    Value run(Assoc &env) override { return node->eval(env); }
+};
+
+// a local of the innermost frame, the most common reference
+struct CLocal0 : Compiled {
+    Var *var;
+    CLocal0(Var *var) : var(var) {}
+    Value run(Assoc &env) override {
+        Value v = env->slots[var->slot];
+        if (v.empty()) undefinedVariable(var);
+        return v;
+    }
+};
+
+struct CLocal : Compiled {
+    Var *var;
+    CLocal(Var *var) : var(var) {}
+    Value run(Assoc &env) override {
+        Value v = frameSlot(env, var->depth, var->slot);
+        if (var->boxed) v = static_cast<Box*>(v.get())->v;
+        if (v.empty()) undefinedVariable(var);
+        return v;
+    }
+};
+
+struct CGlobal : Compiled {
+    Var *var;
+    CGlobal(Var *var) : var(var) {}
+    Value run(Assoc &env) override {
+        Value v = var->cell->v;
+        if (v.empty()) {
+            if (var->prim == nullptr) undefinedVariable(var);
+            return Value(var->prim);
+        }
+        return v;
+    }
+};
+
+// ============================================================================
+// Control flow
+// ============================================================================
+
+struct CIf : Compiled {
+    Compiled *cond, *conseq, *alter;
+    CIf(Compiled *c, Compiled *t, Compiled *e) : cond(c), conseq(t), alter(e) {}
+    Value run(Assoc &env) override { return runTail(this, env); }
+    Compiled *step(Assoc &env, Value &result) override {
+        return cond->run(env).isFalse() ? alter : conseq;
+    }
+};
+
+// a non-empty begin
+struct CBegin : Compiled {
+    std::vector<Compiled*> es;
+    CBegin(const std::vector<Compiled*> &es) : es(es) {}
+    Value run(Assoc &env) override { return runTail(this, env); }
+    Compiled *step(Assoc &env, Value &result) override {
+        for (int i = 0; i + 1 < es.size(); i++) {
+            es[i]->run(env);
+        }
+        return es.back();
+    }
+};
+
+struct CCond : Compiled {
+    std::vector<std::vector<Compiled*>> clauses;
+    CCond(const std::vector<std::vector<Compiled*>> &clauses) : clauses(clauses) {}
+    Value run(Assoc &env) override { return runTail(this, env); }
+    Compiled *step(Assoc &env, Value &result) override {
+        for (int k = 0; k < clauses.size(); k++) {
+            const std::vector<Compiled*> &clause = clauses[k];
+            Value test = clause[0]->run(env);
+            if (test.isFalse()) continue;
+            if (clause.size() == 1) {
+                result = test;
+                return nullptr;
+            }
+            for (int i = 1; i + 1 < clause.size(); i++) {
+                clause[i]->run(env);
+            }
+            return clause.back();
+        }
+        result = VoidV();
+        return nullptr;
+    }
+};
+
+// a non-empty and (or, when is_and is false)
+struct CAndOr : Compiled {
+    bool is_and;
+    std::vector<Compiled*> rands;
+    CAndOr(bool is_and, const std::vector<Compiled*> &rands) : is_and(is_and), rands(rands) {}
+    Value run(Assoc &env) override { return runTail(this, env); }
+    Compiled *step(Assoc &env, Value &result) override {
+        for (int i = 0; i + 1 < rands.size(); i++) {
+            Value v = rands[i]->run(env);
+            if (v.isFalse() == is_and) {
+                result = v;
+                return nullptr;
+            }
+        }
+        return rands.back();
+    }
+};
+
+// ============================================================================
+// Procedures
+// ============================================================================
+
+struct CLambda : Compiled {
+    Lambda *node;
+    Compiled *body;
+    Expr source;    ///< Keeps the nodes the body points to alive
+    CLambda(Lambda *node, const Expr &source) : node(node), body(convert(node->e.get())), source(source) {}
+    Value run(Assoc &env) override {
+        Value closure = node->eval(env);
+        static_cast<Procedure*>(closure.get())->compiled = body;
+        return closure;
+    }
+};
+
+struct CApply : Compiled {
+    Compiled *rator;
+    std::vector<Compiled*> rands;
+    CApply(Compiled *rator, const std::vector<Compiled*> &rands) : rator(rator), rands(rands) {}
+    Value run(Assoc &env) override { return runTail(this, env); }
+    Compiled *step(Assoc &env, Value &result) override {
+        Value f = rator->run(env);
+        ValueRoot f_root(f);
+        if (f.type() == V_PRIMITIVE) {
+            Primitive *prim = static_cast<Primitive*>(f.get());
+            std::vector<Value> args;
+            VectorRoot args_root(args);
+            for (int i = 0; i < rands.size(); i++) {
+                args.push_back(rands[i]->run(env));
+            }
+            if (prim->arity >= 0 && args.size() != prim->arity) throw RuntimeError("Wrong number of arguments");
+            result = prim->fn(args);
+            return nullptr;
+        }
+        if (f.type() != V_PROC) throw RuntimeError("Attempt to apply a non-procedure");
+        //the arguments go straight into the callee's frame
+        Procedure *clos = static_cast<Procedure*>(f.get());
+        Assoc frame = extend(rands.size(), clos->env);
+        EnvRoot frame_root(frame);
+        for (int i = 0; i < rands.size(); i++) {
+            frame->slots[i] = rands[i]->run(env);
+        }
+        if (rands.size() != clos->parameters.size()) throw RuntimeError("Wrong number of arguments");
+        for (int i = 0; i < clos->boxed.size(); i++) {
+            if (clos->boxed[i]) frame->slots[i] = BoxV(frame->slots[i]);
+        }
+        if (clos->compiled == nullptr) {//made by the tree walker
+            result = trampoline(clos->e.get(), frame);
+            return nullptr;
+        }
+        env = frame;
+        gcSafePoint(env);
+        return clos->compiled;
+    }
+};
+
+// ============================================================================
+// Definitions and bindings
+// ============================================================================
+
+// define or set! of a local; set! first checks that it is bound
+struct CAssignLocal : Compiled {
+    int depth, slot;
+    bool boxed, is_set;
+    Compiled *e;
+    CAssignLocal(int depth, int slot, bool boxed, bool is_set, Compiled *e)
+        : depth(depth), slot(slot), boxed(boxed), is_set(is_set), e(e) {}
+    Value run(Assoc &env) override {
+        Value *place = &frameSlot(env, depth, slot);
+        if (boxed) place = &static_cast<Box*>(place->get())->v;
+        if (is_set && place->empty()) throw RuntimeError("Unbound variable in set!");
+        *place = e->run(env);
+        return VoidV();
+    }
+};
+
+struct CAssignGlobal : Compiled {
+    GlobalCell *cell;
+    bool is_set;
+    Compiled *e;
+    CAssignGlobal(GlobalCell *cell, bool is_set, Compiled *e) : cell(cell), is_set(is_set), e(e) {}
+    Value run(Assoc &env) override {
+        if (is_set && cell->v.empty()) throw RuntimeError("Unbound variable in set!");
+        Value value = e->run(env);
+        cell->v = value;
+        return VoidV();
+    }
+};
+
+struct CLet : Compiled {
+    Let *node;
+    std::vector<Compiled*> inits;
+    Compiled *body;
+    CLet(Let *node) : node(node), body(convert(node->body.get())) {
+        for (int i = 0; i < node->bind.size(); i++) {
+            inits.push_back(convert(node->bind[i].second.get()));
+        }
+    }
+    Value run(Assoc &env) override { return runTail(this, env); }
+    Compiled *step(Assoc &env, Value &result) override {
+        Assoc frame = extend(inits.size(), env);
+        EnvRoot frame_root(frame);
+        for (int i = 0; i < inits.size(); i++) {
+            Value v = inits[i]->run(env);
+            frame->slots[i] = node->boxed[i] ? BoxV(v) : v;
+        }
+        env = frame;
+        return body;
+    }
+};
+
+struct CLetrec : Compiled {
+    Letrec *node;
+    std::vector<Compiled*> inits;
+    Compiled *body;
+    CLetrec(Letrec *node) : node(node), body(convert(node->body.get())) {
+        for (int i = 0; i < node->bind.size(); i++) {
+            inits.push_back(convert(node->bind[i].second.get()));
+        }
+    }
+    Value run(Assoc &env) override { return runTail(this, env); }
+    Compiled *step(Assoc &env, Value &result) override {
+        Assoc frame = extend(inits.size(), env);
+        EnvRoot frame_root(frame);
+        for (int i = 0; i < inits.size(); i++) {
+            if (node->boxed[i]) frame->slots[i] = BoxV(Value(nullptr));
+        }
+        std::vector<Value> values;
+        VectorRoot values_root(values);
+        for (int i = 0; i < inits.size(); i++) {
+            values.push_back(inits[i]->run(frame));
+        }
+        for (int i = 0; i < inits.size(); i++) {
+            if (node->boxed[i]) static_cast<Box*>(frame->slots[i].get())->v = values[i];
+            else frame->slots[i] = values[i];
+        }
+        env = frame;
+        return body;
+    }
+};
+
+// ============================================================================
+// Primitives
+// ============================================================================
+
+struct AddOp { static Value apply(int a, int b) { return IntegerV((long long)a + b); } };
+struct SubOp { static Value apply(int a, int b) { return IntegerV((long long)a - b); } };
+struct MulOp { static Value apply(int a, int b) { return IntegerV((long long)a * b); } };
+struct LtOp  { static Value apply(int a, int b) { return BooleanV(a < b); } };
+struct LeOp  { static Value apply(int a, int b) { return BooleanV(a <= b); } };
+struct EqOp  { static Value apply(int a, int b) { return BooleanV(a == b); } };
+struct GeOp  { static Value apply(int a, int b) { return BooleanV(a >= b); } };
+struct GtOp  { static Value apply(int a, int b) { return BooleanV(a > b); } };
+
+// binary arithmetic or comparison with a fixnum fast path
+template <class Op>
+struct CFixnumBinary : Compiled {
+    Binary *node;
+    Compiled *a, *b;
+    CFixnumBinary(Binary *node) : node(node), a(convert(node->rand1.get())), b(convert(node->rand2.get())) {}
+    Value run(Assoc &env) override {
+        Value x = a->run(env);
+        ValueRoot x_root(x);
+        Value y = b->run(env);
+        if (x.isFixnum() && y.isFixnum()) return Op::apply(x.fixnum(), y.fixnum());
+        return node->evalRator(x, y);
+    }
+};
+
+// car (or cdr) with a pair fast path
+template <bool is_car>
+struct CCarCdr : Compiled {
+    Unary *node;
+    Compiled *a;
+    CCarCdr(Unary *node) : node(node), a(convert(node->rand.get())) {}
+    Value run(Assoc &env) override {
+        Value v = a->run(env);
+        if (v.type() == V_PAIR) {
+            Pair *p = static_cast<Pair*>(v.get());
+            return is_car ? p->car : p->cdr;
+        }
+        return node->evalRator(v);
+    }
+};
+
+struct CNullQ : Compiled {
+    Compiled *a;
+    CNullQ(Unary *node) : a(convert(node->rand.get())) {}
+    Value run(Assoc &env) override { return BooleanV(a->run(env).isNull()); }
+};
+
+struct CUnary : Compiled {
+    Unary *node;
+    Compiled *a;
+    CUnary(Unary *node) : node(node), a(convert(node->rand.get())) {}
+    Value run(Assoc &env) override { return node->evalRator(a->run(env)); }
+};
+
+struct CBinary : Compiled {
+    Binary *node;
+    Compiled *a, *b;
+    CBinary(Binary *node) : node(node), a(convert(node->rand1.get())), b(convert(node->rand2.get())) {}
+    Value run(Assoc &env) override {
+        Value x = a->run(env);
+        ValueRoot x_root(x);
+        Value y = b->run(env);
+        return node->evalRator(x, y);
+    }
+};
+
+struct CVariadic : Compiled {
+    Variadic *node;
+    std::vector<Compiled*> rands;
+    CVariadic(Variadic *node) : node(node), rands(convertAll(node->rands)) {}
+    Value run(Assoc &env) override {
+        std::vector<Value> args;
+        VectorRoot args_root(args);
+        for (int i = 0; i < rands.size(); i++) {
+            args.push_back(rands[i]->run(env));
+        }
+        return node->evalRator(args);
+    }
+};
+
+static Compiled *convertPrimitive(ExprBase *x) {
+    if (Unary *unary = dynamic_cast<Unary*>(x)) {
+        switch (x->e_type) {
+            case E_CAR:   return new CCarCdr<true>(unary);
+            case E_CDR:   return new CCarCdr<false>(unary);
+            case E_NULLQ: return new CNullQ(unary);
+            default:      return new CUnary(unary);
+        }
+    }
+    if (Binary *binary = dynamic_cast<Binary*>(x)) {
+        switch (x->e_type) {
+            case E_PLUS:  return new CFixnumBinary<AddOp>(binary);
+            case E_MINUS: return new CFixnumBinary<SubOp>(binary);
+            case E_MUL:   return new CFixnumBinary<MulOp>(binary);
+            case E_LT:    return new CFixnumBinary<LtOp>(binary);
+            case E_LE:    return new CFixnumBinary<LeOp>(binary);
+            case E_EQ:    return new CFixnumBinary<EqOp>(binary);
+            case E_GE:    return new CFixnumBinary<GeOp>(binary);
+            case E_GT:    return new CFixnumBinary<GtOp>(binary);
+            default:      return new CBinary(binary);
+        }
+    }
+    if (Variadic *variadic = dynamic_cast<Variadic*>(x)) {
+        return new CVariadic(variadic);
+    }
+    return new CNode(x);//quote, strings, rationals, exit
+}
+
+// ============================================================================
+// Conversion
+// ============================================================================
+
+static Compiled *convert(ExprBase *x) {
+    switch (x->e_type) {
+        case E_FIXNUM:
+            return new CConst(IntegerV(static_cast<Fixnum*>(x)->n));
+        case E_TRUE:
+            return new CConst(BooleanV(true));
+        case E_FALSE:
+            return new CConst(BooleanV(false));
+        case E_VOID:
+            return new CConst(VoidV());
+        case E_VAR: {
+            Var *var = static_cast<Var*>(x);
+            if (!validName(var->x)) return new CNode(x);
+            if (var->depth < 0) return new CGlobal(var);
+            if (var->depth == 0 && !var->boxed) return new CLocal0(var);
+            return new CLocal(var);
+        }
+        case E_BEGIN: {
+            Begin *begin = static_cast<Begin*>(x);
+            if (begin->es.empty()) return new CConst(VoidV());
+            if (begin->es.size() == 1) return convert(begin->es[0].get());
+            return new CBegin(convertAll(begin->es));
+        }
+        case E_IF: {
+            If *node = static_cast<If*>(x);
+            return new CIf(convert(node->cond.get()), convert(node->conseq.get()), convert(node->alter.get()));
+        }
+        case E_COND: {
+            Cond *node = static_cast<Cond*>(x);
+            std::vector<std::vector<Compiled*>> clauses;
+            for (int i = 0; i < node->clauses.size(); i++) {
+                clauses.push_back(convertAll(node->clauses[i]));
+            }
+            return new CCond(clauses);
+        }
+        case E_AND:
+        case E_OR: {
+            bool is_and = x->e_type == E_AND;
+            const std::vector<Expr> &rands = is_and ? static_cast<AndVar*>(x)->rands : static_cast<OrVar*>(x)->rands;
+            if (rands.empty()) return new CConst(BooleanV(is_and));
+            return new CAndOr(is_and, convertAll(rands));
+        }
+        case E_APPLY: {
+            Apply *apply = static_cast<Apply*>(x);
+            return new CApply(convert(apply->rator.get()), convertAll(apply->rand));
+        }
+        case E_LAMBDA: {
+            Lambda *lambda = static_cast<Lambda*>(x);
+            return new CLambda(lambda, lambda->e);
+        }
+        case E_DEFINE: {
+            Define *define = static_cast<Define*>(x);
+            if (!validName(define->var)) return new CNode(x);
+            if (define->depth >= 0) {
+                return new CAssignLocal(define->depth, define->slot, define->boxed, false, convert(define->e.get()));
+            }
+            return new CAssignGlobal(define->cell, false, convert(define->e.get()));
+        }
+        case E_SET: {
+            Set *set = static_cast<Set*>(x);
+            if (set->depth >= 0) {
+                return new CAssignLocal(set->depth, set->slot, set->boxed, true, convert(set->e.get()));
+            }
+            return new CAssignGlobal(set->cell, true, convert(set->e.get()));
+        }
+        case E_LET: {
+            Let *let = static_cast<Let*>(x);
+            for (int i = 0; i < let->bind.size(); i++) {
+                if (!validName(let->bind[i].first)) return new CNode(x);
+            }
+            return new CLet(let);
+        }
+        case E_LETREC: {
+            Letrec *letrec = static_cast<Letrec*>(x);
+            for (int i = 0; i < letrec->bind.size(); i++) {
+                if (!validName(letrec->bind[i].first)) return new CNode(x);
+            }
+            return new CLetrec(letrec);
+        }
+        default:
+            return convertPrimitive(x);
+    }
+}
+
+Value closureEval(const Expr &x, Assoc &env) {
+    return convert(x.get())->run(env);
+}
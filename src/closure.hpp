@@ -0,0 +1,37 @@
+#ifndef CLOSURE_HPP
+#define CLOSURE_HPP
+
+/**
+ * @file closure.hpp
+ * @brief Closure-compilation engine (--engine=closure)
+ *
+ * Each Expr node is converted once into a functor object specialized for
+ * what it does: children are already converted, variables already point to
+ * their slot or global cell, and primitives to their evaluator. Running the
+ * program is then a chain of virtual calls with no further inspection of
+ * node types, clause lists or binding lists.
+ */
+
+#include "Def.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+
+/**
+ * @brief Pre-bound code for one expression
+ */
+struct Compiled {
+    virtual Value run(Assoc &env) = 0;
+    /**
+     * @brief As ExprBase::step: evaluate up to the code in tail position
+     * and return it, or nullptr with the value in result
+     */
+    virtual Compiled *step(Assoc &env, Value &result);
+    virtual ~Compiled() = default;
+};
+
+/**
+ * @brief Convert x into pre-bound code and run it
+ */
+Value closureEval(const Expr &x, Assoc &env);
+
+#endif // CLOSURE_HPP
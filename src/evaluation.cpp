@@ -11,29 +11,41 @@
 #include "value.hpp"
 #include "expr.hpp" 
 #include "RE.hpp"
+#include "jit.hpp"
 #include "syntax.hpp"
+#include "cek.hpp"
 #include <cstring>
 #include <vector>
 #include <map>
 #include <climits>
+#include <cmath>
 
 extern std::map<std::string, ExprType> primitives;
 extern std::map<std::string, ExprType> reserved_words;
+extern std::map<std::string, ExprType> native_procedures;
 
 
 Value Fixnum::eval(Assoc &e) { // evaluation of a fixnum
     return IntegerV(n);
 }
 
+Value BignumNum::eval(Assoc &e) { // evaluation of a bignum
+    return value.get();
+}
+
+Value FlonumNum::eval(Assoc &e) { // evaluation of a flonum
+    return value.get();
+}
+
 Value RationalNum::eval(Assoc &e) { // evaluation of a rational number
-    if (denominator == 0) {
+    if (denominator.isZero()) {
         throw RuntimeError("Denominator cannot be zero");
     }
-    return RationalV(numerator, denominator);
+    return value.get();
 }
 
 Value StringExpr::eval(Assoc &e) { // evaluation of a string
-    return StringV(s);
+    return value.get();
 }
 
 Value True::eval(Assoc &e) { // evaluation of #t
@@ -44,6 +56,22 @@ Value False::eval(Assoc &e) { // evaluation of #f
     return BooleanV(false);
 }
 
+ExprBase *ExprBase::step(Assoc &env, Value &result) {
+    result = eval(env);
+    return nullptr;
+}
+
+Value trampoline(ExprBase *x, Assoc env) {
+    FrameScope frames;
+    Value result(nullptr);
+    EnvRoot env_root(env);
+    ValueRoot result_root(result);
+    while (x != nullptr) {
+        x = x->step(env, result);
+    }
+    return result;
+}
+
 Value MakeVoid::eval(Assoc &e) { // (void)
     return VoidV();
 }
@@ -57,12 +85,17 @@ Value Unary::eval(Assoc &e) { // evaluation of single-operator primitive
 }
 
 Value Binary::eval(Assoc &e) { // evaluation of two-operators primitive
-    return evalRator(rand1->eval(e), rand2->eval(e));
+    //left to right, like Apply and Variadic (argument order in C++ is unspecified)
+    Value v1 = rand1->eval(e);
+    ValueRoot v1_root(v1);
+    Value v2 = rand2->eval(e);
+    return evalRator(v1, v2);
 }
 
 Value Variadic::eval(Assoc &e) { // evaluation of multi-operator primitive
     //TO COMPLETE THE VARIADIC CLASS
     std::vector<Value> evaled_rands;
+    VectorRoot rands_root(evaled_rands);
     for (int i = 0; i < rands.size(); i++) {
         evaled_rands.push_back(rands[i]->eval(e));
     }
@@ -93,6 +126,132 @@ void checkName(const std::string &x){
         }
     }
 }
+//checkName cached by symbol id, so every name is validated only once
+bool validName(SymbolId x){
+    static std::vector<signed char> valid;  // -1 unknown, 0 invalid, 1 valid
+    if (x >= (SymbolId)valid.size()) valid.resize(x + 1, -1);
+    if (valid[x] == -1) {
+        try {
+            checkName(symbolName(x));
+            valid[x] = 1;
+        } catch (const RuntimeError &) {
+            valid[x] = 0;
+        }
+    }
+    return valid[x] == 1;
+}
+
+void checkName(SymbolId x){
+    if (!validName(x)) {
+        throw RuntimeError("Invalid variable name");
+    }
+}
+//native bodies of the primitive procedures: the evaluators of the expression nodes
+template <class Node>
+static Value unaryPrimitive(const std::vector<Value> &args) {
+    static Node node(Expr(nullptr));
+    return node.evalRator(args[0]);
+}
+
+template <class Node>
+static Value binaryPrimitive(const std::vector<Value> &args) {
+    static Node node(Expr(nullptr), Expr(nullptr));
+    return node.evalRator(args[0], args[1]);
+}
+
+template <class Node>
+static Value variadicPrimitive(const std::vector<Value> &args) {
+    static Node node(std::vector<Expr>{});
+    return node.evalRator(args);
+}
+
+static Value voidPrimitive(const std::vector<Value> &args) {
+    return VoidV();
+}
+
+static Value exitPrimitive(const std::vector<Value> &args) {
+    return TerminateV();
+}
+
+static Value andPrimitive(const std::vector<Value> &args) {
+    Value result = BooleanV(true);
+    for (int i = 0; i < args.size(); i++) {
+        if (args[i].isFalse()) return BooleanV(false);
+        result = args[i];
+    }
+    return result;
+}
+
+static Value orPrimitive(const std::vector<Value> &args) {
+    for (int i = 0; i < args.size(); i++) {
+        if (!args[i].isFalse()) return args[i];
+    }
+    return BooleanV(false);
+}
+
+Value primitiveProcedure(SymbolId x) {
+    static std::map<ExprType, std::pair<Primitive::Function, int>> natives = {
+        {E_VOID,     {voidPrimitive, 0}},
+        {E_EXIT,     {exitPrimitive, 0}},
+        {E_CALLCC,   {callWithCurrentContinuation, 1}},
+        {E_BOOLQ,    {unaryPrimitive<IsBoolean>, 1}},
+        {E_INTQ,     {unaryPrimitive<IsFixnum>, 1}},
+        {E_NULLQ,    {unaryPrimitive<IsNull>, 1}},
+        {E_PAIRQ,    {unaryPrimitive<IsPair>, 1}},
+        {E_PROCQ,    {unaryPrimitive<IsProcedure>, 1}},
+        {E_SYMBOLQ,  {unaryPrimitive<IsSymbol>, 1}},
+        {E_LISTQ,    {unaryPrimitive<IsList>, 1}},
+        {E_STRINGQ,  {unaryPrimitive<IsString>, 1}},
+        {E_DISPLAY,  {unaryPrimitive<Display>, 1}},
+        {E_PLUS,     {variadicPrimitive<PlusVar>, -1}},
+        {E_MINUS,    {variadicPrimitive<MinusVar>, -1}},
+        {E_MUL,      {variadicPrimitive<MultVar>, -1}},
+        {E_DIV,      {variadicPrimitive<DivVar>, -1}},
+        {E_MODULO,   {binaryPrimitive<Modulo>, 2}},
+        {E_EXPT,     {binaryPrimitive<Expt>, 2}},
+        {E_EXACT_TO_INEXACT, {unaryPrimitive<ExactToInexact>, 1}},
+        {E_INEXACT_TO_EXACT, {unaryPrimitive<InexactToExact>, 1}},
+        {E_EQQ,      {binaryPrimitive<IsEq>, 2}},
+        {E_LT,       {variadicPrimitive<LessVar>, -1}},
+        {E_LE,       {variadicPrimitive<LessEqVar>, -1}},
+        {E_EQ,       {variadicPrimitive<EqualVar>, -1}},
+        {E_GE,       {variadicPrimitive<GreaterEqVar>, -1}},
+        {E_GT,       {variadicPrimitive<GreaterVar>, -1}},
+        {E_CONS,     {binaryPrimitive<Cons>, 2}},
+        {E_CAR,      {unaryPrimitive<Car>, 1}},
+        {E_CDR,      {unaryPrimitive<Cdr>, 1}},
+        {E_LIST,     {variadicPrimitive<ListFunc>, -1}},
+        {E_SETCAR,   {binaryPrimitive<SetCar>, 2}},
+        {E_SETCDR,   {binaryPrimitive<SetCdr>, 2}},
+        {E_NOT,      {unaryPrimitive<Not>, 1}},
+        {E_AND,      {andPrimitive, -1}},
+        {E_OR,       {orPrimitive, -1}}
+    };
+    //one pinned instance per primitive name
+    static std::map<SymbolId, Value> instances;
+    auto found = instances.find(x);
+    if (found != instances.end()) {
+        return found->second;
+    }
+    Value result(nullptr);
+    const std::string &name = symbolName(x);
+    auto op = primitives.find(name);
+    bool known = op != primitives.end();
+    if (!known) {
+        op = native_procedures.find(name);
+        known = op != native_procedures.end();
+    }
+    if (known) {
+        auto it = natives.find(op->second);
+        if (it != natives.end()) {
+            result = PrimitiveV(it->second.first, it->second.second);
+            gcPin(result.get());
+        }
+    }
+    instances.emplace(x, result);
+    return result;
+}
+
 Value Var::eval(Assoc &e) { // evaluation of variable
     //TO identify the invalid variable
     //We request all valid variable just need to be a symbol,you should promise:
@@ -103,148 +262,257 @@ Value Var::eval(Assoc &e) { // evaluation of variable
     //When a variable is not defined in the current scope, your interpreter should output RuntimeError
     checkName(x);
 
-    Value matched_value = find(x, e);
-    if (matched_value.get() == nullptr) {//no binding found
-        if (primitives.count(x)) {
-             static std::map<ExprType, std::pair<Expr, std::vector<std::string>>> primitive_map = {
-                    {E_VOID,     {Expr(new MakeVoid()), {}}},
-                    {E_EXIT,     {Expr(new Exit()), {}}},
-                    {E_BOOLQ,    {Expr(new IsBoolean(Expr(new Var("parm")))), {"parm"}}},//parameters of procedure is a vector of string(name)
-                    {E_INTQ,     {Expr(new IsFixnum(Expr(new Var("parm")))), {"parm"}}},
-                    {E_NULLQ,    {Expr(new IsNull(Expr(new Var("parm")))), {"parm"}}},
-                    {E_PAIRQ,    {Expr(new IsPair(Expr(new Var("parm")))), {"parm"}}},
-                    {E_PROCQ,    {Expr(new IsProcedure(Expr(new Var("parm")))), {"parm"}}},
-                    {E_SYMBOLQ,  {Expr(new IsSymbol(Expr(new Var("parm")))), {"parm"}}},
-                    {E_LISTQ,    {Expr(new IsList(Expr(new Var("parm")))), {"parm"}}},
-                    {E_STRINGQ,  {Expr(new IsString(Expr(new Var("parm")))), {"parm"}}},
-                    {E_DISPLAY,  {Expr(new Display(Expr(new Var("parm")))), {"parm"}}},
-                    {E_PLUS,     {Expr(new PlusVar({})), {}}},//varnode in apply
-                    {E_MINUS,    {Expr(new MinusVar({})), {}}},
-                    {E_MUL,      {Expr(new MultVar({})), {}}},
-                    {E_DIV,      {Expr(new DivVar({})), {}}},
-                    {E_MODULO,   {Expr(new Modulo(Expr(new Var("parm1")), Expr(new Var("parm2")))), {"parm1","parm2"}}},
-                    {E_EXPT,     {Expr(new Expt(Expr(new Var("parm1")), Expr(new Var("parm2")))), {"parm1","parm2"}}},
-                    {E_EQQ,      {Expr(new EqualVar({})), {}}},
-                    {E_LT,       {Expr(new LessVar({})), {}}},
-                    {E_LE,       {Expr(new LessEqVar({})), {}}},
-                    {E_EQ,       {Expr(new EqualVar({})), {}}},
-                    {E_GE,       {Expr(new GreaterEqVar({})), {}}},
-                    {E_GT,       {Expr(new GreaterVar({})), {}}},
-                    {E_CONS,     {Expr(new Cons(Expr(new Var("parm1")), Expr(new Var("parm2")))), {"parm1","parm2"}}},
-                    {E_CAR,      {Expr(new Car(Expr(new Var("parm")))), {"parm"}}},
-                    {E_CDR,      {Expr(new Cdr(Expr(new Var("parm")))), {"parm"}}},
-                    {E_LIST,     {Expr(new ListFunc({})), {}}},
-                    {E_SETCAR,   {Expr(new SetCar(Expr(new Var("parm1")), Expr(new Var("parm2")))), {"parm1","parm2"}}},
-                    {E_SETCDR,   {Expr(new SetCdr(Expr(new Var("parm1")), Expr(new Var("parm2")))), {"parm1","parm2"}}},
-                    {E_NOT,      {Expr(new Not(Expr(new Var("parm")))), {"parm"}}},
-                    {E_AND,      {Expr(new AndVar({})), {}}},
-                    {E_OR,       {Expr(new OrVar({})), {}}}
-            };
-            auto it = primitive_map.find(primitives[x]);
-            //to PASS THE parameters correctly;
-            //COMPLETE THE CODE WITH THE HINT IN IF SENTENCE WITH CORRECT RETURN VALUE
-            if (it != primitive_map.end()) {
-                return ProcedureV(it->second.second, it->second.first, e);
-            }
-      }
-      throw RuntimeError("Undefined variable:" +  x);
+    Value matched_value = depth >= 0 ? frameSlot(e, depth, slot) : cell->v;
+    if (boxed) matched_value = static_cast<Box*>(matched_value.get())->v;
+    if (matched_value.empty()) {//no binding found
+        if (prim != nullptr) {//a primitive used as a value
+            return Value(prim);
+        }
+        throw RuntimeError("Undefined variable:" +  symbolName(x));
     }
     return matched_value;
 }
 
+// ============================================================================
+// Exact arithmetic
+// ============================================================================
+//Sums, differences and products of exact numbers stay in long longs: the
+//gcds are taken before multiplying (Knuth 4.5.1), so the intermediates are
+//no larger than the result needs, and an overflow moves the operation to
+//BigInt. A denominator of 1 makes the result an integer again.
+
+//a * b into result, false on overflow
+static bool mulChecked(long long a, long long b, long long &result) {
+#if defined(__GNUC__)
+    return !__builtin_mul_overflow(a, b, &result) && result != LLONG_MIN;
+#else
+    if (a != 0 && (b > LLONG_MAX / (a < 0 ? -a : a) || b < -(LLONG_MAX / (a < 0 ? -a : a)))) return false;
+    result = a * b;
+    return true;
+#endif
+}
+
+//a + b into result, false on overflow; both are above LLONG_MIN
+static bool addChecked(long long a, long long b, long long &result) {
+    if ((b > 0 && a > LLONG_MAX - b) || (b < 0 && a < -LLONG_MAX - b)) return false;
+    result = a + b;
+    return true;
+}
+
+static long long gcdSmall(long long a, long long b) {
+    return (long long)binaryGcd(a < 0 ? -a : a, b < 0 ? -b : b);
+}
+
+//numerator and denominator of an exact number in long longs, false if v is none or too large
+static bool smallParts(const Value &v, long long &num, long long &den) {
+    if (v.isFixnum()) {
+        num = v.fixnum();
+        den = 1;
+        return true;
+    }
+    if (v.type() == V_RATIONAL) {
+        Rational *r = static_cast<Rational*>(v.get());
+        if (r->big) return false;
+        num = r->numerator;
+        den = r->denominator;
+        return true;
+    }
+    return false;
+}
+
+//numerator and denominator of an exact number, false if v is none
+static bool exactParts(const Value &v, BigInt &num, BigInt &den) {
+    if (isInteger(v)) {
+        num = integerValue(v);
+        den = BigInt(1);
+        return true;
+    }
+    if (v.type() == V_RATIONAL) {
+        Rational *r = static_cast<Rational*>(v.get());
+        num = r->big ? r->big_numerator : BigInt(r->numerator);
+        den = r->big ? r->big_denominator : BigInt(r->denominator);
+        return true;
+    }
+    return false;
+}
+
+//num/den already in lowest terms, den positive
+static Value exactResult(long long num, long long den) {
+    return den == 1 ? IntegerV(num) : Value(new Rational(num, den));
+}
+
+static Value exactResult(const BigInt &num, const BigInt &den) {
+    return compare(den, BigInt(1)) == 0 ? IntegerV(num) : Value(new Rational(num, den));
+}
+
+static BigInt quotient(const BigInt &a, const BigInt &b) {
+    BigInt q, r;
+    divide(a, b, q, r);
+    return q;
+}
+
+//a/b + c/d
+static bool addSmall(long long a, long long b, long long c, long long d, Value &result) {
+    long long g = gcdSmall(b, d), t, u, num, den;
+    if (!mulChecked(a, d / g, t) || !mulChecked(c, b / g, u) || !addChecked(t, u, num)) return false;
+    long long g2 = gcdSmall(num, g);
+    if (!mulChecked(b / g, d / g2, den)) return false;
+    result = exactResult(num / g2, den);
+    return true;
+}
+
+//a/b * c/d
+static bool mulSmall(long long a, long long b, long long c, long long d, Value &result) {
+    long long g1 = gcdSmall(a, d), g2 = gcdSmall(c, b), num, den;
+    if (!mulChecked(a / g1, c / g2, num) || !mulChecked(b / g2, d / g1, den)) return false;
+    result = exactResult(num, den);
+    return true;
+}
+
+static Value addBig(const BigInt &a, const BigInt &b, const BigInt &c, const BigInt &d) {
+    BigInt g = gcd(b, d);
+    BigInt bg = quotient(b, g);
+    BigInt num = a * quotient(d, g) + c * bg;
+    BigInt g2 = gcd(num, g);
+    return exactResult(quotient(num, g2), bg * quotient(d, g2));
+}
+
+static Value mulBig(const BigInt &a, const BigInt &b, const BigInt &c, const BigInt &d) {
+    BigInt g1 = gcd(a, d), g2 = gcd(c, b);
+    return exactResult(quotient(a, g1) * quotient(c, g2), quotient(b, g2) * quotient(d, g1));
+}
+
+//x + y, or x - y, on exact numbers
+static Value addExact(const Value &x, const Value &y, bool subtract) {
+    long long a, b, c, d;
+    Value result(nullptr);
+    if (smallParts(x, a, b) && smallParts(y, c, d) && addSmall(a, b, subtract ? -c : c, d, result)) {
+        return result;
+    }
+    BigInt na, nb, nc, nd;
+    if (!exactParts(x, na, nb) || !exactParts(y, nc, nd)) {
+        throw(RuntimeError("Wrong typename"));
+    }
+    return addBig(na, nb, subtract ? -nc : nc, nd);
+}
+
+//x * y, or x / y, on exact numbers
+static Value mulExact(const Value &x, const Value &y, bool reciprocal) {
+    long long a, b, c, d;
+    Value result(nullptr);
+    if (smallParts(x, a, b) && smallParts(y, c, d)) {
+        if (reciprocal) {
+            if (c == 0) throw(RuntimeError("Division by zero"));
+            std::swap(c, d);
+            if (d < 0) {
+                c = -c;
+                d = -d;
+            }
+        }
+        if (mulSmall(a, b, c, d, result)) return result;
+    }
+    BigInt na, nb, nc, nd;
+    if (!exactParts(x, na, nb) || !exactParts(y, nc, nd)) {
+        throw(RuntimeError("Wrong typename"));
+    }
+    if (reciprocal) {
+        if (nc.isZero()) throw(RuntimeError("Division by zero"));
+        std::swap(nc, nd);
+        if (nd.negative) {
+            nc = -nc;
+            nd = -nd;
+        }
+    }
+    return mulBig(na, nb, nc, nd);
+}
+
+//the nearest double to a real number, for arithmetic mixing exact and inexact operands
+static double inexactValue(const Value &v) {
+    if (v.isFixnum()) return v.fixnum();
+    switch (v.type()) {
+        case V_FLONUM:
+            return flonumValue(v);
+        case V_BIGNUM:
+            return static_cast<Bignum*>(v.get())->n.toDouble();
+        case V_RATIONAL: {
+            Rational *r = static_cast<Rational*>(v.get());
+            if (!r->big) return (double)r->numerator / r->denominator;
+            //scale to a quotient of about 64 bits so neither part overflows a double
+            int shift = 64 + (int)r->big_denominator.bitLength() - (int)r->big_numerator.bitLength();
+            BigInt scale = power(BigInt(2), shift < 0 ? -shift : shift);
+            BigInt q = shift < 0 ? quotient(r->big_numerator, r->big_denominator * scale)
+                                 : quotient(r->big_numerator * scale, r->big_denominator);
+            return std::ldexp(q.toDouble(), -shift);
+        }
+        default:
+            throw(RuntimeError("Wrong typename"));
+    }
+}
+
+//x + y or x - y: inexact if either operand is, exact otherwise
+static Value addNumbers(const Value &x, const Value &y, bool subtract) {
+    if (x.type() == V_FLONUM || y.type() == V_FLONUM) {
+        double a = inexactValue(x), b = inexactValue(y);
+        return FlonumV(subtract ? a - b : a + b);
+    }
+    return addExact(x, y, subtract);
+}
+
+//x * y or x / y: inexact if either operand is, exact otherwise
+static Value mulNumbers(const Value &x, const Value &y, bool reciprocal) {
+    if (x.type() == V_FLONUM || y.type() == V_FLONUM) {
+        double a = inexactValue(x), b = inexactValue(y);
+        return FlonumV(reciprocal ? a / b : a * b);
+    }
+    return mulExact(x, y, reciprocal);
+}
+
 Value Plus::evalRator(const Value &rand1, const Value &rand2) { // +
     //To complete the addition logic
     //put dynamic_cast inside if, then will be executed only twice
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT){
-        int n1 = dynamic_cast<Integer*>(rand1.get())->n;
-        int n2 = dynamic_cast<Integer*>(rand2.get())->n;
-        int result = n1 + n2;
+    if (rand1.type() == V_INT && rand2.type() == V_INT){
+        //an int sum cannot overflow a long long; IntegerV promotes it if needed
+        long long result = (long long)rand1.fixnum() + rand2.fixnum();
         return IntegerV(result);
-    }else if (rand1->v_type == V_RATIONAL && rand2->v_type == V_RATIONAL){
-        auto p1= dynamic_cast<Rational*>(rand1.get());
-        auto p2 = dynamic_cast<Rational*>(rand2.get());
-        int num = p1->numerator * p2->denominator + p2->numerator * p1->denominator;
-        int den = p1->denominator * p2->denominator;
-        return RationalV(num, den);
-    }else if (rand1->v_type == V_INT && rand2->v_type == V_RATIONAL){
-        auto p1 = dynamic_cast<Integer*>(rand1.get());
-        auto p2 = dynamic_cast<Rational*>(rand2.get());
-        int num = p1->n * p2->denominator + p2->numerator;
-        int den = p2->denominator;
-        return RationalV(num, den);
-    }else if (rand1->v_type == V_RATIONAL && rand2->v_type == V_INT){
-        auto p1 = dynamic_cast<Rational*>(rand1.get());
-        auto p2 = dynamic_cast<Integer*>(rand2.get());
-        int num = p1->numerator + p2->n * p1->denominator;
-        int den = p1->denominator;
-        return RationalV(num, den);
+    }else if (rand1.isFlonum() && rand2.isFlonum()){
+        return FlonumV(rand1.flonum() + rand2.flonum());
+    }else if (isInteger(rand1) && isInteger(rand2)){
+        return IntegerV(integerValue(rand1) + integerValue(rand2));
     }
-    throw(RuntimeError("Wrong typename"));
+    return addNumbers(rand1, rand2, false);
 }
 
 Value Minus::evalRator(const Value &rand1, const Value &rand2) { // -
     //To complete the substraction logic
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT){
-        int n1 = dynamic_cast<Integer*>(rand1.get())->n;
-        int n2 = dynamic_cast<Integer*>(rand2.get())->n;
-        int result = n1 - n2;
+    if (rand1.type() == V_INT && rand2.type() == V_INT){
+        long long result = (long long)rand1.fixnum() - rand2.fixnum();
         return IntegerV(result);
-    }else if (rand1->v_type == V_RATIONAL && rand2->v_type == V_RATIONAL){
-        auto p1 = dynamic_cast<Rational*>(rand1.get());
-        auto p2 = dynamic_cast<Rational*>(rand2.get());
-        int num = p1->numerator * p2->denominator - p2->numerator * p1->denominator;
-        int den = p1->denominator * p2->denominator;
-        return RationalV(num, den);
-    }else if (rand1->v_type == V_INT && rand2->v_type == V_RATIONAL){
-        auto p1 = dynamic_cast<Integer*>(rand1.get());
-        auto p2 = dynamic_cast<Rational*>(rand2.get());
-        int num = p1->n * p2->denominator - p2->numerator;
-        int den = p2->denominator;
-        return RationalV(num, den);
-    }else if (rand1->v_type == V_RATIONAL && rand2->v_type == V_INT){
-        auto p1 = dynamic_cast<Rational*>(rand1.get());
-        auto p2 = dynamic_cast<Integer*>(rand2.get());
-        int num = p1->numerator - p2->n * p1->denominator;
-        int den = p1->denominator;
-        return RationalV(num, den);
+    }else if (rand1.isFlonum() && rand2.isFlonum()){
+        return FlonumV(rand1.flonum() - rand2.flonum());
+    }else if (isInteger(rand1) && isInteger(rand2)){
+        return IntegerV(integerValue(rand1) - integerValue(rand2));
     }
-    throw(RuntimeError("Wrong typename"));
+    return addNumbers(rand1, rand2, true);
 }
 
 Value Mult::evalRator(const Value &rand1, const Value &rand2) { // *
     //To complete the Multiplication logic
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT){
-        int n1 = dynamic_cast<Integer*>(rand1.get())->n;
-        int n2 = dynamic_cast<Integer*>(rand2.get())->n;
-        int result = n1 * n2;
+    if (rand1.type() == V_INT && rand2.type() == V_INT){
+        long long result = (long long)rand1.fixnum() * rand2.fixnum();
         return IntegerV(result);
-    }else if (rand1->v_type == V_RATIONAL && rand2->v_type == V_RATIONAL){
-        auto p1 = dynamic_cast<Rational*>(rand1.get());
-        auto p2 = dynamic_cast<Rational*>(rand2.get());
-        int num = p1->numerator * p2->numerator;
-        int den = p1->denominator * p2->denominator;
-        return RationalV(num, den);
-    }else if (rand1->v_type == V_INT && rand2->v_type == V_RATIONAL){
-        auto p1 = dynamic_cast<Integer*>(rand1.get());
-        auto p2 = dynamic_cast<Rational*>(rand2.get());
-        int num = p1->n * p2->numerator;
-        int den = p2->denominator;
-        return RationalV(num, den);
-    }else if (rand1->v_type == V_RATIONAL && rand2->v_type == V_INT){
-        auto p1 = dynamic_cast<Rational*>(rand1.get());
-        auto p2 = dynamic_cast<Integer*>(rand2.get());
-        int num = p1->numerator * p2->n;
-        int den = p1->denominator;
-        return RationalV(num, den);
+    }else if (rand1.isFlonum() && rand2.isFlonum()){
+        return FlonumV(rand1.flonum() * rand2.flonum());
+    }else if (isInteger(rand1) && isInteger(rand2)){
+        return IntegerV(integerValue(rand1) * integerValue(rand2));
     }
-    throw(RuntimeError("Wrong typename"));
+    return mulNumbers(rand1, rand2, false);
 }
 
 Value Div::evalRator(const Value &rand1, const Value &rand2) { // /
     //To complete the division logic
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT){
-        int num = dynamic_cast<Integer*>(rand1.get())->n;
-        int den = dynamic_cast<Integer*>(rand2.get())->n;
+    if (rand1.type() == V_INT && rand2.type() == V_INT){
+        long long num = rand1.fixnum();
+        long long den = rand2.fixnum();
         if (den == 0){
             throw(RuntimeError("Division by zero"));
         }
@@ -253,255 +521,163 @@ Value Div::evalRator(const Value &rand1, const Value &rand2) { // /
         }else{
             return RationalV(num, den);
         }
-    }else if (rand1->v_type == V_RATIONAL && rand2->v_type == V_RATIONAL){
-        auto p1 = dynamic_cast<Rational*>(rand1.get());
-        auto p2 = dynamic_cast<Rational*>(rand2.get());
-        if (p2->numerator == 0){
-            throw(RuntimeError("Division by zero"));
-        }
-        int num = p1->numerator * p2->denominator;
-        int den = p1->denominator * p2->numerator;
-        if (num % den == 0){
-            return IntegerV(num / den);
-        }else{
-            return RationalV(num, den);
-        }
-    }else if (rand1->v_type == V_INT && rand2->v_type == V_RATIONAL){
-        auto p1 = dynamic_cast<Integer*>(rand1.get());
-        auto p2 = dynamic_cast<Rational*>(rand2.get());
-        if (p2->numerator == 0){
-            throw(RuntimeError("Division by zero"));
-        }
-        int num = p1->n * p2->denominator;
-        int den = p2->numerator;
-        if (num % den == 0){
-            return IntegerV(num / den);
-        }else{
-            return RationalV(num, den);
-        }
-    }else if (rand1->v_type == V_RATIONAL && rand2->v_type == V_INT){
-        auto p1 = dynamic_cast<Rational*>(rand1.get());
-        auto p2 = dynamic_cast<Integer*>(rand2.get());
-        if (p2->n == 0){
-            throw(RuntimeError("Division by zero"));
-        }
-        int num = p1->numerator;
-        int den = p1->denominator * p2->n;
-        if (num % den == 0){
-            return IntegerV(num / den);
-        }else{
-            return RationalV(num, den);
-        }
+    }else if (rand1.isFlonum() && rand2.isFlonum()){
+        return FlonumV(rand1.flonum() / rand2.flonum());
     }
-    throw(RuntimeError("Wrong typename"));
+    return mulNumbers(rand1, rand2, true);
 }
 
 Value Modulo::evalRator(const Value &rand1, const Value &rand2) { // modulo
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT) {
-        int dividend = dynamic_cast<Integer*>(rand1.get())->n;
-        int divisor = dynamic_cast<Integer*>(rand2.get())->n;
+    if (rand1.type() == V_INT && rand2.type() == V_INT) {
+        long long dividend = rand1.fixnum();
+        long long divisor = rand2.fixnum();
         if (divisor == 0) {
             throw(RuntimeError("Division by zero"));
         }
         return IntegerV(dividend % divisor);
     }
-    throw(RuntimeError("modulo is only defined for integers"));
-}
-
-// Helper function to calculate greatest common divisor//will this be included???and static
-static int gcd(int a, int b) {
-    if (a < 0) a = -a;
-    if (b < 0) b = -b;
-    while (b != 0) {
-        int temp = b;
-        b = a % b;
-        a = temp;
-    }
-    return a;
-}
-//helper function to transform args into rationals
-static std::vector<std::pair<int, int>> toRationals(const std::vector<Value> &args) {
-    std::vector<std::pair<int, int>> rationals;
-    for (const auto &arg : args) {
-        if (arg->v_type == V_INT) {
-            int n = dynamic_cast<Integer*>(arg.get())->n;
-            rationals.push_back({n, 1});
-        }else if (arg->v_type == V_RATIONAL) {
-            auto p = dynamic_cast<Rational*>(arg.get());
-            rationals.push_back({p->numerator, p->denominator});
-        }else {
-            throw(RuntimeError("Wrong typename"));
-        }
-    }
-    return rationals;
-}
-//helper function to do variadic arithmetics
-static std::pair<int, int> arithmeticVar(std::pair<int, int> r1, std::pair<int, int> r2, char op) {
-    switch(op) {
-        case '+': {
-            int num = r1.first * r2.second + r2.first * r1.second;
-            int den = r1.second * r2.second;
-            int g = gcd(num, den);
-            return {num / g, den / g};
-        }
-        case '-': {
-            int num = r1.first * r2.second - r2.first * r1.second;
-            int den = r1.second * r2.second;
-            int g = gcd(num, den);
-            return {num / g, den / g};
-        }
-        case '*': {
-            int num = r1.first * r2.first;
-            int den = r1.second * r2.second;
-            int g = gcd(num, den);
-            return {num / g, den / g};
-        }
-        case '/': {
-            if (r2.first == 0) {
-                throw(RuntimeError("Division by zero"));
-            }
-            int num = r1.first * r2.second;
-            int den = r1.second * r2.first;
-            int g = gcd(num, den);
-            return {num / g, den / g};
+    if (isInteger(rand1) && isInteger(rand2)) {
+        BigInt divisor = integerValue(rand2), quotient, remainder;
+        if (divisor.isZero()) {
+            throw(RuntimeError("Division by zero"));
         }
+        divide(integerValue(rand1), divisor, quotient, remainder);
+        return IntegerV(remainder);
     }
+    throw(RuntimeError("modulo is only defined for integers"));
 }
+
+//variadic arithmetic: the binary operation folded over the args
 Value PlusVar::evalRator(const std::vector<Value> &args) { // + with multiple args
-    //To complete the addition logic
-    if (args.empty()) {
-        return IntegerV(0);
-    }
-    std::vector<std::pair<int, int>> rationals = toRationals(args);
-    std::pair<int, int> result = rationals[0];
-    for (int i = 1; i < rationals.size(); ++i) {
-        result = arithmeticVar(result, rationals[i], '+');
-    }
-    if (result.second == 1) {
-        return IntegerV(result.first);
-    } else {
-        return RationalV(result.first, result.second);
+    Value result = IntegerV(0);
+    for (const auto &arg : args) {
+        result = addNumbers(result, arg, false);
     }
+    return result;
 }
 
 Value MinusVar::evalRator(const std::vector<Value> &args) { // - with multiple args
-    //To complete the substraction logic
-    std::vector<std::pair<int, int>> rationals = toRationals(args);
-    std::pair<int, int> result = rationals[0];
-    if (rationals.size() == 1){
-        result.first = 0 - result.first;
+    if (args.empty()) {
+        throw(RuntimeError("Wrong number of arguments for -"));
     }
-    for (int i = 1; i < rationals.size(); ++i) {
-        result = arithmeticVar(result, rationals[i], '-');
+    if (args.size() == 1) {
+        //0 - x would make (- 0.0) 0.0 rather than -0.0
+        if (args[0].type() == V_FLONUM) return FlonumV(-flonumValue(args[0]));
+        return addNumbers(IntegerV(0), args[0], true);
     }
-    if (result.second == 1) {
-        return IntegerV(result.first);
-    } else {
-        return RationalV(result.first, result.second);
+    Value result = args[0];
+    for (std::size_t i = 1; i < args.size(); ++i) {
+        result = addNumbers(result, args[i], true);
     }
+    return result;
 }
 
 Value MultVar::evalRator(const std::vector<Value> &args) { // * with multiple args
-    //To complete the multiplication logic
-    if (args.empty()) {
-        return IntegerV(1);
-    }
-    std::vector<std::pair<int, int>> rationals = toRationals(args);
-    std::pair<int, int> result = rationals[0];
-    for (int i = 1; i < rationals.size(); ++i) {
-        result = arithmeticVar(result, rationals[i], '*');
-    }
-    if (result.second == 1) {
-        return IntegerV(result.first);
-    } else {
-        return RationalV(result.first, result.second);
+    Value result = IntegerV(1);
+    for (const auto &arg : args) {
+        result = mulNumbers(result, arg, false);
     }
+    return result;
 }
 
 Value DivVar::evalRator(const std::vector<Value> &args) { // / with multiple args
-    //To complete the divisor logic
-    std::vector<std::pair<int, int>> rationals = toRationals(args);
-    std::pair<int, int> result = rationals[0];
-    if (rationals.size() == 1) {
-        if (result.first == 0) {
-            throw(RuntimeError("Division by zero"));
-        }
-        result = {result.second, result.first};
+    if (args.empty()) {
+        throw(RuntimeError("Wrong number of arguments for /"));
     }
-    for (int i = 1; i < rationals.size(); ++i) {
-        result = arithmeticVar(result, rationals[i], '/');
+    if (args.size() == 1) {
+        return mulNumbers(IntegerV(1), args[0], true);
     }
-    if (result.second == 1) {
-        return IntegerV(result.first);
-    } else {
-        return RationalV(result.first, result.second);
+    Value result = args[0];
+    for (std::size_t i = 1; i < args.size(); ++i) {
+        result = mulNumbers(result, args[i], true);
     }
+    return result;
 }
 
 Value Expt::evalRator(const Value &rand1, const Value &rand2) { // expt
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT) {
-        int base = dynamic_cast<Integer*>(rand1.get())->n;
-        int exponent = dynamic_cast<Integer*>(rand2.get())->n;
+    if (isInteger(rand1) && isInteger(rand2)) {
+        BigInt base = integerValue(rand1);
+        BigInt exponent = integerValue(rand2);
         
-        if (exponent < 0) {
+        if (exponent.negative) {
             throw(RuntimeError("Negative exponent not supported for integers"));
         }
-        if (base == 0 && exponent == 0) {
+        if (base.isZero() && exponent.isZero()) {
             throw(RuntimeError("0^0 is undefined"));
         }
+        if (!rand2.isFixnum()) {
+            throw(RuntimeError("Integer overflow in expt"));
+        }
         
-        long long result = 1;
-        long long b = base;
-        int exp = exponent;
-        
-        while (exp > 0) {
-            if (exp % 2 == 1) {
-                result *= b;
-                if (result > INT_MAX || result < INT_MIN) {
-                    throw(RuntimeError("Integer overflow in expt"));
+        if (rand1.isFixnum()) {//stay in a long long while the result fits a fixnum
+            long long result = 1;
+            long long b = rand1.fixnum();
+            int exp = rand2.fixnum();
+            bool overflow = false;
+            while (exp > 0 && !overflow) {
+                if (exp % 2 == 1) {
+                    result *= b;
+                    overflow = result > INT_MAX || result < INT_MIN;
                 }
-            }
-            b *= b;
-            if (b > INT_MAX || b < INT_MIN) {
-                if (exp > 1) {
-                    throw(RuntimeError("Integer overflow in expt"));
+                exp /= 2;
+                if (exp > 0) {
+                    b *= b;
+                    overflow = overflow || b > INT_MAX || b < INT_MIN;
                 }
             }
-            exp /= 2;
+            if (!overflow) return IntegerV((int)result);
         }
-        
-        return IntegerV((int)result);
+        return IntegerV(power(base, rand2.fixnum()));
+    }
+    if (rand1.type() == V_FLONUM || rand2.type() == V_FLONUM) {
+        return FlonumV(std::pow(inexactValue(rand1), inexactValue(rand2)));
     }
     throw(RuntimeError("Wrong typename"));
 }
 
+Value ExactToInexact::evalRator(const Value &rand) { // exact->inexact
+    if (rand.type() == V_FLONUM) return rand;
+    return FlonumV(inexactValue(rand));
+}
+
+Value InexactToExact::evalRator(const Value &rand) { // inexact->exact
+    if (rand.type() != V_FLONUM) {
+        inexactValue(rand);//just the type check
+        return rand;
+    }
+    double d = flonumValue(rand);
+    if (!std::isfinite(d)) {
+        throw(RuntimeError("inexact->exact: no exact value for an infinity or NaN"));
+    }
+    //d = mantissa * 2^exponent with a 53-bit integer mantissa
+    int exponent;
+    long long mantissa = (long long)std::ldexp(std::frexp(d, &exponent), 53);
+    exponent -= 53;
+    if (exponent >= 0) return IntegerV(BigInt(mantissa) * power(BigInt(2), exponent));
+    if (exponent > -63) return RationalV(mantissa, 1LL << -exponent);
+    return RationalV(BigInt(mantissa), power(BigInt(2), -exponent));
+}
+
 //A FUNCTION TO SIMPLIFY THE COMPARISON WITH INTEGER AND RATIONAL NUMBER
+//-1, 0 or 1; 2 if the operands are unordered, which only a NaN is
 int compareNumericValues(const Value &v1, const Value &v2) {
-    if (v1->v_type == V_INT && v2->v_type == V_INT) {
-        int n1 = dynamic_cast<Integer*>(v1.get())->n;
-        int n2 = dynamic_cast<Integer*>(v2.get())->n;
+    if (v1.type() == V_INT && v2.type() == V_INT) {
+        int n1 = v1.fixnum();
+        int n2 = v2.fixnum();
         return (n1 < n2) ? -1 : (n1 > n2) ? 1 : 0;
     }
-    else if (v1->v_type == V_RATIONAL && v2->v_type == V_INT) {
-        Rational* r1 = dynamic_cast<Rational*>(v1.get());
-        int n2 = dynamic_cast<Integer*>(v2.get())->n;
-        int left = r1->numerator;
-        int right = n2 * r1->denominator;
-        return (left < right) ? -1 : (left > right) ? 1 : 0;
+    if (v1.type() == V_FLONUM || v2.type() == V_FLONUM) {
+        double a = inexactValue(v1), b = inexactValue(v2);
+        return (a < b) ? -1 : (a > b) ? 1 : (a == b) ? 0 : 2;
     }
-    else if (v1->v_type == V_INT && v2->v_type == V_RATIONAL) {
-        int n1 = dynamic_cast<Integer*>(v1.get())->n;
-        Rational* r2 = dynamic_cast<Rational*>(v2.get());
-        int left = n1 * r2->denominator;
-        int right = r2->numerator;
+    //compare the cross products, denominators being positive
+    long long a, b, c, d, left, right;
+    if (smallParts(v1, a, b) && smallParts(v2, c, d) && mulChecked(a, d, left) && mulChecked(c, b, right)) {
         return (left < right) ? -1 : (left > right) ? 1 : 0;
     }
-    else if (v1->v_type == V_RATIONAL && v2->v_type == V_RATIONAL) {
-        Rational* r1 = dynamic_cast<Rational*>(v1.get());
-        Rational* r2 = dynamic_cast<Rational*>(v2.get());
-        int left = r1->numerator * r2->denominator;
-        int right = r2->numerator * r1->denominator;
-        return (left < right) ? -1 : (left > right) ? 1 : 0;
+    BigInt n1, d1, n2, d2;
+    if (exactParts(v1, n1, d1) && exactParts(v2, n2, d2)) {
+        return compare(n1 * d2, n2 * d1);
     }
     throw RuntimeError("Wrong typename in numeric comparison");
 }
@@ -576,7 +752,7 @@ Value LessEqVar::evalRator(const std::vector<Value> &args) { // <= with multiple
     //To complete the lesseq logic
     for (int i = 0; i < args.size() - 1; i++) {
         int compare = compareNumericValues(args[i], args[i + 1]);
-        if (compare == 1) {
+        if (compare != -1 && compare != 0) {
             return BooleanV(false);
         }
     }
@@ -598,7 +774,7 @@ Value GreaterEqVar::evalRator(const std::vector<Value> &args) { // >= with multi
     //To complete the greatereq logic
     for (int i = 0; i < args.size() - 1; i++) {
         int compare = compareNumericValues(args[i], args[i + 1]);
-        if (compare == -1) {
+        if (compare != 1 && compare != 0) {
             return BooleanV(false);
         }
     }
@@ -632,7 +808,7 @@ Value ListFunc::evalRator(const std::vector<Value> &args) { // list function
 
 Value IsList::evalRator(const Value &rand) { // list?
     //To complete the list? logic
-    if (rand->v_type == V_NULL) return BooleanV(true);
+    if (rand.type() == V_NULL) return BooleanV(true);
     if (auto p = dynamic_cast<Pair*>(rand.get())) {
         return evalRator(p->cdr);
     }
@@ -659,6 +835,7 @@ Value SetCar::evalRator(const Value &rand1, const Value &rand2) { // set-car!
     //To complete the set-car! logic
     auto p_pair = dynamic_cast<Pair*>(rand1.get());
     if (p_pair == nullptr) throw RuntimeError("Wrong typename");
+    if (p_pair->constant) throw RuntimeError("Cannot modify a literal constant");
     p_pair->car = rand2;
     return VoidV();
 }
@@ -667,283 +844,488 @@ Value SetCdr::evalRator(const Value &rand1, const Value &rand2) { // set-cdr!
    //To complete the set-cdr! logic
    auto p_pair = dynamic_cast<Pair*>(rand1.get());
    if (p_pair == nullptr) throw RuntimeError("Wrong typename");
+   if (p_pair->constant) throw RuntimeError("Cannot modify a literal constant");
    p_pair->cdr = rand2;
    return VoidV();
 }
 
 Value IsEq::evalRator(const Value &rand1, const Value &rand2) { // eq?
-    // 检查类型是否为 Integer
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT) {
-        return BooleanV((dynamic_cast<Integer*>(rand1.get())->n) == (dynamic_cast<Integer*>(rand2.get())->n));
-    }
-    // 检查类型是否为 Boolean
-    else if (rand1->v_type == V_BOOL && rand2->v_type == V_BOOL) {
-        return BooleanV((dynamic_cast<Boolean*>(rand1.get())->b) == (dynamic_cast<Boolean*>(rand2.get())->b));
-    }
-    // 检查类型是否为 Symbol
-    else if (rand1->v_type == V_SYM && rand2->v_type == V_SYM) {
-        return BooleanV((dynamic_cast<Symbol*>(rand1.get())->s) == (dynamic_cast<Symbol*>(rand2.get())->s));
-    }
-    // 检查类型是否为 Null 或 Void
-    else if ((rand1->v_type == V_NULL && rand2->v_type == V_NULL) ||
-             (rand1->v_type == V_VOID && rand2->v_type == V_VOID)) {
-        return BooleanV(true);
-    } else {
-        return BooleanV(rand1.get() == rand2.get());
-    }
+    // 整数、布尔值、空表、void 与符号都是立即数，直接比较标记字即可
+    return BooleanV(rand1.bits == rand2.bits);
 }
 
 Value IsBoolean::evalRator(const Value &rand) { // boolean?
-    return BooleanV(rand->v_type == V_BOOL);
+    return BooleanV(rand.type() == V_BOOL);
 }
 
 Value IsFixnum::evalRator(const Value &rand) { // number?
-    return BooleanV(rand->v_type == V_INT);
+    return BooleanV(isInteger(rand) || rand.type() == V_RATIONAL || rand.type() == V_FLONUM);
 }
 
 Value IsNull::evalRator(const Value &rand) { // null?
-    return BooleanV(rand->v_type == V_NULL);
+    return BooleanV(rand.type() == V_NULL);
 }
 
 Value IsPair::evalRator(const Value &rand) { // pair?
-    return BooleanV(rand->v_type == V_PAIR);
+    return BooleanV(rand.type() == V_PAIR);
 }
 
 Value IsProcedure::evalRator(const Value &rand) { // procedure?
-    return BooleanV(rand->v_type == V_PROC);
+    return BooleanV(rand.type() == V_PROC || rand.type() == V_PRIMITIVE || rand.type() == V_CONTINUATION);
 }
 
 Value IsSymbol::evalRator(const Value &rand) { // symbol?
-    return BooleanV(rand->v_type == V_SYM);
+    return BooleanV(rand.type() == V_SYM);
 }
 
 Value IsString::evalRator(const Value &rand) { // string?
-    return BooleanV(rand->v_type == V_STRING);
+    return BooleanV(rand.type() == V_STRING);
 }
 
 Value Begin::eval(Assoc &e) {
+    return trampoline(this, e);
+}
+
+ExprBase *Begin::step(Assoc &e, Value &result) {
     //To complete the begin logic
-    Value result = VoidV();
-    for (int i = 0; i < es.size(); i++) {
-        result = es[i]->eval(e);
+    if (es.empty()) {
+        result = VoidV();
+        return nullptr;
     }
-    return result;
+    for (int i = 0; i + 1 < es.size(); i++) {
+        es[i]->eval(e);
+    }
+    return es.back().get();
 }
 
 Value Quote::eval(Assoc& e) {
-    //To complete the quote logic
-    if (auto p = dynamic_cast<Number*>(s.get())) {
-        return IntegerV(p->n);
-    } else if (auto p = dynamic_cast<RationalSyntax*>(s.get())) {
-        return RationalV(p->numerator, p->denominator);
-    } else if (auto p = dynamic_cast<TrueSyntax*>(s.get())) {
-        return BooleanV(true);
-    } else if (auto p = dynamic_cast<FalseSyntax*>(s.get())) {
-        return BooleanV(false);
-    } else if (auto p = dynamic_cast<SymbolSyntax*>(s.get())) {
-        return SymbolV(p->s);
-    } else if (auto p = dynamic_cast<StringSyntax*>(s.get())) {
-        return StringV(p->s);
-    } else if (auto p = dynamic_cast<List*>(s.get())) {
-        Value pointer = NullV();
-        if(p->stxs.size()>=3){
-            Syntax dot = (p->stxs)[(p->stxs).size() - 2];
-            auto whetherdot = dynamic_cast<SymbolSyntax*>(dot.get());
-            if(whetherdot != nullptr && whetherdot->s == "."){
-                pointer = Quote((p->stxs)[(p->stxs).size() - 1]).eval(e);
-                for (int i = (p->stxs).size() - 3; i >= 0; i--){
-                    Syntax d = (p->stxs)[i];
-                    auto w = dynamic_cast<SymbolSyntax*>(d.get());
-                    if(w != nullptr && w->s == "."){
-                        throw RuntimeError("Invalid '.' in quote");
-                    }
-                    pointer = PairV(Quote((p->stxs)[i]).eval(e), pointer);
-                }
-                return pointer;
-            }
-        }
-        for (int i = (p->stxs).size() - 1; i >= 0; i--){
-            Syntax d = (p->stxs)[i];
-            auto w = dynamic_cast<SymbolSyntax*>(d.get());
-            if(w != nullptr && w->s == "."){
-                throw RuntimeError("Invalid '.' in quote");
-            }
-            pointer = PairV(Quote((p->stxs)[i]).eval(e), pointer);
-        }
-        return pointer;
-    }
-    throw RuntimeError("Wrong typename");
+    return value.get();
 }
 
 Value AndVar::eval(Assoc &e) { // and with short-circuit evaluation
+    return trampoline(this, e);
+}
+
+ExprBase *AndVar::step(Assoc &e, Value &result) {
     //To complete the and logic
-    Value result = BooleanV(true);
-    for (int i = 0; i < rands.size(); i++) {
-        result = rands[i]->eval(e);
-        if (result->v_type == V_BOOL) {
-            if (!(dynamic_cast<Boolean*>(result.get())->b)) {
-                return BooleanV(false);
-            }
+    if (rands.empty()) {
+        result = BooleanV(true);
+        return nullptr;
+    }
+    for (int i = 0; i + 1 < rands.size(); i++) {
+        if (rands[i]->eval(e).isFalse()) {
+            result = BooleanV(false);
+            return nullptr;
         }
     }
-    return result;
+    return rands.back().get();
 }
 
 Value OrVar::eval(Assoc &e) { // or with short-circuit evaluation
+    return trampoline(this, e);
+}
+
+ExprBase *OrVar::step(Assoc &e, Value &result) {
     //To complete the or logic
-    Value result = BooleanV(false);
-    for (int i = 0; i < rands.size(); i++) {
-        result = rands[i]->eval(e);
-        if (result->v_type == V_BOOL) {
-            if (!(dynamic_cast<Boolean*>(result.get())->b)) {
-                continue;
-            }
+    if (rands.empty()) {
+        result = BooleanV(false);
+        return nullptr;
+    }
+    for (int i = 0; i + 1 < rands.size(); i++) {
+        Value v = rands[i]->eval(e);
+        if (!v.isFalse()) {
+            result = v;
+            return nullptr;
         }
-        return result;
     }
-    return result;
+    return rands.back().get();
 }
 
 Value Not::evalRator(const Value &rand) { // not
     //To complete the not logic
-    if (rand->v_type == V_BOOL) {
-        if (!(dynamic_cast<Boolean*>(rand.get())->b)) return BooleanV(true);
-    }
-    return BooleanV(false);
+    return BooleanV(rand.isFalse());
 }
 
 Value If::eval(Assoc &e) {
+    return trampoline(this, e);
+}
+
+ExprBase *If::step(Assoc &e, Value &result) {
     //To complete the if logic
     auto p = cond->eval(e);
-    if (p->v_type == V_BOOL && !(dynamic_cast<Boolean*>(p.get())->b)){
-        return alter->eval(e);
+    if (p.isFalse()){
+        return alter.get();
     }else{
-        return conseq->eval(e);
+        return conseq.get();
     }
 }
 
 Value Cond::eval(Assoc &env) {
+    return trampoline(this, env);
+}
+
+ExprBase *Cond::step(Assoc &env, Value &result) {
     //To complete the cond logic
     for (const auto& clause : clauses) {
         Value test = clause[0]->eval(env);
-        if (test->v_type == V_BOOL && !(dynamic_cast<Boolean*>(test.get())->b)) {
+        if (test.isFalse()) {
             continue;
         }
-        if (clause.size() == 1) return test;
-        Value ret = clause[1]->eval(env);
-        for (int i = 2; i < clause.size(); i++) {
-            ret = clause[i]->eval(env);
+        if (clause.size() == 1) {
+            result = test;
+            return nullptr;
         }
-        return ret;
+        for (int i = 1; i + 1 < clause.size(); i++) {
+            clause[i]->eval(env);
+        }
+        return clause.back().get();
     }
-    return VoidV();
+    result = VoidV();
+    return nullptr;
 }
 
 Value Lambda::eval(Assoc &env) { 
     //To complete the lambda logic
-    return ProcedureV(x, e, env);
+    //flat closure: copy only the free variables (boxes are shared, not copied)
+    Assoc captured = empty();
+    if (!captures.empty()) {
+        captured = extend(captures.size(), empty());
+        for (int i = 0; i < captures.size(); i++) {
+            captured->slots[i] = frameSlot(env, captures[i].first, captures[i].second);
+        }
+    }
+    Value proc = ProcedureV(x, e, captured, boxed);
+    static_cast<Procedure*>(proc.get())->jit = jit;
+    jit->holders++;
+    return proc;
 }
 
 Value Apply::eval(Assoc &e) {
+    return trampoline(this, e);
+}
+
+static std::size_t call_cache_hits = 0;
+static std::size_t call_cache_misses = 0;
+static std::size_t inline_hits = 0;
+static std::size_t inline_fallbacks = 0;
+
+void reportCallCacheStats(std::ostream &os) {
+    os << "call cache: hits " << call_cache_hits
+       << ", misses " << call_cache_misses << std::endl;
+    os << "inlined calls: hits " << inline_hits
+       << ", fallbacks " << inline_fallbacks << std::endl;
+}
+
+ExprBase *Apply::step(Assoc &e, Value &result) {
     Value r = rator->eval(e);
-    if (r->v_type != V_PROC) {throw RuntimeError("Attempt to apply a non-procedure");}
+    ValueRoot r_root(r);
+    if (r.get() == cached && cached != nullptr && cached_epoch == gcEpoch()) {
+        //same callee as last time: type and arity are already known to fit
+        call_cache_hits++;
+        if (cached_fn != nullptr) {
+            std::vector<Value> args;
+            VectorRoot args_root(args);
+            for (int i = 0; i < rand.size(); i++) {
+                args.push_back(rand[i]->eval(e));
+            }
+            result = cached_fn(args);
+            return nullptr;
+        }
+        Procedure *clos_ptr = static_cast<Procedure*>(cached);
+        Assoc param_env = pushFrame(rand.size(), clos_ptr->env);
+        EnvRoot param_root(param_env);
+        for (int i = 0; i < rand.size(); i++) {
+            param_env->slots[i] = rand[i]->eval(e);
+        }
+        if (cached_boxed) {
+            for (int i = 0; i < clos_ptr->boxed.size(); i++) {
+                if (clos_ptr->boxed[i]) param_env->slots[i] = BoxV(param_env->slots[i]);
+            }
+        }
+        e = tailFrame(param_env);
+        gcSafePoint(e);
+        return clos_ptr->jit != nullptr ? jitEntry(clos_ptr->jit, cached_body) : cached_body;
+    }
+    call_cache_misses++;
+    if (r.type() != V_PROC && r.type() != V_PRIMITIVE) {throw RuntimeError("Attempt to apply a non-procedure");}
 
-    //TO COMPLETE THE CLOSURE LOGIC
-    Procedure* clos_ptr = dynamic_cast<Procedure*>(r.get());
-    
     //TO COMPLETE THE ARGUMENT PARSER LOGIC
-    std::vector<Value> args;
+    if (r.type() == V_PRIMITIVE) {//native code, no frame needed
+        std::vector<Value> args;
+        VectorRoot args_root(args);
+        for (int i = 0; i < rand.size(); i++) {
+            args.push_back(rand[i]->eval(e));
+        }
+        Primitive *prim = static_cast<Primitive*>(r.get());
+        if (prim->arity >= 0 && args.size() != prim->arity) throw RuntimeError("Wrong number of arguments");
+        cached = prim;
+        cached_epoch = gcEpoch();
+        cached_fn = prim->fn;
+        result = prim->fn(args);
+        return nullptr;
+    }
+
+    //TO COMPLETE THE CLOSURE LOGIC
+    //the arguments go straight into the callee's frame, a window onto the frame stack
+    Procedure* clos_ptr = static_cast<Procedure*>(r.get());
+    Assoc param_env = pushFrame(rand.size(), clos_ptr->env);
+    EnvRoot param_root(param_env);
     for (int i = 0; i < rand.size(); i++) {
-        args.push_back(rand[i]->eval(e));
+        param_env->slots[i] = rand[i]->eval(e);
     }
-    if (auto varNode = dynamic_cast<Variadic*>(clos_ptr->e.get())) {
-        //expr is variadic, which doesn't have certain number of parameters
-        return varNode->evalRator(args);
+    if (rand.size() != clos_ptr->parameters.size()) throw RuntimeError("Wrong number of arguments");
+    cached = clos_ptr;
+    cached_epoch = gcEpoch();
+    cached_fn = nullptr;
+    cached_body = clos_ptr->e.get();
+    cached_boxed = false;
+    for (int i = 0; i < clos_ptr->boxed.size(); i++) {
+        if (clos_ptr->boxed[i]) cached_boxed = true;
     }
-    if (args.size() != clos_ptr->parameters.size()) throw RuntimeError("Wrong number of arguments");
     
     //TO COMPLETE THE PARAMETERS' ENVIRONMENT LOGIC
-    Assoc param_env = clos_ptr->env;
-    for (int i = 0; i < args.size(); i++){
-        param_env = extend(clos_ptr->parameters[i], args[i], param_env);
+    for (int i = 0; i < clos_ptr->boxed.size(); i++){
+        if (clos_ptr->boxed[i]) param_env->slots[i] = BoxV(param_env->slots[i]);
     }
 
-    return clos_ptr->e->eval(param_env);
+    //the body is a tail call: continue with it instead of recursing
+    e = tailFrame(param_env);
+    gcSafePoint(e);
+    return clos_ptr->jit != nullptr ? jitEntry(clos_ptr->jit, clos_ptr->e.get()) : clos_ptr->e.get();
+}
+
+ExprBase *InlinedApply::step(Assoc &e, Value &result) {
+    if (cell->v.get() == proc) {//still the procedure that was inlined
+        inline_hits++;
+        return body.get();
+    }
+    inline_fallbacks++;
+    return Apply::step(e, result);
+}
 
+ExprBase *LoopCall::step(Assoc &e, Value &result) {
+    Value r = rator->eval(e);
+    ValueRoot r_root(r);
+    //the first call fills the inline cache the ordinary way: type and arity are then known to fit
+    if (r.get() != cached || cached == nullptr || cached_epoch != gcEpoch() || cached_fn != nullptr) {
+        return Apply::step(e, result);
+    }
+    Procedure *clos_ptr = static_cast<Procedure*>(cached);
+    AssocList *frame = e.get();
+    for (int i = 0; i < depth; i++) {
+        frame = frame->next.get();
+    }
+    //the procedure's own frame is the one whose next is its captured frame
+    if (frame->next.get() != clos_ptr->env.get()) return Apply::step(e, result);
+    //every operand still sees the old bindings
+    {
+        Value small[4] = {Value(nullptr), Value(nullptr), Value(nullptr), Value(nullptr)};
+        Assoc scratch = rand.size() <= 4 ? empty() : pushFrame(rand.size(), empty());
+        EnvRoot scratch_root(scratch);
+        Value *values = rand.size() <= 4 ? small : scratch->slots;
+        ValueRoot values_root(values, rand.size());
+        for (int i = 0; i < rand.size(); i++) {
+            values[i] = rand[i]->eval(e);
+        }
+        for (int i = 0; i < rand.size(); i++) {
+            frame->slots[i] = values[i];
+        }
+    }
+    if (cached_boxed) {//a fresh binding per iteration, as closures may hold the old box
+        for (int i = 0; i < clos_ptr->boxed.size(); i++) {
+            if (clos_ptr->boxed[i]) frame->slots[i] = BoxV(frame->slots[i]);
+        }
+    }
+    e = Assoc(frame);
+    popFramesAbove(e);
+    gcSafePoint(e);    //the back-edge of a loop: it may never reach another procedure entry
+    return clos_ptr->jit != nullptr ? jitEntry(clos_ptr->jit, cached_body) : cached_body;
 }
 
 Value Define::eval(Assoc &env) {
     checkName(var);
-    //global variables should be put at tail and have only one version
-    if(env.get() == nullptr){//empty
-        env = extend(var, Value(nullptr), env);
+    if (depth >= 0) {//a local in scope is simply assigned
         Value value = e->eval(env);
-        modify(var, value, env);
+        if (boxed) static_cast<Box*>(frameSlot(env, depth, slot).get())->v = value;
+        else frameSlot(env, depth, slot) = value;
         return VoidV();
     }
-    for (auto i = env; i.get() != nullptr; i = i->next) {
-        if (var == i->x) {
-            i->v = e->eval(env);
-            return VoidV();
-        }
-        if((i->next).get() == nullptr){
-            Assoc na = Assoc(nullptr);
-            i->next = Assoc(new AssocList(var, Value(nullptr), na));
-            Value value = e->eval(env);
-            i->next->v = value;
-            return VoidV();
-        }
-    }
+    //global variables have only one version: redefining overwrites the cell
+    Value value = e->eval(env);
+    cell->v = value;
     return VoidV();
 }
 
 Value Let::eval(Assoc &env) {
+    return trampoline(this, env);
+}
+
+ExprBase *Let::step(Assoc &env, Value &result) {
     //To complete the let logic
     //create new env
-    Assoc let_env = env;
+    Assoc let_env = pushFrame(bind.size(), env);
+    EnvRoot let_root(let_env);
     for (int i = 0; i < bind.size(); i++){
         checkName(bind[i].first);
-        let_env = extend(bind[i].first, bind[i].second->eval(env), let_env);
+        let_env->slots[i] = bind[i].second->eval(env);
+        if (boxed[i]) let_env->slots[i] = BoxV(let_env->slots[i]);
     }
     
-    return body->eval(let_env);
+    env = let_env;
+    return body.get();
 }
 
 Value Letrec::eval(Assoc &env) {
+    return trampoline(this, env);
+}
+
+ExprBase *Letrec::step(Assoc &env, Value &result) {
     //To complete the letrec logic
-    Assoc env1 = env;
+    Assoc env1 = pushFrame(bind.size(), env);
+    EnvRoot env1_root(env1);
     for (int i = 0; i < bind.size(); i++) {
         checkName(bind[i].first);
-        env1 = extend(bind[i].first, Value(nullptr), env1);
+        if (boxed[i]) env1->slots[i] = BoxV(Value(nullptr));
     }
-    //if we modify env1, later will know the former(already evaled)
-    Assoc env2 = env;
+    //the slots stay unbound until every init has been evaluated
+    std::vector<Value> values;
+    VectorRoot values_root(values);
     for (int i = 0; i < bind.size(); i++) {
-        env2 = extend(bind[i].first, bind[i].second->eval(env1), env2);
+        values.push_back(bind[i].second->eval(env1));
     }
-    //modify env1 in case of procedure
     for (int i = 0; i < bind.size(); i++) {
-        modify(bind[i].first, find(bind[i].first, env2), env1);
+        if (boxed[i]) static_cast<Box*>(env1->slots[i].get())->v = values[i];
+        else env1->slots[i] = values[i];
     }
-    return body->eval(env2);
+    env = env1;
+    return body.get();
 }
 
 Value Set::eval(Assoc &env) {
     //To complete the set logic
-    if (find(var, env).get() == nullptr) {
+    if (depth >= 0) {
+        Value *place = &frameSlot(env, depth, slot);
+        if (boxed) place = &static_cast<Box*>(place->get())->v;
+        if (place->empty()) {
+            throw RuntimeError("Unbound variable in set!");
+        }
+        Value value = e->eval(env);
+        *place = value;
+        return VoidV();
+    }
+    if (cell->v.empty()) {
         throw RuntimeError("Unbound variable in set!");
     }
-    modify(var, e->eval(env), env);
+    Value value = e->eval(env);
+    cell->v = value;
     return VoidV();
 }
 
 Value Display::evalRator(const Value &rand) { // display function
-    if (rand->v_type == V_STRING) {
+    if (rand.type() == V_STRING) {
         String* str_ptr = dynamic_cast<String*>(rand.get());
         std::cout << str_ptr->s;
     } else {
-        rand->show(std::cout);
+        rand.show(std::cout);
     }
     
     return VoidV();
 }
+
+// ================================================================================
+//                              FUSED NODES
+// ================================================================================
+
+std::size_t *fusionCounter(const std::string &shape) {
+    static std::map<std::string, std::size_t> counters;
+    return &counters[shape];    //map nodes never move
+}
+
+void reportFusionStats(std::ostream &os) {
+    //every shape the parser can emit, in a fixed order
+    static const char *ops[] = {"+", "-", "<", "<=", "=", ">=", ">"};
+    static const char *unary[] = {"null?", "car", "cdr"};
+    for (const char *op : ops) {
+        os << "fused (" << op << " var const): " << *fusionCounter(std::string("(") + op + " var const)") << std::endl;
+        os << "fused (" << op << " var var): " << *fusionCounter(std::string("(") + op + " var var)") << std::endl;
+    }
+    for (const char *op : unary) {
+        os << "fused (" << op << " var): " << *fusionCounter(std::string("(") + op + " var)") << std::endl;
+    }
+}
+
+//current value of a variable, empty if it is unbound
+static Value readVar(Var *v, Assoc &e) {
+    Value x = v->depth >= 0 ? frameSlot(e, v->depth, v->slot) : v->cell->v;
+    if (v->boxed) x = static_cast<Box*>(x.get())->v;
+    return x;
+}
+
+//the operation on two fixnums, as in the evalRator of each node
+template <class Node> static Value fixnumOp(int a, int b);
+template <> Value fixnumOp<Plus>(int a, int b) { return IntegerV((long long)a + b); }
+template <> Value fixnumOp<Minus>(int a, int b) { return IntegerV((long long)a - b); }
+template <> Value fixnumOp<Less>(int a, int b) { return BooleanV(a < b); }
+template <> Value fixnumOp<LessEq>(int a, int b) { return BooleanV(a <= b); }
+template <> Value fixnumOp<Equal>(int a, int b) { return BooleanV(a == b); }
+template <> Value fixnumOp<GreaterEq>(int a, int b) { return BooleanV(a >= b); }
+template <> Value fixnumOp<Greater>(int a, int b) { return BooleanV(a > b); }
+
+template <class Base>
+FusedVarConst<Base>::FusedVarConst(const Expr &r1, const Expr &r2, const std::string &shape)
+    : Base(r1, r2), var(static_cast<Var*>(r1.get())), k(static_cast<Fixnum*>(r2.get())->n),
+      fired(fusionCounter(shape)) {}
+
+template <class Base>
+Value FusedVarConst<Base>::eval(Assoc &e) {
+    ++*fired;
+    Value v = readVar(var, e);
+    if (v.empty()) return Base::eval(e);
+    if (v.type() == V_INT) return fixnumOp<Base>(v.fixnum(), k);
+    return Base::evalRator(v, IntegerV(k));
+}
+
+template <class Base>
+FusedVarVar<Base>::FusedVarVar(const Expr &r1, const Expr &r2, const std::string &shape)
+    : Base(r1, r2), var1(static_cast<Var*>(r1.get())), var2(static_cast<Var*>(r2.get())),
+      fired(fusionCounter(shape)) {}
+
+template <class Base>
+Value FusedVarVar<Base>::eval(Assoc &e) {
+    ++*fired;
+    Value v1 = readVar(var1, e);
+    Value v2 = readVar(var2, e);
+    if (v1.empty() || v2.empty()) return Base::eval(e);
+    if (v1.type() == V_INT && v2.type() == V_INT) return fixnumOp<Base>(v1.fixnum(), v2.fixnum());
+    return Base::evalRator(v1, v2);
+}
+
+template <class Base>
+FusedVar<Base>::FusedVar(const Expr &r, const std::string &shape)
+    : Base(r), var(static_cast<Var*>(r.get())), fired(fusionCounter(shape)) {}
+
+template <class Base>
+Value FusedVar<Base>::eval(Assoc &e) {
+    ++*fired;
+    Value v = readVar(var, e);
+    if (v.empty()) return Base::eval(e);
+    return Base::evalRator(v);
+}
+
+template struct FusedVarConst<Plus>;
+template struct FusedVarConst<Minus>;
+template struct FusedVarConst<Less>;
+template struct FusedVarConst<LessEq>;
+template struct FusedVarConst<Equal>;
+template struct FusedVarConst<GreaterEq>;
+template struct FusedVarConst<Greater>;
+template struct FusedVarVar<Plus>;
+template struct FusedVarVar<Minus>;
+template struct FusedVarVar<Less>;
+template struct FusedVarVar<LessEq>;
+template struct FusedVarVar<Equal>;
+template struct FusedVarVar<GreaterEq>;
+template struct FusedVarVar<Greater>;
+template struct FusedVar<IsNull>;
+template struct FusedVar<Car>;
+template struct FusedVar<Cdr>;
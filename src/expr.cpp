@@ -1,5 +1,8 @@
 #include "Def.hpp"
 #include "expr.hpp"
+#include "jit.hpp"
+#include "value.hpp"
+#include "RE.hpp"
 #include <cstring>
 #include <cstdlib>
 #include <vector>
@@ -7,41 +10,61 @@ using std::vector;
 using std::string;
 using std::pair;
 
-// 辅助函数：计算最大公约数
-int gcd(int a, int b) {
-    while (b != 0) {
-        int temp = b;
-        b = a % b;
-        a = temp;
-    }
-    return a;
+ExprBase::ExprBase(ExprType et) : e_type(et) {}
+
+Constant::Constant() : bits(0) {}
+
+Constant::~Constant() {
+    gcUnpin(get().get());
 }
 
-ExprBase::ExprBase(ExprType et) : e_type(et) {}
+void Constant::set(const Value &v) {
+    bits = v.bits;
+    freezeConstant(v);
+    gcPin(v.get());
+}
+
+Value Constant::get() const {
+    return Value::fromBits(bits);
+}
 
 Expr::Expr(ExprBase * eb) : ptr(eb) {}
 ExprBase* Expr::operator->() const { return ptr.get(); }
 ExprBase& Expr::operator*() { return *ptr; }
 ExprBase* Expr::get() const { return ptr.get(); }
+bool Expr::unique() const { return ptr.use_count() == 1; }
 
 //BASIC TYPES AND LITERALS
 
 Fixnum::Fixnum(int x) : ExprBase(E_FIXNUM), n(x) {}
 
-RationalNum::RationalNum(int num, int den) : ExprBase(E_RATIONAL), numerator(num), denominator(den) {
+BignumNum::BignumNum(const BigInt &x) : ExprBase(E_BIGNUM), n(x) {
+    value.set(IntegerV(n));
+}
+
+FlonumNum::FlonumNum(double x) : ExprBase(E_FLONUM), d(x) {
+    value.set(FlonumV(d));
+}
+
+RationalNum::RationalNum(const BigInt &num, const BigInt &den) : ExprBase(E_RATIONAL), numerator(num), denominator(den) {
     // 简化分数
-    int g = gcd(abs(numerator), abs(denominator));
-    numerator /= g;
-    denominator /= g;
+    if (denominator.isZero()) return;
+    BigInt g = gcd(numerator, denominator), rem;
+    divide(num, g, numerator, rem);
+    divide(den, g, denominator, rem);
     
     // 确保分母为正
-    if (denominator < 0) {
+    if (denominator.negative) {
         numerator = -numerator;
         denominator = -denominator;
     }
+    if (compare(denominator, BigInt(1)) == 0) value.set(IntegerV(numerator));
+    else value.set(Value(new Rational(numerator, denominator)));
 }
 
-StringExpr::StringExpr(const std::string &str) : ExprBase(E_STRING), s(str) {}
+StringExpr::StringExpr(const std::string &str) : ExprBase(E_STRING), s(str) {
+    value.set(StringV(s));
+}
 
 True::True() : ExprBase(E_TRUE) {}
 
@@ -73,6 +96,10 @@ Modulo::Modulo(const Expr &r1, const Expr &r2) : Binary(E_MODULO, r1, r2) {}
 
 Expt::Expt(const Expr &r1, const Expr &r2) : Binary(E_EXPT, r1, r2) {}
 
+ExactToInexact::ExactToInexact(const Expr &r1) : Unary(E_EXACT_TO_INEXACT, r1) {}
+
+InexactToExact::InexactToExact(const Expr &r1) : Unary(E_INEXACT_TO_EXACT, r1) {}
+
 PlusVar::PlusVar(const std::vector<Expr> &rands) : Variadic(E_PLUS, rands) {}
 
 MinusVar::MinusVar(const std::vector<Expr> &rands) : Variadic(E_MINUS, rands) {}
@@ -149,7 +176,51 @@ IsString::IsString(const Expr &r1) : Unary(E_STRINGQ, r1) {}
 
 Begin::Begin(const vector<Expr> &vec) : ExprBase(E_BEGIN), es(vec) {}
 
-Quote::Quote(const Syntax &t) : ExprBase(E_QUOTE), s(t) {}
+//the datum written as t: numbers, booleans, symbols, strings and (dotted) lists of them
+static Value quoteValue(const Syntax &t) {
+    static const SymbolId dot_id = intern(".");
+    if (auto p = dynamic_cast<Number*>(t.get())) {
+        return IntegerV(p->n);
+    } else if (auto p = dynamic_cast<FlonumSyntax*>(t.get())) {
+        return FlonumV(p->d);
+    } else if (auto p = dynamic_cast<BignumSyntax*>(t.get())) {
+        return IntegerV(BigInt::fromString(p->digits));
+    } else if (auto p = dynamic_cast<RationalSyntax*>(t.get())) {
+        return RationalV(p->numerator, p->denominator);
+    } else if (dynamic_cast<TrueSyntax*>(t.get())) {
+        return BooleanV(true);
+    } else if (dynamic_cast<FalseSyntax*>(t.get())) {
+        return BooleanV(false);
+    } else if (auto p = dynamic_cast<SymbolSyntax*>(t.get())) {
+        return SymbolV(p->sym);
+    } else if (auto p = dynamic_cast<StringSyntax*>(t.get())) {
+        return StringV(p->s);
+    } else if (auto p = dynamic_cast<List*>(t.get())) {
+        const vector<Syntax> &stxs = p->stxs;
+        Value pointer = NullV();
+        int last = (int)stxs.size() - 1;
+        if (stxs.size() >= 3) {
+            auto dot = dynamic_cast<SymbolSyntax*>(stxs[stxs.size() - 2].get());
+            if (dot != nullptr && dot->sym == dot_id) {
+                pointer = quoteValue(stxs.back());
+                last = (int)stxs.size() - 3;
+            }
+        }
+        for (int i = last; i >= 0; i--) {
+            auto w = dynamic_cast<SymbolSyntax*>(stxs[i].get());
+            if (w != nullptr && w->sym == dot_id) {
+                throw RuntimeError("Invalid '.' in quote");
+            }
+            pointer = PairV(quoteValue(stxs[i]), pointer);
+        }
+        return pointer;
+    }
+    throw RuntimeError("Wrong typename");
+}
+
+Quote::Quote(const Syntax &t) : ExprBase(E_QUOTE), s(t) {
+    value.set(quoteValue(s));
+}
 
 //CONDITIONAL
 
@@ -159,23 +230,47 @@ Cond::Cond(const std::vector<std::vector<Expr>> &cls) : ExprBase(E_COND), clause
 
 //VARIABLE AND FUNCITON DEFINITION
 
-Var::Var(const string &s) : ExprBase(E_VAR), x(s) {}
+Var::Var(SymbolId s) : ExprBase(E_VAR), x(s), depth(-1), slot(-1), boxed(false), cell(globalCell(s)), prim(static_cast<Primitive*>(primitiveProcedure(s).get())) {}
 
-Apply::Apply(const Expr &expr, const vector<Expr> &vec) : ExprBase(E_APPLY), rator(expr), rand(vec) {}
+Var::Var(SymbolId s, int d, int i, bool b) : ExprBase(E_VAR), x(s), depth(d), slot(i), boxed(b), cell(nullptr), prim(nullptr) {}
 
-Lambda::Lambda(const vector<string> &vec, const Expr &expr) : ExprBase(E_LAMBDA), x(vec), e(expr) {}
+Apply::Apply(const Expr &expr, const vector<Expr> &vec) : ExprBase(E_APPLY), rator(expr), rand(vec), cached(nullptr), cached_epoch(0), cached_body(nullptr), cached_boxed(false), cached_fn(nullptr) {}
+
+InlinedApply::InlinedApply(const Expr &expr, const vector<Expr> &vec, GlobalCell *c, ValueBase *p, const Expr &b)
+    : Apply(expr, vec), cell(c), proc(p), body(b) {
+    gcPin(proc);//the guard compares addresses, so the procedure must not be freed and reused
+}
+
+InlinedApply::~InlinedApply() {
+    gcUnpin(proc);
+}
 
-Define::Define(const string &variable, const Expr &expr) : ExprBase(E_DEFINE), var(variable), e(expr) {}
+LoopCall::LoopCall(const Expr &expr, const vector<Expr> &vec, int d) : Apply(expr, vec), depth(d) {}
+
+Lambda::Lambda(const vector<SymbolId> &vec, const Expr &expr, const vector<bool> &b, const vector<pair<int, int>> &c)
+    : ExprBase(E_LAMBDA), x(vec), e(expr), boxed(b), captures(c), jit(new JitState()) {}
+
+Lambda::~Lambda() {
+    jitRelease(jit);
+}
+
+Define::Define(SymbolId variable, const Expr &expr) : ExprBase(E_DEFINE), var(variable), depth(-1), slot(-1), boxed(false), cell(globalCell(variable)), e(expr) {}
+
+Define::Define(SymbolId variable, int d, int i, bool b, const Expr &expr) : ExprBase(E_DEFINE), var(variable), depth(d), slot(i), boxed(b), cell(nullptr), e(expr) {}
 
 //BINDING CONSTRUCTS
 
-Let::Let(const vector<pair<string, Expr>> &vec, const Expr &e) : ExprBase(E_LET), bind(vec), body(e) {}
+Let::Let(const vector<pair<SymbolId, Expr>> &vec, const Expr &e, const vector<bool> &b) : ExprBase(E_LET), bind(vec), body(e), boxed(b) {}
 
-Letrec::Letrec(const vector<pair<string, Expr>> &vec, const Expr &expr) : ExprBase(E_LETREC), bind(vec), body(expr) {}
+Letrec::Letrec(const vector<pair<SymbolId, Expr>> &vec, const Expr &expr, const vector<bool> &b) : ExprBase(E_LETREC), bind(vec), body(expr), boxed(b) {}
 
 //ASSIGNMENT
 
-Set::Set(const std::string &var, const Expr &e) : ExprBase(E_SET), var(var), e(e) {}
+Set::Set(SymbolId var, const Expr &e) : ExprBase(E_SET), var(var), depth(-1), slot(-1), boxed(false), cell(globalCell(var)), e(e) {
+    cell->assigned = true;
+}
+
+Set::Set(SymbolId var, int d, int i, bool b, const Expr &e) : ExprBase(E_SET), var(var), depth(d), slot(i), boxed(b), cell(nullptr), e(e) {}
 
 //I/O OPERATIONS
 
@@ -19,6 +19,8 @@ public:
 
 #include "Def.hpp"
 #include "syntax.hpp"
+#include "bignum.hpp"
+#include <cstdint>
 #include <memory>
 #include <cstring>
 #include <vector>
@@ -27,9 +29,48 @@ struct ExprBase{
     ExprType e_type;
     ExprBase(ExprType);
     virtual Value eval(Assoc &) = 0;
+    /**
+     * @brief Evaluate up to the expression in tail position
+     * @return That expression, to be continued in env (possibly replaced);
+     *         or nullptr when the value is already in result
+     */
+    virtual ExprBase *step(Assoc &env, Value &result);
     virtual ~ExprBase() = default;
 };
 
+/**
+ * @brief Evaluate x by stepping through tail positions in a loop,
+ * so tail calls run in constant C++ stack
+ */
+Value trampoline(ExprBase *x, Assoc env);
+
+void reportCallCacheStats(std::ostream &);    ///< Apply inline cache hits and misses, printed by --ic-stats
+
+/**
+ * @brief Whether x may name a variable; the other engines leave nodes with
+ * invalid names to eval, which raises the error when they are reached
+ */
+bool validName(SymbolId x);
+void checkName(SymbolId x);    ///< Throws unless validName(x)
+
+/**
+ * @brief Value of a literal, built once when its node is made and returned by every evaluation
+ *
+ * Kept as the bits of the Value word, Value being incomplete here; a heap
+ * value is pinned while the node lives. Quoted lists and strings are
+ * therefore shared constants; they are frozen, so set-car! and set-cdr!
+ * raise an error on them rather than change every later evaluation.
+ */
+struct Constant {
+    uintptr_t bits;
+    Constant();
+    Constant(const Constant &) = delete;
+    Constant &operator=(const Constant &) = delete;
+    ~Constant();
+    void set(const Value &);    ///< At most once
+    Value get() const;
+};
+
 class Expr {
     std::shared_ptr<ExprBase> ptr;
 public:
@@ -37,6 +78,7 @@ public:
     ExprBase* operator->() const;
     ExprBase& operator*();
     ExprBase* get() const;
+    bool unique() const;    ///< No other Expr shares the node
 };
 
 // ================================================================================
@@ -58,9 +100,30 @@ struct Fixnum : ExprBase {
  * Represents rational numbers as numerator/denominator
  */
 struct RationalNum : ExprBase {
-  int numerator;
-  int denominator;
-  RationalNum(int num, int den);
+  BigInt numerator;
+  BigInt denominator;
+  Constant value;     ///< Unset if the denominator is zero
+  RationalNum(const BigInt &num, const BigInt &den);  ///< Reduced to lowest terms
+  virtual Value eval(Assoc &) override;
+};
+
+/**
+ * @brief Integer literal outside the fixnum range
+ */
+struct BignumNum : ExprBase {
+  BigInt n;
+  Constant value;
+  BignumNum(const BigInt &);
+  virtual Value eval(Assoc &) override;
+};
+
+/**
+ * @brief Floating-point literal expression
+ */
+struct FlonumNum : ExprBase {
+  double d;
+  Constant value;     ///< Boxed when d is not an immediate
+  FlonumNum(double);
   virtual Value eval(Assoc &) override;
 };
 
@@ -70,6 +133,7 @@ struct RationalNum : ExprBase {
  */
 struct StringExpr : ExprBase {
   std::string s;
+  Constant value;
   StringExpr(const std::string &);
   virtual Value eval(Assoc &) override;
 };
@@ -160,6 +224,16 @@ struct Expt : Binary {
     virtual Value evalRator(const Value &, const Value &) override;
 };
 
+struct ExactToInexact : Unary {
+    ExactToInexact(const Expr &);
+    virtual Value evalRator(const Value &) override;
+};
+
+struct InexactToExact : Unary {
+    InexactToExact(const Expr &);
+    virtual Value evalRator(const Value &) override;
+};
+
 struct PlusVar : Variadic {
     PlusVar(const std::vector<Expr> &);
     virtual Value evalRator(const std::vector<Value> &) override;
@@ -281,12 +355,14 @@ struct AndVar : ExprBase {
     std::vector<Expr> rands;
     AndVar(const std::vector<Expr> &);
     virtual Value eval(Assoc &) override;  
+    virtual ExprBase *step(Assoc &, Value &) override;
 };
 
 struct OrVar : ExprBase {
     std::vector<Expr> rands;
     OrVar(const std::vector<Expr> &);
     virtual Value eval(Assoc &) override;
+    virtual ExprBase *step(Assoc &, Value &) override;
 };
 
 // ================================================================================
@@ -346,10 +422,12 @@ struct Begin : ExprBase {
     std::vector<Expr> es;
     Begin(const std::vector<Expr> &);
     virtual Value eval(Assoc &) override;
+    virtual ExprBase *step(Assoc &, Value &) override;
 };
 
 struct Quote : ExprBase {
   Syntax s;
+  Constant value;     ///< The quoted datum, built at parse time
   Quote(const Syntax &);
   virtual Value eval(Assoc &) override;
 };
@@ -364,12 +442,14 @@ struct If : ExprBase {
   Expr alter;
   If(const Expr &, const Expr &, const Expr &);
   virtual Value eval(Assoc &) override;
+  virtual ExprBase *step(Assoc &, Value &) override;
 };
 
 struct Cond : ExprBase {
     std::vector<std::vector<Expr>> clauses;
     Cond(const std::vector<std::vector<Expr>> &);
     virtual Value eval(Assoc &) override;
+    virtual ExprBase *step(Assoc &, Value &) override;
 };
 
 // ================================================================================
@@ -377,29 +457,89 @@ struct Cond : ExprBase {
 // ================================================================================
 
 struct Var : ExprBase {
-    std::string x;
-    Var(const std::string &);
+    SymbolId x;
+    int depth;  ///< Frames to walk up for a local, -1 for a global
+    int slot;   ///< Slot index in that frame
+    bool boxed; ///< The slot holds a Box
+    GlobalCell *cell;   ///< Binding cell of a global, nullptr for a local
+    Primitive *prim;    ///< Primitive of the same name, used while the global is unbound
+    Var(SymbolId);
+    Var(SymbolId, int, int, bool = false);
     virtual Value eval(Assoc &) override;
 };
 
+/**
+ * @brief Procedure call, with a monomorphic inline cache of its last callee
+ *
+ * The callee is known to accept rand.size() arguments; the cache only holds
+ * while no collection has run since it was filled, as a collected callee's
+ * address may be reused.
+ */
 struct Apply : ExprBase {
     Expr rator;
     std::vector<Expr> rand;
+    ValueBase *cached;          ///< Last callee, nullptr if none
+    std::size_t cached_epoch;   ///< gcEpoch() when it was cached
+    ExprBase *cached_body;      ///< Body of a cached Procedure
+    bool cached_boxed;          ///< The Procedure boxes some parameter
+    Value (*cached_fn)(const std::vector<Value> &);  ///< Native code of a cached Primitive, nullptr for a Procedure
     Apply(const Expr &, const std::vector<Expr> &);
     virtual Value eval(Assoc &) override;
+    virtual ExprBase *step(Assoc &, Value &) override;
+};
+
+/**
+ * @brief Call of a global procedure whose body the optimizer inlined
+ *
+ * The inlined body runs only while the global still holds the procedure it
+ * was taken from; once the global is redefined or assigned, the node falls
+ * back to the ordinary call. Other engines compile it as a plain Apply.
+ */
+struct InlinedApply : Apply {
+    GlobalCell *cell;   ///< Global named by the rator
+    ValueBase *proc;    ///< Procedure that was inlined, pinned while the node lives
+    Expr body;          ///< The body with the operands substituted, or a Let binding them around it
+    InlinedApply(const Expr &, const std::vector<Expr> &, GlobalCell *, ValueBase *, const Expr &);
+    ~InlinedApply();
+    virtual ExprBase *step(Assoc &, Value &) override;
+};
+
+/**
+ * @brief Call of a named let's or do's own procedure in tail position of its body
+ *
+ * The tree walker stores the operands into the frame the procedure is
+ * already running in, depth frames up, and goes back to the start of the
+ * body, so a loop neither allocates a frame nor grows the frame stack per
+ * iteration. When the callee is not that procedure, or the frame is not its
+ * own, it is an ordinary call. Other engines compile it as a plain Apply.
+ */
+struct LoopCall : Apply {
+    int depth;  ///< let and letrec frames between the call and the procedure's frame
+    LoopCall(const Expr &, const std::vector<Expr> &, int);
+    virtual ExprBase *step(Assoc &, Value &) override;
 };
 
 struct Lambda : ExprBase {
-    std::vector<std::string> x;
+    std::vector<SymbolId> x;
     Expr e;
-    Lambda(const std::vector<std::string> &, const Expr &);
+    std::vector<bool> boxed;                    ///< Parameters assigned in the body (empty if none)
+    std::vector<std::pair<int, int>> captures;  ///< (depth, slot) of each free variable
+    JitState *jit;                              ///< Shared by its closures (tree engine)
+    Lambda(const std::vector<SymbolId> &, const Expr &, const std::vector<bool> &,
+           const std::vector<std::pair<int, int>> &);
+    ~Lambda();
     virtual Value eval(Assoc &) override;
 };
 
 struct Define : ExprBase {
-    std::string var;
+    SymbolId var;
+    int depth;  ///< -1 defines a global, otherwise assigns this local
+    int slot;
+    bool boxed;
+    GlobalCell *cell;   ///< Cell of the global being defined
     Expr e;
-    Define(const std::string &, const Expr &);
+    Define(SymbolId, const Expr &);
+    Define(SymbolId, int, int, bool, const Expr &);
     virtual Value eval(Assoc &) override;
 };
 
@@ -408,17 +548,21 @@ struct Define : ExprBase {
 // ================================================================================
 
 struct Let : ExprBase {
-    std::vector<std::pair<std::string, Expr>> bind;
+    std::vector<std::pair<SymbolId, Expr>> bind;
     Expr body;
-    Let(const std::vector<std::pair<std::string, Expr>> &, const Expr &);
+    std::vector<bool> boxed;    ///< Bindings that live in a Box
+    Let(const std::vector<std::pair<SymbolId, Expr>> &, const Expr &, const std::vector<bool> &);
     virtual Value eval(Assoc &) override;
+    virtual ExprBase *step(Assoc &, Value &) override;
 };
 
 struct Letrec : ExprBase {
-    std::vector<std::pair<std::string, Expr>> bind;
+    std::vector<std::pair<SymbolId, Expr>> bind;
     Expr body;
-    Letrec(const std::vector<std::pair<std::string, Expr>> &, const Expr &);
+    std::vector<bool> boxed;    ///< Bindings that live in a Box
+    Letrec(const std::vector<std::pair<SymbolId, Expr>> &, const Expr &, const std::vector<bool> &);
     virtual Value eval(Assoc &) override;
+    virtual ExprBase *step(Assoc &, Value &) override;
 };
 
 // ================================================================================
@@ -426,9 +570,14 @@ struct Letrec : ExprBase {
 // ================================================================================
 
 struct Set : ExprBase {
-    std::string var;
+    SymbolId var;
+    int depth;  ///< -1 for a global
+    int slot;
+    bool boxed;
+    GlobalCell *cell;   ///< Cell of the global being assigned
     Expr e;
-    Set(const std::string &, const Expr &);
+    Set(SymbolId, const Expr &);
+    Set(SymbolId, int, int, bool, const Expr &);
     virtual Value eval(Assoc &) override;
 };
 
@@ -441,4 +590,56 @@ struct Display : Unary {
     virtual Value evalRator(const Value &) override;
 };
 
+// ================================================================================
+//                              FUSED NODES
+// ================================================================================
+// Superinstructions emitted by the parser for the most common operand shapes.
+// Each is still a node of its primitive (same e_type, operands and evalRator),
+// so the other engines compile it like any other; only eval() is fused: the
+// variables are read straight from their slot or cell and fixnums are handled
+// inline. An unbound variable takes the generic path, which reports it.
+
+/**
+ * @brief (op var const) for +, - and the comparisons
+ */
+template <class Base>
+struct FusedVarConst : Base {
+    Var *var;               ///< rand1
+    int k;                  ///< Value of rand2
+    std::size_t *fired;     ///< Counter reported by --fusion-stats
+    FusedVarConst(const Expr &, const Expr &, const std::string &shape);
+    virtual Value eval(Assoc &) override;
+};
+
+/**
+ * @brief (op var var) for +, - and the comparisons
+ */
+template <class Base>
+struct FusedVarVar : Base {
+    Var *var1;
+    Var *var2;
+    std::size_t *fired;
+    FusedVarVar(const Expr &, const Expr &, const std::string &shape);
+    virtual Value eval(Assoc &) override;
+};
+
+/**
+ * @brief (op var) for null?, car and cdr
+ */
+template <class Base>
+struct FusedVar : Base {
+    Var *var;
+    std::size_t *fired;
+    FusedVar(const Expr &, const std::string &shape);
+    virtual Value eval(Assoc &) override;
+};
+
+std::size_t *fusionCounter(const std::string &shape);
+void reportFusionStats(std::ostream &);     ///< Fire counts of the fused nodes, printed by --fusion-stats
+
+/**
+ * @brief Node of the primitive op_type (named op) on parameters, as the parser builds it
+ */
+Expr primitiveNode(ExprType op_type, const std::string &op, const std::vector<Expr> &parameters);
+
 #endif
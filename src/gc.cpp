@@ -0,0 +1,165 @@
+/**
+ * @file gc.cpp
+ * @brief Mark-and-sweep garbage collector implementation
+ *
+ * Objects are allocated from the size-class pool and linked into one
+ * list. The mark phase uses an explicit gray stack, so long lists and deep
+ * environment chains do not recurse on the C++ stack; the sweep phase walks
+ * the list and deletes every object that was not reached.
+ */
+
+#include "gc.hpp"
+#include "value.hpp"
+#include "pool.hpp"
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+
+// ============================================================================
+// Heap state
+// ============================================================================
+
+static GCObject *all_objects = nullptr;          ///< Every live GCObject
+static std::vector<GCObject *> gray_stack;       ///< Marked but not yet traced
+static std::unordered_map<GCObject *, int> pinned;
+GCRoot *gc_roots = nullptr;
+
+static std::size_t heap_bytes = 0;               ///< Bytes currently allocated
+static std::size_t peak_heap_bytes = 0;
+static std::size_t bytes_since_gc = 0;
+static std::size_t gc_threshold = 4 << 20;       ///< Allocation budget between collections
+
+static std::size_t objects_allocated = 0;
+static std::size_t collections = 0;
+static std::size_t objects_freed = 0;
+static double total_pause_ms = 0;
+static double max_pause_ms = 0;
+
+// ============================================================================
+// GCObject
+// ============================================================================
+
+GCObject::GCObject() : gc_next(all_objects), gc_marked(false) {
+    all_objects = this;
+}
+
+GCObject::GCObject(Unmanaged) : gc_next(nullptr), gc_marked(false) {}
+
+GCObject::~GCObject() {
+    // Only reached while still linked if a derived constructor threw
+    if (all_objects == this) all_objects = gc_next;
+}
+
+void GCObject::trace() {}
+
+void *GCObject::operator new(std::size_t size) {
+    objects_allocated++;
+    heap_bytes += size;
+    bytes_since_gc += size;
+    if (heap_bytes > peak_heap_bytes) peak_heap_bytes = heap_bytes;
+    return poolAllocate(size);
+}
+
+void GCObject::operator delete(void *p, std::size_t size) {
+    heap_bytes -= size;
+    poolFree(p, size);
+}
+
+// ============================================================================
+// Marking
+// ============================================================================
+
+void gcMark(GCObject *obj) {
+    if (obj == nullptr || obj->gc_marked) return;
+    obj->gc_marked = true;
+    gray_stack.push_back(obj);
+}
+
+static void drainGrayStack() {
+    while (!gray_stack.empty()) {
+        GCObject *obj = gray_stack.back();
+        gray_stack.pop_back();
+        obj->trace();
+    }
+}
+
+void gcPin(GCObject *obj) {
+    if (obj != nullptr) pinned[obj]++;
+}
+
+void gcUnpin(GCObject *obj) {
+    auto it = pinned.find(obj);
+    if (it != pinned.end() && --it->second == 0) pinned.erase(it);
+}
+
+// ============================================================================
+// Collection
+// ============================================================================
+
+void gcCollect(Assoc &env) {
+    auto start = std::chrono::steady_clock::now();
+
+    markFrameStack();
+    gcMark(env.get());
+    markGlobals();
+    for (auto &p : pinned) gcMark(p.first);
+    for (GCRoot *root = gc_roots; root != nullptr; root = root->gc_prev) root->trace();
+    drainGrayStack();
+
+    GCObject **link = &all_objects;
+    while (*link != nullptr) {
+        GCObject *obj = *link;
+        if (obj->gc_marked) {
+            obj->gc_marked = false;
+            link = &obj->gc_next;
+        } else {
+            *link = obj->gc_next;
+            delete obj;
+            objects_freed++;
+        }
+    }
+
+    bytes_since_gc = 0;
+    // Let the heap grow at least as much as what survived before collecting again
+    if (heap_bytes > gc_threshold) gc_threshold = heap_bytes;
+
+    double pause = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    collections++;
+    total_pause_ms += pause;
+    if (pause > max_pause_ms) max_pause_ms = pause;
+}
+
+std::size_t gcObjectsAllocated() {
+    return objects_allocated;
+}
+
+std::size_t gcEpoch() {
+    return collections;
+}
+
+bool gcPending() {
+    return bytes_since_gc >= gc_threshold;
+}
+
+void gcChargeBudget(std::size_t bytes) {
+    bytes_since_gc += bytes;
+}
+
+void gcSafePoint(Assoc &env) {
+    if (gcPending()) {
+        gcCollect(env);
+    }
+}
+
+void gcReportStats(std::ostream &os) {
+    os << "gc: objects allocated " << objects_allocated
+       << ", collections " << collections
+       << ", objects freed " << objects_freed
+       << ", total pause " << total_pause_ms << " ms"
+       << ", max pause " << max_pause_ms << " ms"
+       << ", heap " << heap_bytes << " bytes"
+       << ", peak heap " << peak_heap_bytes << " bytes"
+       << ", pool reserved " << poolReservedBytes() << " bytes" << std::endl;
+}
@@ -0,0 +1,77 @@
+#ifndef GC_HPP
+#define GC_HPP
+
+/**
+ * @file gc.hpp
+ * @brief Mark-and-sweep garbage collector for values and environments
+ *
+ * Every heap-allocated ValueBase and AssocList derives from GCObject and is
+ * threaded onto a single list of all live objects. Collections happen at
+ * safe points once gcPending() says the allocation budget is used up:
+ * between top-level forms of the REPL, and at procedure entry in every
+ * engine, so a long-running form frees its garbage as it goes. The roots
+ * are the environment given to the safe point, the global variable cells,
+ * the frame stack, objects explicitly pinned by the interpreter and the
+ * GCRoots the running evaluators have registered for their own state.
+ */
+
+#include "Def.hpp"
+#include <cstddef>
+
+/**
+ * @brief Tag for an object living outside the collected heap (see pushFrame)
+ */
+struct Unmanaged {};
+
+/**
+ * @brief Base class for all objects owned by the collector
+ */
+struct GCObject {
+    GCObject *gc_next;   ///< Next object in the list of all allocated objects
+    bool gc_marked;      ///< Set during the mark phase for reachable objects
+    GCObject();
+    explicit GCObject(Unmanaged);   ///< Never linked into the list, so never swept
+    virtual void trace();   ///< Mark every GCObject directly referenced
+    virtual ~GCObject();
+    static void *operator new(std::size_t);
+    static void operator delete(void *, std::size_t);
+};
+
+// Marking
+void gcMark(GCObject *);
+
+// Roots that are not reachable from the global variables
+void gcPin(GCObject *);
+void gcUnpin(GCObject *);
+
+struct GCRoot;
+extern GCRoot *gc_roots;    ///< Innermost registered root
+
+/**
+ * @brief State of a running evaluator that the collector must see: its
+ * current frame, its operand stack, values it is still holding...
+ *
+ * Roots are locals of the evaluators, so they come and go in LIFO order;
+ * while one lives, every collection calls its trace().
+ */
+struct GCRoot {
+    GCRoot *gc_prev;    ///< Root registered before this one
+    GCRoot() : gc_prev(gc_roots) { gc_roots = this; }
+    ~GCRoot() { gc_roots = gc_prev; }
+    GCRoot(const GCRoot &) = delete;
+    GCRoot &operator=(const GCRoot &) = delete;
+    virtual void trace() = 0;   ///< Mark every GCObject it holds
+};
+
+// Collection
+void gcSafePoint(Assoc &);
+bool gcPending();    ///< Whether the allocation budget is used up
+void gcChargeBudget(std::size_t);   ///< Memory outside the heap freed along with collected objects, such as native code
+std::size_t gcEpoch();   ///< Number of collections so far: object addresses may be reused once it changes
+void gcCollect(Assoc &);
+
+// Statistics, printed by --gc-stats
+std::size_t gcObjectsAllocated();
+void gcReportStats(std::ostream &);
+
+#endif // GC_HPP
@@ -0,0 +1,730 @@
+/**
+ * @file jit.cpp
+ * @brief Copy-and-patch JIT implementation
+ *
+ * Native code of a body has the signature uintptr_t(AssocList *frame,
+ * Value *temps) and keeps the frame in rbx and the temporaries in r12;
+ * every node leaves the bits of its value in rax, and the first operand of
+ * a binary primitive waits in a temporary while the second is evaluated.
+ * The temporaries are the slots of a frame pushed on the frame stack for
+ * the call, so the collector sees what they hold. The result is a Value,
+ * or 0 when a tail call is pending, or JIT_ERROR when a helper caught an
+ * error.
+ *
+ * Each stencil below is the machine code of one small operation with zero
+ * bytes where it is patched; the comment gives the instructions and the
+ * offsets of the holes. Jumps are emitted with a placeholder and resolved
+ * once the whole body is laid out. Compiled code refers to the nodes of the
+ * body, so it lives as long as the JitState of its lambda; bodies are carved
+ * out of shared executable chunks, and the block of a freed body goes back
+ * to a free list, so redefining procedures reuses the space.
+ */
+
+#include "jit.hpp"
+#include "value.hpp"
+#include "gc.hpp"
+#include "RE.hpp"
+#include <exception>
+#include <iterator>
+#include <map>
+#include <vector>
+#include <cstring>
+
+int jit_threshold = 50;
+
+static std::size_t bodies_compiled = 0;
+static std::size_t bodies_freed = 0;
+static std::size_t code_bytes = 0;
+static std::size_t code_reserved = 0;  ///< Executable memory mapped so far
+
+void reportJitStats(std::ostream &os) {
+    os << "jit: bodies compiled " << bodies_compiled
+       << ", freed " << bodies_freed
+       << ", code " << code_bytes << " bytes"
+       << ", reserved " << code_reserved << " bytes" << std::endl;
+}
+
+static std::vector<JitState *> retired_states;  ///< Held by no lambda or closure
+
+JitState::~JitState() {
+    delete entry;
+}
+
+void jitRelease(JitState *jit) {
+    if (--jit->holders == 0) retired_states.push_back(jit);
+}
+
+void jitFreeRetired() {
+    for (int i = 0; i < retired_states.size(); i++) {
+        delete retired_states[i];
+    }
+    retired_states.clear();
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// ============================================================================
+// Executable memory
+// ============================================================================
+
+static const std::size_t CHUNK_BYTES = 64 * 1024;
+static const std::size_t CODE_ALIGN = 16;
+
+static std::map<char *, std::size_t> free_code;    ///< Free blocks by address
+
+static std::size_t roundUp(std::size_t n, std::size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+// a block of n bytes: the first free one that fits, or the start of a new chunk
+static char *allocCode(std::size_t n) {
+    n = roundUp(n, CODE_ALIGN);
+    for (auto it = free_code.begin(); it != free_code.end(); ++it) {
+        if (it->second < n) continue;
+        char *p = it->first;
+        std::size_t rest = it->second - n;
+        free_code.erase(it);
+        if (rest > 0) free_code[p + n] = rest;
+        return p;
+    }
+    std::size_t size = roundUp(n > CHUNK_BYTES ? n : CHUNK_BYTES, sysconf(_SC_PAGESIZE));
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return nullptr;
+    code_reserved += size;
+    char *p = static_cast<char *>(memory);
+    if (size > n) free_code[p + n] = size - n;
+    return p;
+}
+
+// give the block back, merged with the free blocks right before and after it
+static void freeCode(char *p, std::size_t n) {
+    n = roundUp(n, CODE_ALIGN);
+    auto next = free_code.lower_bound(p);
+    if (next != free_code.end() && p + n == next->first) {
+        n += next->second;
+        next = free_code.erase(next);
+    }
+    if (next != free_code.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == p) {
+            prev->second += n;
+            return;
+        }
+    }
+    free_code[p] = n;
+}
+
+// copy code to p, making its pages writable meanwhile; nothing runs in them while it does
+static bool writeCode(char *p, const std::vector<unsigned char> &code) {
+    std::size_t page = sysconf(_SC_PAGESIZE);
+    char *start = reinterpret_cast<char *>(reinterpret_cast<uintptr_t>(p) / page * page);
+    std::size_t length = roundUp(p + code.size() - start, page);
+    if (mprotect(start, length, PROT_READ | PROT_WRITE) != 0) return false;
+    std::memcpy(p, code.data(), code.size());
+    return mprotect(start, length, PROT_READ | PROT_EXEC) == 0;
+}
+
+// ============================================================================
+// Runtime helpers called from native code
+// ============================================================================
+
+/// Returned by native code after a helper caught an error; never the bits of a Value
+static const uintptr_t JIT_ERROR = (31 << 3) | Value::SPECIAL_TAG;
+
+static std::exception_ptr jit_error;        ///< Error caught by a helper
+static ExprBase *pending_expr = nullptr;    ///< Where a pending tail call continues
+static Assoc pending_env(nullptr);          ///< And its frame
+
+typedef uintptr_t (*JitCode)(AssocList *, Value *);
+
+/**
+ * @brief The node a call continues with once its body is compiled
+ */
+struct JitBody : ExprBase {
+    JitCode code;
+    std::size_t size;   ///< Bytes of code
+    int temps;          ///< Temporaries the code needs
+    JitBody(ExprType t, JitCode code, std::size_t size, int temps) : ExprBase(t), code(code), size(size), temps(temps) {}
+    ~JitBody() {
+        freeCode(reinterpret_cast<char *>(code), size);
+        bodies_freed++;
+    }
+    // the code on frame, with a fresh frame on the frame stack for its temporaries
+    uintptr_t run(AssocList *frame) {
+        Assoc temp_frame = temps > 0 ? pushFrame(temps, empty()) : empty();
+        EnvRoot temp_root(temp_frame);
+        return code(frame, temps > 0 ? temp_frame->slots : nullptr);
+    }
+    virtual Value eval(Assoc &env) override { return trampoline(this, env); }
+    virtual ExprBase *step(Assoc &env, Value &result) override {
+        uintptr_t r = run(env.get());
+        if (r == JIT_ERROR) {
+            std::exception_ptr error = jit_error;
+            jit_error = nullptr;
+            std::rethrow_exception(error);
+        }
+        if (r != 0) {
+            result = Value::fromBits(r);
+            return nullptr;
+        }
+        env = pending_env;
+        pending_env = empty();
+        return pending_expr;
+    }
+};
+
+static uintptr_t jitEval(ExprBase *x, AssocList *frame) {
+    try {
+        Assoc env(frame);
+        return x->eval(env).bits;
+    } catch (...) {
+        jit_error = std::current_exception();
+        return JIT_ERROR;
+    }
+}
+
+// x in tail position: its value, or 0 with the rest left pending
+static uintptr_t jitStep(ExprBase *x, AssocList *frame) {
+    try {
+        Assoc env(frame);
+        Value result(nullptr);
+        ExprBase *next = x->step(env, result);
+        if (next == nullptr) return result.bits;
+        pending_expr = next;
+        pending_env = env;
+        return 0;
+    } catch (...) {
+        jit_error = std::current_exception();
+        return JIT_ERROR;
+    }
+}
+
+static uintptr_t jitApplicable(uintptr_t f) {
+    Value r = Value::fromBits(f);
+    if (r.type() == V_PROC || r.type() == V_PRIMITIVE) return f;
+    jit_error = std::make_exception_ptr(RuntimeError("Attempt to apply a non-procedure"));
+    return JIT_ERROR;
+}
+
+// the call x with the callee in slots[0] and argument i in slots[1 + i],
+// like Apply::step: a primitive gives its value, a procedure its body and frame
+static ExprBase *jitEnter(Apply *x, const Value *slots, Assoc &env, Value &result) {
+    Value r = slots[0];
+    int n = x->rand.size();
+    if (r.type() == V_PRIMITIVE) {
+        Primitive *prim = static_cast<Primitive*>(r.get());
+        std::vector<Value> args;
+        for (int i = 0; i < n; i++) {
+            args.push_back(slots[1 + i]);
+        }
+        if (prim->arity >= 0 && args.size() != prim->arity) throw RuntimeError("Wrong number of arguments");
+        result = prim->fn(args);
+        return nullptr;
+    }
+    Procedure *clos_ptr = static_cast<Procedure*>(r.get());
+    if (n != clos_ptr->parameters.size()) throw RuntimeError("Wrong number of arguments");
+    Assoc param_env = pushFrame(n, clos_ptr->env);
+    for (int i = 0; i < n; i++) {
+        param_env->slots[i] = slots[1 + i];
+    }
+    for (int i = 0; i < clos_ptr->boxed.size(); i++) {
+        if (clos_ptr->boxed[i]) param_env->slots[i] = BoxV(param_env->slots[i]);
+    }
+    env = param_env;
+    gcSafePoint(env);
+    return clos_ptr->jit != nullptr ? jitEntry(clos_ptr->jit, clos_ptr->e.get()) : clos_ptr->e.get();
+}
+
+static uintptr_t jitApply(Apply *x, const Value *slots) {
+    std::size_t top = frameStackTop();
+    try {
+        Assoc env = empty();
+        EnvRoot env_root(env);
+        Value result(nullptr);
+        ExprBase *body = jitEnter(x, slots, env, result);
+        if (body == nullptr) return result.bits;
+        uintptr_t r;
+        if (JitBody *native = dynamic_cast<JitBody*>(body)) {//straight into its code, saving stack
+            FrameScope frames;
+            r = native->run(env.get());
+            if (r == 0) {
+                env = pending_env;
+                pending_env = empty();
+                r = trampoline(pending_expr, env).bits;
+            }
+        } else {
+            r = trampoline(body, env).bits;
+        }
+        popFrames(top);
+        return r;
+    } catch (...) {
+        popFrames(top);
+        jit_error = std::current_exception();
+        return JIT_ERROR;
+    }
+}
+
+// the call x in tail position: leaves the body pending
+static uintptr_t jitTailApply(Apply *x, const Value *slots) {
+    try {
+        Assoc env = empty();
+        Value result(nullptr);
+        ExprBase *body = jitEnter(x, slots, env, result);
+        if (body == nullptr) return result.bits;
+        pending_expr = body;
+        pending_env = tailFrame(env);
+        return 0;
+    } catch (...) {
+        jit_error = std::current_exception();
+        return JIT_ERROR;
+    }
+}
+
+static uintptr_t jitUnary(Unary *x, uintptr_t a) {
+    try {
+        return x->evalRator(Value::fromBits(a)).bits;
+    } catch (...) {
+        jit_error = std::current_exception();
+        return JIT_ERROR;
+    }
+}
+
+static uintptr_t jitBinary(Binary *x, uintptr_t a, uintptr_t b) {
+    try {
+        return x->evalRator(Value::fromBits(a), Value::fromBits(b)).bits;
+    } catch (...) {
+        jit_error = std::current_exception();
+        return JIT_ERROR;
+    }
+}
+
+
+// ============================================================================
+// Stencils
+// ============================================================================
+
+// push rbp; mov rbp, rsp; push rbx; push r12; mov rbx, rdi; mov r12, rsi
+static const unsigned char PROLOGUE[] = {
+    0x55, 0x48, 0x89, 0xE5, 0x53, 0x41, 0x54, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4};
+// lea rsp, [rbp-16]; pop r12; pop rbx; pop rbp; ret
+static const unsigned char EPILOGUE[] = {0x48, 0x8D, 0x65, 0xF0, 0x41, 0x5C, 0x5B, 0x5D, 0xC3};
+// mov rax, imm64 @2
+static const unsigned char MOV_RAX_IMM[] = {0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0};
+// mov rdi, imm64 @2
+static const unsigned char MOV_RDI_IMM[] = {0x48, 0xBF, 0, 0, 0, 0, 0, 0, 0, 0};
+// mov rax, rbx
+static const unsigned char MOV_RAX_FRAME[] = {0x48, 0x89, 0xD8};
+// mov rsi, rbx
+static const unsigned char MOV_RSI_FRAME[] = {0x48, 0x89, 0xDE};
+// mov rsi, rax
+static const unsigned char MOV_RSI_RAX[] = {0x48, 0x89, 0xC6};
+// mov rdx, rax
+static const unsigned char MOV_RDX_RAX[] = {0x48, 0x89, 0xC2};
+// mov rdi, rax
+static const unsigned char MOV_RDI_RAX[] = {0x48, 0x89, 0xC7};
+// lea rsi, [r12 + disp32 @4]
+static const unsigned char LEA_RSI_TEMP[] = {0x49, 0x8D, 0xB4, 0x24, 0, 0, 0, 0};
+// mov rax, [rax + disp32 @3]
+static const unsigned char LOAD[] = {0x48, 0x8B, 0x80, 0, 0, 0, 0};
+// mov [r12 + disp32 @4], rax
+static const unsigned char STORE_TEMP[] = {0x49, 0x89, 0x84, 0x24, 0, 0, 0, 0};
+// mov rsi, [r12 + disp32 @4]
+static const unsigned char LOAD_RSI_TEMP[] = {0x49, 0x8B, 0xB4, 0x24, 0, 0, 0, 0};
+// mov rax, imm64 @2; call rax
+static const unsigned char CALL[] = {0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xD0};
+// cmp rax, imm32 @2; je rel32 @8
+static const unsigned char JUMP_IF_EQUAL[] = {0x48, 0x3D, 0, 0, 0, 0, 0x0F, 0x84, 0, 0, 0, 0};
+// test rax, rax; jnz rel32 @5
+static const unsigned char JUMP_IF_VALUE[] = {0x48, 0x85, 0xC0, 0x0F, 0x85, 0, 0, 0, 0};
+// jmp rel32 @1
+static const unsigned char JUMP[] = {0xE9, 0, 0, 0, 0};
+// mov eax, esi; and eax, edx; test al, 1; jz rel32 @8 (unless rsi and rdx are both fixnums)
+static const unsigned char CHECK_FIXNUMS[] = {0x89, 0xF0, 0x21, 0xD0, 0xA8, 0x01, 0x0F, 0x84, 0, 0, 0, 0};
+// mov rax, rsi; sar rax, 1; mov rcx, rdx; sar rcx, 1
+static const unsigned char UNTAG[] = {0x48, 0x89, 0xF0, 0x48, 0xD1, 0xF8, 0x48, 0x89, 0xD1, 0x48, 0xD1, 0xF9};
+// add rax, rcx
+static const unsigned char ADD[] = {0x48, 0x01, 0xC8};
+// sub rax, rcx
+static const unsigned char SUB[] = {0x48, 0x29, 0xC8};
+// imul rax, rcx
+static const unsigned char MUL[] = {0x48, 0x0F, 0xAF, 0xC1};
+// movsxd rcx, eax; cmp rcx, rax; jne rel32 @8 (unless it fits a fixnum); lea rax, [rax+rax+1]
+static const unsigned char RETAG[] = {
+    0x48, 0x63, 0xC8, 0x48, 0x39, 0xC1, 0x0F, 0x85, 0, 0, 0, 0, 0x48, 0x8D, 0x44, 0x00, 0x01};
+// cmp rsi, rdx; mov eax, imm32 @4 (#f); mov ecx, imm32 @9 (#t); cmovcc @15 rax, rcx
+static const unsigned char COMPARE[] = {
+    0x48, 0x39, 0xD6, 0xB8, 0, 0, 0, 0, 0xB9, 0, 0, 0, 0, 0x48, 0x0F, 0, 0xC1};
+// cmp rax, imm32 @2; mov eax, imm32 @7 (#f); mov ecx, imm32 @12 (#t); cmove rax, rcx
+static const unsigned char SELECT_EQUAL[] = {
+    0x48, 0x3D, 0, 0, 0, 0, 0xB8, 0, 0, 0, 0, 0xB9, 0, 0, 0, 0, 0x48, 0x0F, 0x44, 0xC1};
+// test al, 7; jnz rel32 @4; test rax, rax; jz rel32 @13;
+// cmp dword [rax + disp32 @19], imm8 @23; jne rel32 @26 (unless rax is a heap value of that type)
+static const unsigned char CHECK_TYPE[] = {
+    0xA8, 0x07, 0x0F, 0x85, 0, 0, 0, 0, 0x48, 0x85, 0xC0, 0x0F, 0x84, 0, 0, 0, 0,
+    0x83, 0xB8, 0, 0, 0, 0, 0, 0x0F, 0x85, 0, 0, 0, 0};
+
+// condition codes of cmovcc
+static const unsigned char CC_LESS = 0x4C, CC_LESS_EQ = 0x4E, CC_EQUAL = 0x44,
+                           CC_GREATER_EQ = 0x4D, CC_GREATER = 0x4F;
+
+// ============================================================================
+// Object layout, measured on real objects
+// ============================================================================
+
+struct Layout {
+    int32_t frame_slots;    ///< AssocList::slots
+    int32_t frame_next;     ///< AssocList::next
+    int32_t box_value;      ///< Box::v
+    int32_t pair_car;       ///< Pair::car
+    int32_t pair_cdr;       ///< Pair::cdr
+    int32_t value_type;     ///< ValueBase::v_type
+};
+
+static int32_t offset(const void *object, const void *field) {
+    return (int32_t)(static_cast<const char*>(field) - static_cast<const char*>(object));
+}
+
+static const Layout &layout() {
+    static Layout l;
+    static bool measured = false;
+    if (!measured) {//the probes are garbage right away; no collection runs before the next safe point
+        Assoc frame = extend(1, empty());
+        Value box = BoxV(NullV());
+        Value pair = PairV(NullV(), NullV());
+        Pair *p = static_cast<Pair*>(pair.get());
+        l.frame_slots = offset(frame.get(), &frame->slots);
+        l.frame_next = offset(frame.get(), &frame->next.ptr);
+        l.box_value = offset(box.get(), &static_cast<Box*>(box.get())->v.bits);
+        l.pair_car = offset(p, &p->car.bits);
+        l.pair_cdr = offset(p, &p->cdr.bits);
+        l.value_type = offset(p, &p->v_type);
+        measured = true;
+    }
+    return l;
+}
+
+static_assert(sizeof(ValueType) == 4, "CHECK_TYPE compares a 32-bit type tag");
+
+// ============================================================================
+// Compilation
+// ============================================================================
+
+struct JitCompiler {
+    std::vector<unsigned char> code;
+    std::vector<std::pair<std::size_t, int>> fixups;   ///< rel32 position and its label
+    std::vector<long> labels;                          ///< Position of each label, -1 until bound
+    int temps;          ///< Stack slots in use
+    int max_temps;
+    int exit;           ///< Label of the epilogue
+    const Layout &l;
+    JitCompiler() : temps(0), max_temps(0), exit(-1), l(layout()) {}
+
+    template <std::size_t N>
+    std::size_t copy(const unsigned char (&stencil)[N]) {
+        std::size_t at = code.size();
+        code.insert(code.end(), stencil, stencil + N);
+        return at;
+    }
+    void patch8(std::size_t at, unsigned char v) { code[at] = v; }
+    void patch32(std::size_t at, int32_t v) { std::memcpy(&code[at], &v, 4); }
+    void patch64(std::size_t at, uint64_t v) { std::memcpy(&code[at], &v, 8); }
+    int label() {
+        labels.push_back(-1);
+        return (int)labels.size() - 1;
+    }
+    void bind(int label) { labels[label] = (long)code.size(); }
+    void jumpTo(std::size_t rel32, int label) { fixups.push_back(std::make_pair(rel32, label)); }
+
+    int32_t temp(int i) { return 8 * i; }  ///< Offset of temporary i from r12
+
+    void constant(uintptr_t bits);
+    void load(int32_t disp);
+    void call(const void *helper);
+    void callNode(const void *helper, ExprBase *x);
+    void variable(Var *var);
+    void unary(Unary *x);
+    void binary(Binary *x);
+    void apply(Apply *x, bool tail);
+    int checkType(ValueType t);
+    void expr(ExprBase *x, bool tail);
+    JitCode finish();
+};
+
+void JitCompiler::constant(uintptr_t bits) {
+    patch64(copy(MOV_RAX_IMM) + 2, bits);
+}
+
+void JitCompiler::load(int32_t disp) {
+    patch32(copy(LOAD) + 3, disp);
+}
+
+// call a helper, leaving for the epilogue if it caught an error
+void JitCompiler::call(const void *helper) {
+    patch64(copy(CALL) + 2, (uint64_t)helper);
+    std::size_t at = copy(JUMP_IF_EQUAL);
+    patch32(at + 2, (int32_t)JIT_ERROR);
+    jumpTo(at + 8, exit);
+}
+
+// helper(x, frame)
+void JitCompiler::callNode(const void *helper, ExprBase *x) {
+    patch64(copy(MOV_RDI_IMM) + 2, (uint64_t)x);
+    copy(MOV_RSI_FRAME);
+    call(helper);
+}
+
+void JitCompiler::variable(Var *var) {
+    if (!validName(var->x)) {
+        callNode((const void *)jitEval, var);
+        return;
+    }
+    if (var->depth < 0) {
+        constant((uintptr_t)&var->cell->v.bits);
+        load(0);
+    } else {
+        copy(MOV_RAX_FRAME);
+        for (int d = 0; d < var->depth; d++) {
+            load(l.frame_next);
+        }
+        load(l.frame_slots);
+        load(8 * var->slot);
+        if (var->boxed) load(l.box_value);
+    }
+    //unbound: the tree walker gives the primitive of that name or the error
+    int bound = label();
+    jumpTo(copy(JUMP_IF_VALUE) + 5, bound);
+    callNode((const void *)jitEval, var);
+    bind(bound);
+}
+
+// falls through if rax is a heap value of type t; the returned label is taken otherwise
+int JitCompiler::checkType(ValueType t) {
+    int other = label();
+    std::size_t at = copy(CHECK_TYPE);
+    jumpTo(at + 4, other);
+    jumpTo(at + 13, other);
+    patch32(at + 19, l.value_type);
+    patch8(at + 23, t);
+    jumpTo(at + 26, other);
+    return other;
+}
+
+// callee and arguments in consecutive stack slots, then the call through a helper
+void JitCompiler::apply(Apply *x, bool tail) {
+    int base = temps;
+    temps += 1 + x->rand.size();
+    if (temps > max_temps) max_temps = temps;
+    expr(x->rator.get(), false);
+    patch32(copy(STORE_TEMP) + 4, temp(base));
+    int other = checkType(V_PROC), checked = label();
+    jumpTo(copy(JUMP) + 1, checked);
+    bind(other);
+    copy(MOV_RDI_RAX);
+    call((const void *)jitApplicable);
+    bind(checked);
+    for (int i = 0; i < x->rand.size(); i++) {
+        expr(x->rand[i].get(), false);
+        patch32(copy(STORE_TEMP) + 4, temp(base + 1 + i));
+    }
+    patch64(copy(MOV_RDI_IMM) + 2, (uint64_t)x);
+    patch32(copy(LEA_RSI_TEMP) + 4, temp(base));
+    call(tail ? (const void *)jitTailApply : (const void *)jitApply);
+    temps = base;
+}
+
+void JitCompiler::unary(Unary *x) {
+    expr(x->rand.get(), false);
+    switch (x->e_type) {
+        case E_NULLQ:
+        case E_NOT: {
+            std::size_t at = copy(SELECT_EQUAL);
+            patch32(at + 2, (int32_t)(x->e_type == E_NULLQ ? Value::NULL_BITS : Value::FALSE_BITS));
+            patch32(at + 7, (int32_t)Value::FALSE_BITS);
+            patch32(at + 12, (int32_t)Value::TRUE_BITS);
+            return;
+        }
+        case E_CAR:
+        case E_CDR: {
+            int slow = checkType(V_PAIR), done = label();
+            load(x->e_type == E_CAR ? l.pair_car : l.pair_cdr);
+            jumpTo(copy(JUMP) + 1, done);
+            bind(slow);
+            copy(MOV_RSI_RAX);
+            patch64(copy(MOV_RDI_IMM) + 2, (uint64_t)x);
+            call((const void *)jitUnary);
+            bind(done);
+            return;
+        }
+        default:
+            copy(MOV_RSI_RAX);
+            patch64(copy(MOV_RDI_IMM) + 2, (uint64_t)x);
+            call((const void *)jitUnary);
+    }
+}
+
+void JitCompiler::binary(Binary *x) {
+    //first operand in a stack slot while the second is evaluated, then rsi and rdx
+    int slot = temps++;
+    if (temps > max_temps) max_temps = temps;
+    expr(x->rand1.get(), false);
+    patch32(copy(STORE_TEMP) + 4, temp(slot));
+    expr(x->rand2.get(), false);
+    copy(MOV_RDX_RAX);
+    patch32(copy(LOAD_RSI_TEMP) + 4, temp(slot));
+    temps--;
+
+    int slow = label(), done = label();
+    unsigned char cc = 0;
+    switch (x->e_type) {
+        case E_PLUS:
+        case E_MINUS:
+        case E_MUL:
+            jumpTo(copy(CHECK_FIXNUMS) + 8, slow);
+            copy(UNTAG);
+            if (x->e_type == E_PLUS) copy(ADD);
+            else if (x->e_type == E_MINUS) copy(SUB);
+            else copy(MUL);
+            jumpTo(copy(RETAG) + 8, slow);
+            jumpTo(copy(JUMP) + 1, done);
+            break;
+        case E_LT: cc = CC_LESS; break;
+        case E_LE: cc = CC_LESS_EQ; break;
+        case E_EQ: cc = CC_EQUAL; break;
+        case E_GE: cc = CC_GREATER_EQ; break;
+        case E_GT: cc = CC_GREATER; break;
+        default: break;
+    }
+    if (cc != 0) {//fixnums compare like their tagged words
+        jumpTo(copy(CHECK_FIXNUMS) + 8, slow);
+        std::size_t at = copy(COMPARE);
+        patch32(at + 4, (int32_t)Value::FALSE_BITS);
+        patch32(at + 9, (int32_t)Value::TRUE_BITS);
+        patch8(at + 15, cc);
+        jumpTo(copy(JUMP) + 1, done);
+    }
+    bind(slow);
+    patch64(copy(MOV_RDI_IMM) + 2, (uint64_t)x);
+    call((const void *)jitBinary);
+    bind(done);
+}
+
+// x's value in rax; in tail position, go on to the epilogue with it
+void JitCompiler::expr(ExprBase *x, bool tail) {
+    switch (x->e_type) {
+        case E_FIXNUM:
+            constant(IntegerV(static_cast<Fixnum*>(x)->n).bits);
+            break;
+        case E_TRUE:
+            constant(Value::TRUE_BITS);
+            break;
+        case E_FALSE:
+            constant(Value::FALSE_BITS);
+            break;
+        case E_VOID:
+            constant(Value::VOID_BITS);
+            break;
+        case E_BIGNUM:
+            constant(static_cast<BignumNum*>(x)->value.bits);
+            break;
+        case E_FLONUM:
+            constant(static_cast<FlonumNum*>(x)->value.bits);
+            break;
+        case E_STRING:
+            constant(static_cast<StringExpr*>(x)->value.bits);
+            break;
+        case E_QUOTE:
+            constant(static_cast<Quote*>(x)->value.bits);
+            break;
+        case E_VAR:
+            variable(static_cast<Var*>(x));
+            break;
+        case E_IF: {
+            If *node = static_cast<If*>(x);
+            int alter = label(), end = label();
+            expr(node->cond.get(), false);
+            std::size_t at = copy(JUMP_IF_EQUAL);
+            patch32(at + 2, (int32_t)Value::FALSE_BITS);
+            jumpTo(at + 8, alter);
+            expr(node->conseq.get(), tail);
+            if (!tail) jumpTo(copy(JUMP) + 1, end);
+            bind(alter);
+            expr(node->alter.get(), tail);
+            bind(end);
+            return;
+        }
+        case E_BEGIN: {
+            Begin *node = static_cast<Begin*>(x);
+            if (node->es.empty()) {
+                constant(Value::VOID_BITS);
+                break;
+            }
+            for (int i = 0; i + 1 < node->es.size(); i++) {
+                expr(node->es[i].get(), false);
+            }
+            expr(node->es.back().get(), tail);
+            return;
+        }
+        case E_APPLY:
+            if (dynamic_cast<InlinedApply*>(x) == nullptr) {
+                apply(static_cast<Apply*>(x), tail);
+                break;
+            }
+            callNode(tail ? (const void *)jitStep : (const void *)jitEval, x);
+            break;
+        default:
+            if (Unary *u = dynamic_cast<Unary*>(x)) {
+                unary(u);
+            } else if (Binary *b = dynamic_cast<Binary*>(x)) {
+                binary(b);
+            } else {//calls, bindings, definitions...: the tree walker runs them
+                callNode(tail ? (const void *)jitStep : (const void *)jitEval, x);
+            }
+    }
+    if (tail) jumpTo(copy(JUMP) + 1, exit);
+}
+
+// resolve the jumps and copy the code into executable memory
+JitCode JitCompiler::finish() {
+    for (int i = 0; i < fixups.size(); i++) {
+        std::size_t at = fixups[i].first;
+        patch32(at, (int32_t)(labels[fixups[i].second] - (long)(at + 4)));
+    }
+    char *memory = allocCode(code.size());
+    if (memory == nullptr) return nullptr;
+    if (!writeCode(memory, code)) {
+        freeCode(memory, code.size());
+        return nullptr;
+    }
+    return reinterpret_cast<JitCode>(memory);
+}
+
+ExprBase *jitCompile(JitState *jit, ExprBase *body) {
+    JitCompiler c;
+    c.exit = c.label();
+    c.copy(PROLOGUE);
+    c.expr(body, true);
+    c.bind(c.exit);
+    c.copy(EPILOGUE);
+    JitCode code = c.finish();
+    if (code == nullptr) {
+        jit->failed = true;
+        return body;
+    }
+    bodies_compiled++;
+    code_bytes += c.code.size();
+    gcChargeBudget(c.code.size());//freed once the lambda and its closures are collected
+    jit->entry = new JitBody(body->e_type, code, c.code.size(), c.max_temps);
+    return jit->entry;
+}
+
+#else
+
+ExprBase *jitCompile(JitState *jit, ExprBase *body) {
+    jit->failed = true;
+    return body;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+/**
+ * @file jit.hpp
+ * @brief Copy-and-patch JIT for hot procedure bodies (tree engine, x86-64 Linux)
+ *
+ * Every lambda counts the calls of its closures made by the tree walker;
+ * when the count reaches jit_threshold, its body is compiled by copying
+ * precompiled machine-code stencils for each node into mmap'd memory and
+ * patching their holes (constants, slot offsets, node and helper addresses,
+ * jump targets). Constants, variables, If, Begin, the operands of calls and
+ * the fixnum/pair fast paths of the common primitives become straight-line
+ * native code; a call enters its callee through a runtime helper, and any
+ * other node is a stencil calling back into the interpreter, so jitted and
+ * interpreted code call each other freely.
+ *
+ * A call made in tail position leaves the callee pending instead of
+ * recursing, and the trampoline continues with it, so tail calls still take
+ * constant C++ stack. Errors raised by the interpreter are caught before
+ * they reach native frames and raised again once outside them. On other
+ * platforms nothing is compiled and every body stays interpreted.
+ */
+
+#include "Def.hpp"
+#include "expr.hpp"
+
+/**
+ * @brief Calls before a body is compiled; 0 turns the JIT off
+ * (--no-jit, --jit-threshold=N)
+ */
+extern int jit_threshold;
+
+/**
+ * @brief JIT state of one lambda, shared by all its closures
+ *
+ * Held by the lambda and by each closure made from it; once the last of
+ * them is gone it is retired, and freed with its native code by
+ * jitFreeRetired between top-level forms, where no body runs.
+ */
+struct JitState {
+    int calls;          ///< Calls counted so far
+    bool failed;        ///< Could not be compiled, stays interpreted
+    ExprBase *entry;    ///< Node running the native code, nullptr until compiled
+    int holders;        ///< The lambda and its closures
+    JitState() : calls(0), failed(false), entry(nullptr), holders(1) {}
+    ~JitState();
+};
+
+void jitRelease(JitState *);   ///< A holder is gone
+void jitFreeRetired();         ///< Free the states no one holds any more
+
+/**
+ * @brief Compile body; returns the node running it, or body itself if it cannot be compiled
+ */
+ExprBase *jitCompile(JitState *jit, ExprBase *body);
+
+/**
+ * @brief What a call continues with: the native code of body once it is hot
+ */
+inline ExprBase *jitEntry(JitState *jit, ExprBase *body) {
+    if (jit->entry != nullptr) return jit->entry;
+    if (jit_threshold <= 0 || jit->failed || ++jit->calls < jit_threshold) return body;
+    return jitCompile(jit, body);
+}
+
+void reportJitStats(std::ostream &);    ///< Bodies compiled and freed and code size, printed by --jit-stats
+
+#endif // JIT_HPP
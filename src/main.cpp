@@ -3,9 +3,18 @@
 #include "expr.hpp"
 #include "value.hpp"
 #include "RE.hpp"
+#include "gc.hpp"
+#include "vm.hpp"
+#include "closure.hpp"
+#include "cek.hpp"
+#include "optimize.hpp"
+#include "aot.hpp"
+#include "jit.hpp"
 #include <sstream>
 #include <iostream>
 #include <map>
+#include <cstring>
+#include <cstdlib>
 
 extern std::map<std::string, ExprType> primitives;
 extern std::map<std::string, ExprType> reserved_words;
@@ -19,7 +28,7 @@ bool isExplicitVoidCall(Expr expr) {
     Apply* apply_expr = dynamic_cast<Apply*>(expr.get());
     if (apply_expr != nullptr) {
         Var* var_expr = dynamic_cast<Var*>(apply_expr->rator.get());
-        if (var_expr != nullptr && var_expr->x == "void") {
+        if (var_expr != nullptr && symbolName(var_expr->x) == "void") {
             return true;
         }
     }
@@ -45,7 +54,26 @@ bool isExplicitVoidCall(Expr expr) {
     return false;
 }
 
-void REPL(){
+/**
+ * @brief Execution engine, chosen with --engine=
+ */
+enum Engine {
+    ENGINE_TREE,    ///< tree-walking eval (default)
+    ENGINE_VM,      ///< bytecode virtual machine
+    ENGINE_CLOSURE, ///< pre-bound C++ functors
+    ENGINE_CEK      ///< explicit-stack machine with call/cc
+};
+
+static Value evaluate(Engine engine, const Expr &expr, Assoc &env) {
+    switch (engine) {
+        case ENGINE_VM:      return vmEval(expr, env);
+        case ENGINE_CLOSURE: return closureEval(expr, env);
+        case ENGINE_CEK:     return cekEval(expr, env);
+        default:             return expr -> eval(env);
+    }
+}
+
+void REPL(Engine engine){
     // read - evaluation - print loop
     Assoc global_env = empty();
     while (1){
@@ -56,22 +84,111 @@ void REPL(){
         try{
             Expr expr = stx -> parse(global_env); // parse
             // stx -> show(std :: cout); // syntax print
-            Value val = expr -> eval(global_env);
-            if (val -> v_type == V_TERMINATE)
+            bool explicit_void = isExplicitVoidCall(expr); // decided on the source, before it is rewritten
+            expr = optimize(expr);
+            Value val = evaluate(engine, expr, global_env);
+            if (val.type() == V_TERMINATE)
                 break;
-            if(!(val -> v_type == V_VOID && !(isExplicitVoidCall(expr))))
-                val -> show(std :: cout); // value print
+            if(!(val.type() == V_VOID && !explicit_void))
+                val.show(std :: cout); // value print
         }
         catch (const RuntimeError &RE){
             // std :: cout << RE.message();
             std :: cout << "RuntimeError";
         }
         puts("");
+        gcSafePoint(global_env); // nothing is live on the evaluator stack here
+        releaseBodies();
     }
 }
 
+/**
+ * @brief Read the whole program and write it as C++ (--emit-cpp)
+ *
+ * Forms are parsed as the REPL would, but none is run; one that fails to
+ * parse raises its error when the compiled program reaches it. The program
+ * ends at the end of the input instead of waiting for more.
+ */
+void emitProgram(std::istream &is, std::ostream &os) {
+    Assoc global_env = empty();
+    std::vector<AotForm> forms;
+    while (readSpace(is).peek() != EOF) {
+        Syntax stx = readSyntax(is);
+        try {
+            Expr expr = stx -> parse(global_env);
+            bool explicit_void = isExplicitVoidCall(expr);
+            forms.push_back(AotForm(optimize(expr), "", explicit_void));
+        }
+        catch (const RuntimeError &RE) {
+            forms.push_back(AotForm(Expr(nullptr), RE.message(), false));
+        }
+    }
+    emitCpp(forms, os);
+}
 
 int main(int argc, char *argv[]) {
-    REPL();
+    bool gc_stats = false;
+    bool ic_stats = false;
+    bool fusion_stats = false;
+    bool jit_stats = false;
+    bool emit_cpp = false;
+    Engine engine = ENGINE_TREE;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--gc-stats") == 0) {
+            gc_stats = true;
+        } else if (strcmp(argv[i], "--ic-stats") == 0) {
+            ic_stats = true;
+        } else if (strcmp(argv[i], "--fusion-stats") == 0) {
+            fusion_stats = true;
+        } else if (strcmp(argv[i], "--no-inline") == 0) {
+            inline_budget = 0;
+        } else if (strncmp(argv[i], "--inline-budget=", 16) == 0) {
+            inline_budget = atoi(argv[i] + 16);
+        } else if (strcmp(argv[i], "--jit-stats") == 0) {
+            jit_stats = true;
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            jit_threshold = 0;
+        } else if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+            jit_threshold = atoi(argv[i] + 16);
+        } else if (strcmp(argv[i], "--emit-cpp") == 0) {
+            emit_cpp = true;
+        } else if (strcmp(argv[i], "--engine=vm") == 0) {
+            engine = ENGINE_VM;
+        } else if (strcmp(argv[i], "--engine=closure") == 0) {
+            engine = ENGINE_CLOSURE;
+        } else if (strcmp(argv[i], "--engine=cek") == 0) {
+            engine = ENGINE_CEK;
+        } else if (strcmp(argv[i], "--engine=tree") == 0) {
+            engine = ENGINE_TREE;
+        }
+    }
+    if (emit_cpp) {
+        inline_budget = 0;//inlined calls check the global values seen while parsing
+        emitProgram(std :: cin, std :: cout);
+        return 0;
+    }
+    if (engine != ENGINE_TREE) {
+        jit_threshold = 0;//only the tree walker enters native code
+    }
+    bool jit_off_for_stats = (ic_stats || fusion_stats) && jit_threshold > 0;
+    if (jit_off_for_stats) {
+        jit_threshold = 0;//native code skips the call caches and fused nodes these count
+    }
+    REPL(engine);
+    if (gc_stats) {
+        gcReportStats(std :: cerr);
+    }
+    if (ic_stats) {
+        reportCallCacheStats(std :: cerr);
+    }
+    if (fusion_stats) {
+        reportFusionStats(std :: cerr);
+    }
+    if (jit_stats) {
+        reportJitStats(std :: cerr);
+    }
+    if (jit_off_for_stats) {
+        std :: cerr << "jit: off while --ic-stats or --fusion-stats count" << std :: endl;
+    }
     return 0;
 }
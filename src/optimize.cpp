@@ -0,0 +1,455 @@
+/**
+ * @file optimize.cpp
+ * @brief Constant folding and branch pruning
+ *
+ * The pass works bottom-up: children are optimized first, so a folded
+ * operand can make its parent foldable in turn. Folding simply evaluates the
+ * node with its literal operands; if that raises an error the node is kept,
+ * and the error is raised when (and if) the node is evaluated. So is a node
+ * whose exact result would be huge, such as (expt 3 1000000). Branches behind
+ * a literal test are pruned before they are optimized, so nothing in them is
+ * ever folded.
+ *
+ * Calls of small global procedures are inlined, guarded by an InlinedApply
+ * that checks the global was not redefined since. When every operand is a
+ * literal or a local, it is substituted for its parameter and the body runs
+ * in the caller's frame; otherwise a Let binds the parameters, as the call
+ * would. The size budget counts the bodies already inlined into a callee, so
+ * a chain of helpers stops being inlined once the combined code outgrows it.
+ */
+
+#include "optimize.hpp"
+#include "value.hpp"
+#include "RE.hpp"
+#include <algorithm>
+#include <exception>
+#include <map>
+
+extern std::map<std::string, ExprType> primitives;
+
+//whether x evaluates to a constant without side effects
+static bool isLiteral(const Expr &x) {
+    switch (x->e_type) {
+        case E_FIXNUM: case E_BIGNUM: case E_FLONUM: case E_RATIONAL: case E_STRING: case E_TRUE: case E_FALSE: case E_QUOTE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+//primitives without side effects whose result depends only on their operands
+static bool isPure(ExprType t) {
+    switch (t) {
+        case E_PLUS: case E_MINUS: case E_MUL: case E_DIV: case E_MODULO: case E_EXPT:
+        case E_EXACT_TO_INEXACT: case E_INEXACT_TO_EXACT:
+        case E_LT: case E_LE: case E_EQ: case E_GE: case E_GT:
+        case E_NOT: case E_AND: case E_OR: case E_EQQ:
+        case E_BOOLQ: case E_INTQ: case E_NULLQ: case E_PAIRQ: case E_PROCQ:
+        case E_SYMBOLQ: case E_LISTQ: case E_STRINGQ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+//exact results with more bits than this are left to run time: computing one could take long,
+//for a call that may never run, and its literal would bloat the tree
+static const std::size_t FOLD_MAX_BITS = 4096;
+
+//bits in the magnitude of an exact number, the larger part of a rational; 0 for anything else
+static std::size_t exactBits(const Value &v) {
+    switch (v.type()) {
+        case V_INT:
+            return BigInt(v.fixnum()).bitLength();
+        case V_BIGNUM:
+            return static_cast<Bignum*>(v.get())->n.bitLength();
+        case V_RATIONAL: {
+            Rational *r = static_cast<Rational*>(v.get());
+            BigInt numerator = r->big ? r->big_numerator : BigInt(r->numerator);
+            BigInt denominator = r->big ? r->big_denominator : BigInt(r->denominator);
+            return std::max(numerator.bitLength(), denominator.bitLength());
+        }
+        default:
+            return 0;
+    }
+}
+
+//whether the result of x, a pure primitive on literals, may exceed FOLD_MAX_BITS;
+//only expt grows much faster than its operands
+static bool tooLargeToFold(const Expr &x) {
+    if (x->e_type != E_EXPT) return false;
+    Expt *expt = static_cast<Expt*>(x.get());
+    Assoc env = empty();
+    Value base = expt->rand1->eval(env);
+    Value exponent = expt->rand2->eval(env);
+    if (exponent.type() == V_BIGNUM) return exactBits(base) > 1;
+    if (exponent.type() != V_INT) return false;
+    double e = exponent.fixnum() < 0 ? -(double)exponent.fixnum() : (double)exponent.fixnum();
+    return exactBits(base) * e > FOLD_MAX_BITS;
+}
+
+//x evaluated once and for all, if its value has a literal node; otherwise x
+static Expr fold(const Expr &x) {
+    if (tooLargeToFold(x)) return x;
+    Assoc env = empty();
+    Value v(nullptr);
+    try {
+        v = x->eval(env);
+    } catch (const RuntimeError &) {
+        return x;
+    } catch (const std::exception &) {
+        return x;
+    }
+    if (exactBits(v) > FOLD_MAX_BITS) return x;
+    switch (v.type()) {
+        case V_INT:
+            return Expr(new Fixnum(v.fixnum()));
+        case V_BIGNUM:
+            return Expr(new BignumNum(static_cast<Bignum*>(v.get())->n));
+        case V_FLONUM:
+            return Expr(new FlonumNum(flonumValue(v)));
+        case V_BOOL:
+            return v.isFalse() ? Expr(new False()) : Expr(new True());
+        case V_RATIONAL: {
+            Rational *r = static_cast<Rational*>(v.get());
+            if (r->big) return Expr(new RationalNum(r->big_numerator, r->big_denominator));
+            return Expr(new RationalNum(BigInt(r->numerator), BigInt(r->denominator)));
+        }
+        default:
+            return x;
+    }
+}
+
+int inline_budget = 16;
+
+//direct subexpressions of x
+static void children(ExprBase *x, std::vector<ExprBase*> &out) {
+    if (Unary *unary = dynamic_cast<Unary*>(x)) {
+        out.push_back(unary->rand.get());
+        return;
+    }
+    if (Binary *binary = dynamic_cast<Binary*>(x)) {
+        out.push_back(binary->rand1.get());
+        out.push_back(binary->rand2.get());
+        return;
+    }
+    const std::vector<Expr> *operands = nullptr;
+    if (Variadic *variadic = dynamic_cast<Variadic*>(x)) operands = &variadic->rands;
+    else if (AndVar *and_expr = dynamic_cast<AndVar*>(x)) operands = &and_expr->rands;
+    else if (OrVar *or_expr = dynamic_cast<OrVar*>(x)) operands = &or_expr->rands;
+    else if (Begin *begin = dynamic_cast<Begin*>(x)) operands = &begin->es;
+    if (operands != nullptr) {
+        for (int i = 0; i < operands->size(); i++) out.push_back((*operands)[i].get());
+        return;
+    }
+    switch (x->e_type) {
+        case E_IF: {
+            If *if_expr = static_cast<If*>(x);
+            out.push_back(if_expr->cond.get());
+            out.push_back(if_expr->conseq.get());
+            out.push_back(if_expr->alter.get());
+            break;
+        }
+        case E_COND: {
+            Cond *cond = static_cast<Cond*>(x);
+            for (int i = 0; i < cond->clauses.size(); i++) {
+                for (int j = 0; j < cond->clauses[i].size(); j++) out.push_back(cond->clauses[i][j].get());
+            }
+            break;
+        }
+        case E_APPLY: {
+            Apply *apply = static_cast<Apply*>(x);
+            out.push_back(apply->rator.get());
+            for (int i = 0; i < apply->rand.size(); i++) out.push_back(apply->rand[i].get());
+            //a call inlined earlier also carries the callee's body
+            if (InlinedApply *inlined = dynamic_cast<InlinedApply*>(x)) out.push_back(inlined->body.get());
+            break;
+        }
+        case E_LAMBDA:
+            out.push_back(static_cast<Lambda*>(x)->e.get());
+            break;
+        case E_DEFINE:
+            out.push_back(static_cast<Define*>(x)->e.get());
+            break;
+        case E_SET:
+            out.push_back(static_cast<Set*>(x)->e.get());
+            break;
+        case E_LET: {
+            Let *let = static_cast<Let*>(x);
+            for (int i = 0; i < let->bind.size(); i++) out.push_back(let->bind[i].second.get());
+            out.push_back(let->body.get());
+            break;
+        }
+        case E_LETREC: {
+            Letrec *letrec = static_cast<Letrec*>(x);
+            for (int i = 0; i < letrec->bind.size(); i++) out.push_back(letrec->bind[i].second.get());
+            out.push_back(letrec->body.get());
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+//whether x has at most budget nodes and never mentions the global self
+static bool smallAndNonRecursive(ExprBase *x, GlobalCell *self, int budget) {
+    std::vector<ExprBase*> todo(1, x);
+    int size = 0;
+    while (!todo.empty()) {
+        ExprBase *node = todo.back();
+        todo.pop_back();
+        if (++size > budget) return false;
+        if (node->e_type == E_VAR && static_cast<Var*>(node)->cell == self) return false;
+        children(node, todo);
+    }
+    return true;
+}
+
+//a name of the primitive t, to rebuild its node
+static const std::string &primitiveName(ExprType t) {
+    static std::map<ExprType, std::string> names;
+    if (names.empty()) {
+        for (auto it = primitives.begin(); it != primitives.end(); ++it) names[it->second] = it->first;
+    }
+    return names[t];
+}
+
+//whether evaluating x any number of times, or not at all, is the same as evaluating it once at the call
+static bool duplicable(const Expr &x) {
+    if (isLiteral(x)) return true;
+    Var *var = dynamic_cast<Var*>(x.get());
+    return var != nullptr && var->depth >= 0 && !var->boxed && validName(var->x);
+}
+
+static bool substituteAll(const std::vector<Expr> &xs, const std::vector<Expr> &args, std::vector<Expr> &out);
+
+//x, part of a body without binding forms, with the parameters replaced by args;
+//an empty Expr if x has a node the substitution does not handle
+static Expr substitute(const Expr &x, const std::vector<Expr> &args) {
+    ExprBase *node = x.get();
+    if (node->e_type == E_VAR) {
+        Var *var = static_cast<Var*>(node);
+        if (var->depth < 0) return x;
+        if (var->depth == 0 && !var->boxed) return args[var->slot];
+        return Expr(nullptr);
+    }
+    std::vector<Expr> operands;
+    if (Unary *unary = dynamic_cast<Unary*>(node)) {
+        operands.push_back(unary->rand);
+    } else if (Binary *binary = dynamic_cast<Binary*>(node)) {
+        operands.push_back(binary->rand1);
+        operands.push_back(binary->rand2);
+    } else if (Variadic *variadic = dynamic_cast<Variadic*>(node)) {
+        operands = variadic->rands;
+    } else if (AndVar *and_expr = dynamic_cast<AndVar*>(node)) {
+        operands = and_expr->rands;
+    } else if (OrVar *or_expr = dynamic_cast<OrVar*>(node)) {
+        operands = or_expr->rands;
+    } else {
+        switch (node->e_type) {
+            case E_FIXNUM: case E_BIGNUM: case E_FLONUM: case E_RATIONAL: case E_STRING: case E_TRUE: case E_FALSE:
+            case E_QUOTE: case E_VOID: case E_EXIT:
+                return x;
+            case E_IF: {
+                If *if_expr = static_cast<If*>(node);
+                Expr cond = substitute(if_expr->cond, args);
+                Expr conseq = substitute(if_expr->conseq, args);
+                Expr alter = substitute(if_expr->alter, args);
+                if (cond.get() == nullptr || conseq.get() == nullptr || alter.get() == nullptr) return Expr(nullptr);
+                if (isLiteral(cond)) return cond->e_type == E_FALSE ? alter : conseq;
+                return Expr(new If(cond, conseq, alter));
+            }
+            case E_COND: {
+                Cond *cond = static_cast<Cond*>(node);
+                std::vector<std::vector<Expr>> clauses(cond->clauses.size());
+                for (int i = 0; i < cond->clauses.size(); i++) {
+                    if (!substituteAll(cond->clauses[i], args, clauses[i])) return Expr(nullptr);
+                }
+                return Expr(new Cond(clauses));
+            }
+            case E_BEGIN: {
+                std::vector<Expr> es;
+                if (!substituteAll(static_cast<Begin*>(node)->es, args, es)) return Expr(nullptr);
+                return Expr(new Begin(es));
+            }
+            case E_APPLY: {
+                Apply *apply = static_cast<Apply*>(node);
+                Expr rator = substitute(apply->rator, args);
+                std::vector<Expr> rand;
+                if (rator.get() == nullptr || !substituteAll(apply->rand, args, rand)) return Expr(nullptr);
+                if (InlinedApply *inlined = dynamic_cast<InlinedApply*>(node)) {
+                    //the body inlined there runs in this frame too: substitute into it rather than inline again,
+                    //which would redo the whole nested inlining at every level
+                    Expr body = substitute(inlined->body, args);
+                    if (body.get() != nullptr) return Expr(new InlinedApply(rator, rand, inlined->cell, inlined->proc, body));
+                }
+                return Expr(new Apply(rator, rand));
+            }
+            default://binding forms
+                return Expr(nullptr);
+        }
+    }
+    std::vector<Expr> substituted;
+    if (!substituteAll(operands, args, substituted)) return Expr(nullptr);
+    Expr rebuilt = primitiveNode(node->e_type, primitiveName(node->e_type), substituted);
+    if (!isPure(node->e_type)) return rebuilt;
+    for (int i = 0; i < substituted.size(); i++) {
+        if (!isLiteral(substituted[i])) return rebuilt;
+    }
+    return fold(rebuilt);
+}
+
+static bool substituteAll(const std::vector<Expr> &xs, const std::vector<Expr> &args, std::vector<Expr> &out) {
+    for (int i = 0; i < xs.size(); i++) {
+        out.push_back(substitute(xs[i], args));
+        if (out.back().get() == nullptr) return false;
+    }
+    return true;
+}
+
+//an InlinedApply running the body of proc, the value of cell, on rand; an empty Expr if proc is not inlined
+static Expr inlineCall(GlobalCell *cell, Procedure *proc, const Expr &rator, const std::vector<Expr> &rand) {
+    //the body must not reach past its own frame, which the inlined code replaces
+    if (proc->env.get() != nullptr || !proc->boxed.empty()) return Expr(nullptr);
+    if (proc->parameters.size() != rand.size()) return Expr(nullptr);
+    for (int i = 0; i < rand.size(); i++) {
+        if (!validName(proc->parameters[i])) return Expr(nullptr);
+    }
+    if (!smallAndNonRecursive(proc->e.get(), cell, inline_budget)) return Expr(nullptr);
+    //with operands that can be duplicated the body runs in the caller's frame
+    bool trivial = true;
+    for (int i = 0; i < rand.size(); i++) {
+        if (!duplicable(rand[i])) trivial = false;
+    }
+    Expr body = trivial ? substitute(proc->e, rand) : Expr(nullptr);
+    if (body.get() == nullptr) {//otherwise a Let binds the parameters, like the call would
+        std::vector<std::pair<SymbolId, Expr>> bind;
+        for (int i = 0; i < rand.size(); i++) {
+            bind.push_back(std::make_pair(proc->parameters[i], rand[i]));
+        }
+        body = Expr(new Let(bind, proc->e, std::vector<bool>(rand.size(), false)));
+    }
+    return Expr(new InlinedApply(rator, rand, cell, proc, body));
+}
+
+static void optimizeAll(std::vector<Expr> &es) {
+    for (int i = 0; i < es.size(); i++) {
+        es[i] = optimize(es[i]);
+    }
+}
+
+static Expr optimizeCond(Cond *cond, const Expr &x) {
+    //drop the clauses whose test is #f, and those after a test that is always true,
+    //before their bodies are optimized: nothing in them is folded
+    std::vector<std::vector<Expr>> clauses;
+    for (int i = 0; i < cond->clauses.size(); i++) {
+        std::vector<Expr> &clause = cond->clauses[i];
+        clause[0] = optimize(clause[0]);
+        if (clause[0]->e_type == E_FALSE) continue;
+        for (int j = 1; j < clause.size(); j++) {
+            clause[j] = optimize(clause[j]);
+        }
+        clauses.push_back(clause);
+        if (isLiteral(clause[0])) break;
+    }
+    if (clauses.empty()) {
+        return Expr(new MakeVoid());
+    }
+    if (isLiteral(clauses[0][0])) {//the first clause is always taken
+        if (clauses[0].size() == 1) return clauses[0][0];
+        if (clauses[0].size() == 2) return clauses[0][1];
+        return Expr(new Begin(std::vector<Expr>(clauses[0].begin() + 1, clauses[0].end())));
+    }
+    cond->clauses = clauses;
+    return x;
+}
+
+Expr optimize(const Expr &x) {
+    ExprBase *node = x.get();
+    if (Unary *unary = dynamic_cast<Unary*>(node)) {
+        unary->rand = optimize(unary->rand);
+        if (isPure(node->e_type) && isLiteral(unary->rand)) return fold(x);
+        return x;
+    }
+    if (Binary *binary = dynamic_cast<Binary*>(node)) {
+        binary->rand1 = optimize(binary->rand1);
+        binary->rand2 = optimize(binary->rand2);
+        if (isPure(node->e_type) && isLiteral(binary->rand1) && isLiteral(binary->rand2)) return fold(x);
+        return x;
+    }
+    std::vector<Expr> *operands = nullptr;
+    if (Variadic *variadic = dynamic_cast<Variadic*>(node)) operands = &variadic->rands;
+    else if (AndVar *and_expr = dynamic_cast<AndVar*>(node)) operands = &and_expr->rands;
+    else if (OrVar *or_expr = dynamic_cast<OrVar*>(node)) operands = &or_expr->rands;
+    if (operands != nullptr) {
+        optimizeAll(*operands);
+        if (!isPure(node->e_type)) return x;
+        for (int i = 0; i < operands->size(); i++) {
+            if (!isLiteral((*operands)[i])) return x;
+        }
+        return fold(x);
+    }
+    switch (node->e_type) {
+        case E_IF: {
+            If *if_expr = static_cast<If*>(node);
+            if_expr->cond = optimize(if_expr->cond);
+            if (isLiteral(if_expr->cond)) {//the other branch is dropped unoptimized
+                return optimize(if_expr->cond->e_type == E_FALSE ? if_expr->alter : if_expr->conseq);
+            }
+            if_expr->conseq = optimize(if_expr->conseq);
+            if_expr->alter = optimize(if_expr->alter);
+            return x;
+        }
+        case E_COND:
+            return optimizeCond(static_cast<Cond*>(node), x);
+        case E_BEGIN: {
+            Begin *begin = static_cast<Begin*>(node);
+            optimizeAll(begin->es);
+            if (begin->es.size() == 1) return begin->es[0];
+            return x;
+        }
+        case E_APPLY: {
+            Apply *apply = static_cast<Apply*>(node);
+            apply->rator = optimize(apply->rator);
+            optimizeAll(apply->rand);
+            if (inline_budget <= 0 || apply->rator->e_type != E_VAR) return x;
+            GlobalCell *cell = static_cast<Var*>(apply->rator.get())->cell;
+            if (cell == nullptr || cell->assigned || cell->v.empty() || cell->v.type() != V_PROC) return x;
+            Expr code = inlineCall(cell, static_cast<Procedure*>(cell->v.get()), apply->rator, apply->rand);
+            return code.get() == nullptr ? x : code;
+        }
+        case E_LAMBDA: {
+            Lambda *lambda = static_cast<Lambda*>(node);
+            lambda->e = optimize(lambda->e);
+            return x;
+        }
+        case E_DEFINE: {
+            Define *define = static_cast<Define*>(node);
+            define->e = optimize(define->e);
+            return x;
+        }
+        case E_SET: {
+            Set *set = static_cast<Set*>(node);
+            set->e = optimize(set->e);
+            return x;
+        }
+        case E_LET: {
+            Let *let = static_cast<Let*>(node);
+            for (int i = 0; i < let->bind.size(); i++) {
+                let->bind[i].second = optimize(let->bind[i].second);
+            }
+            let->body = optimize(let->body);
+            return x;
+        }
+        case E_LETREC: {
+            Letrec *letrec = static_cast<Letrec*>(node);
+            for (int i = 0; i < letrec->bind.size(); i++) {
+                letrec->bind[i].second = optimize(letrec->bind[i].second);
+            }
+            letrec->body = optimize(letrec->body);
+            return x;
+        }
+        default:
+            return x;
+    }
+}
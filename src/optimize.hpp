@@ -0,0 +1,33 @@
+#ifndef OPTIMIZE_HPP
+#define OPTIMIZE_HPP
+
+/**
+ * @file optimize.hpp
+ * @brief Optimization pass between parse and eval
+ *
+ * Rewrites a parsed expression into an equivalent, cheaper one: pure
+ * primitives applied to literals are folded into their result, If and Cond
+ * with literal tests lose the branches that can never run, and a Begin of a
+ * single expression becomes that expression. Nothing that could raise an
+ * error or has a side effect is folded, so evaluation behaves the same.
+ *
+ * Calls of small, non-recursive global procedures that are never assigned
+ * with set! are inlined; the inlined body is used only while the global
+ * still holds the same procedure.
+ */
+
+#include "Def.hpp"
+#include "expr.hpp"
+
+/**
+ * @brief Largest procedure body, in nodes, that gets inlined; 0 turns the
+ * inliner off (--no-inline, --inline-budget=N)
+ */
+extern int inline_budget;
+
+/**
+ * @brief Optimize x, reusing its nodes in place; returns the new root
+ */
+Expr optimize(const Expr &x);
+
+#endif // OPTIMIZE_HPP
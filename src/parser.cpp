@@ -13,6 +13,7 @@
 #include "value.hpp"
 #include "expr.hpp"
 #include <map>
+#include <set>
 #include <string>
 #include <iostream>
 
@@ -24,6 +25,408 @@ using std::pair;
 extern std::map<std::string, ExprType> primitives;
 extern std::map<std::string, ExprType> reserved_words;
 
+/**
+ * @brief Collect the names assigned in stx by set! or define
+ *
+ * Locals in this set are boxed, so a closure that copies one shares the
+ * assignments. Shadowing and quoted data are ignored: that only boxes more.
+ * When mentioned is given, every symbol in stx is collected there too.
+ */
+static void scanAssigned(const Syntax &stx, std::set<SymbolId> &assigned, std::set<SymbolId> *mentioned) {
+    if (auto sym = dynamic_cast<SymbolSyntax*>(stx.get())) {
+        if (mentioned != nullptr) mentioned->insert(sym->sym);
+        return;
+    }
+    List *list = dynamic_cast<List*>(stx.get());
+    if (list == nullptr) return;
+    if (list->stxs.size() >= 2) {
+        static const SymbolId set_id = intern("set!"), define_id = intern("define");
+        auto head = dynamic_cast<SymbolSyntax*>(list->stxs[0].get());
+        if (head != nullptr && (head->sym == set_id || head->sym == define_id)) {
+            Syntax target = list->stxs[1];
+            if (auto signature = dynamic_cast<List*>(target.get())) {//(define (f x) ...)
+                if (!signature->stxs.empty()) target = signature->stxs[0];
+            }
+            if (auto var = dynamic_cast<SymbolSyntax*>(target.get())) {
+                assigned.insert(var->sym);
+            }
+        }
+    }
+    for (int i = 0; i < list->stxs.size(); i++) {
+        scanAssigned(list->stxs[i], assigned, mentioned);
+    }
+}
+
+static vector<bool> boxFlags(const vector<SymbolId> &names, const std::set<SymbolId> &assigned) {
+    vector<bool> boxed;
+    for (int i = 0; i < names.size(); i++) {
+        boxed.push_back(assigned.count(names[i]) != 0);
+    }
+    return boxed;
+}
+
+static bool anyBoxed(const vector<bool> &boxed) {
+    for (int i = 0; i < boxed.size(); i++) {
+        if (boxed[i]) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Parse a lambda with parameters x and body stxs[2...] into a flat closure
+ *
+ * The body is parsed under a closure scope, which collects the free local
+ * variables it references; the Lambda copies exactly those when evaluated.
+ */
+static Expr parseLambda(const vector<SymbolId> &x, const vector<Syntax> &stxs, Assoc &env) {
+    std::set<SymbolId> assigned;
+    for (int i = 2; i < stxs.size(); i++) {
+        scanAssigned(stxs[i], assigned, nullptr);
+    }
+    vector<bool> boxed = boxFlags(x, assigned);
+    Assoc captured = closureScope(env);
+    //the call frame holds one slot per parameter
+    Assoc lambda_parse_env = extendScope(x, boxed, captured);
+    vector<Expr> es;
+    for (int i = 2; i < stxs.size(); i++){
+        es.push_back(stxs[i]->parse(lambda_parse_env));
+    }
+    if (!anyBoxed(boxed)) boxed.clear();
+    return Expr(new Lambda(x, Expr(new Begin(es)), boxed, captured->scope->captures));
+}
+
+/**
+ * @brief Turn the self-calls of the loop procedure name in tail position of x into LoopCalls
+ *
+ * depth counts the let and letrec frames between x and the procedure's own
+ * frame. Inner lambdas, and bindings that shadow name, are left alone.
+ */
+static Expr loopTails(const Expr &x, SymbolId name, int depth) {
+    switch (x->e_type) {
+        case E_IF: {
+            If *if_expr = static_cast<If*>(x.get());
+            if_expr->conseq = loopTails(if_expr->conseq, name, depth);
+            if_expr->alter = loopTails(if_expr->alter, name, depth);
+            return x;
+        }
+        case E_COND: {
+            Cond *cond = static_cast<Cond*>(x.get());
+            for (int i = 0; i < cond->clauses.size(); i++) {
+                vector<Expr> &clause = cond->clauses[i];
+                if (clause.size() > 1) clause.back() = loopTails(clause.back(), name, depth);
+            }
+            return x;
+        }
+        case E_BEGIN: {
+            Begin *begin = static_cast<Begin*>(x.get());
+            if (!begin->es.empty()) begin->es.back() = loopTails(begin->es.back(), name, depth);
+            return x;
+        }
+        case E_LET: {
+            Let *let = static_cast<Let*>(x.get());
+            for (int i = 0; i < let->bind.size(); i++) {
+                if (let->bind[i].first == name) return x;
+            }
+            let->body = loopTails(let->body, name, depth + 1);
+            return x;
+        }
+        case E_LETREC: {
+            Letrec *letrec = static_cast<Letrec*>(x.get());
+            for (int i = 0; i < letrec->bind.size(); i++) {
+                if (letrec->bind[i].first == name) return x;
+            }
+            letrec->body = loopTails(letrec->body, name, depth + 1);
+            return x;
+        }
+        case E_APPLY: {
+            Apply *apply = static_cast<Apply*>(x.get());
+            Var *var = dynamic_cast<Var*>(apply->rator.get());
+            if (var == nullptr || var->x != name || var->depth < 0) return x;
+            return Expr(new LoopCall(apply->rator, apply->rand, depth));
+        }
+        default:
+            return x;
+    }
+}
+
+/**
+ * @brief Scope of the parameters xs of a loop procedure name, bound by a letrec in env
+ *
+ * captured receives the closure scope of the procedure, for finishLoop.
+ */
+static Assoc loopScope(SymbolId name, const vector<SymbolId> &xs, const vector<bool> &boxed, Assoc &env, Assoc &captured) {
+    Assoc letrec_parse_env = extendScope(vector<SymbolId>(1, name), vector<bool>(1, true), env);
+    captured = closureScope(letrec_parse_env);
+    return extendScope(xs, boxed, captured);
+}
+
+/**
+ * @brief The loop ((letrec ((name (lambda xs body))) name) inits...) of a named let or do
+ *
+ * body was parsed in loopScope. Unless name can be assigned, its self-calls
+ * in tail position rebind the parameters in place (see LoopCall).
+ */
+static Expr finishLoop(SymbolId name, const vector<SymbolId> &xs, vector<bool> boxed, const Assoc &captured,
+                       Expr body, const vector<Expr> &inits, const std::set<SymbolId> &assigned) {
+    bool own_name = assigned.count(name) == 0;
+    for (int i = 0; i < xs.size(); i++) {
+        if (xs[i] == name) own_name = false;
+    }
+    if (own_name) body = loopTails(body, name, 0);
+    if (!anyBoxed(boxed)) boxed.clear();
+    Expr lambda(new Lambda(xs, body, boxed, captured->scope->captures));
+    vector<pair<SymbolId, Expr>> bind(1, std::make_pair(name, lambda));
+    Expr procedure(new Letrec(bind, Expr(new Var(name, 0, 0, true)), vector<bool>(1, true)));
+    return Expr(new Apply(procedure, inits));
+}
+
+//whether x is a variable a fused node may read directly
+static bool fusable(const Expr &x) {
+    Var *v = dynamic_cast<Var*>(x.get());
+    return v != nullptr && validName(v->x);
+}
+
+//(op a b) as a fused node when the operands are variables or a fixnum constant
+template <class Node>
+static Expr binaryNode(const string &op, const Expr &a, const Expr &b) {
+    if (fusable(a)) {
+        if (b->e_type == E_FIXNUM) return Expr(new FusedVarConst<Node>(a, b, "(" + op + " var const)"));
+        if (fusable(b)) return Expr(new FusedVarVar<Node>(a, b, "(" + op + " var var)"));
+    }
+    return Expr(new Node(a, b));
+}
+
+template <class Node>
+static Expr unaryNode(const string &op, const Expr &a) {
+    if (fusable(a)) return Expr(new FusedVar<Node>(a, "(" + op + " var)"));
+    return Expr(new Node(a));
+}
+
+//the node of primitive op applied to parameters; also used by the inliner to rebuild a substituted body
+Expr primitiveNode(ExprType op_type, const string &op, const vector<Expr> &parameters) {
+    if (op_type == E_PLUS) {
+        if (parameters.size() == 2) {
+            return binaryNode<Plus>(op, parameters[0], parameters[1]); 
+        } else {
+            return Expr(new PlusVar(parameters));
+        }
+    } else if (op_type == E_MINUS) {
+        //TO COMPLETE THE LOGIC
+        if (parameters.size() == 0) {
+            throw RuntimeError("Wrong number of arguments for -");
+        }
+        if (parameters.size() == 2) {
+            return binaryNode<Minus>(op, parameters[0], parameters[1]); 
+        } else {
+            return Expr(new MinusVar(parameters));
+        }
+    } else if (op_type == E_MUL) {
+        //TO COMPLETE THE LOGIC
+        if (parameters.size() == 2) {
+            return Expr(new Mult(parameters[0], parameters[1])); 
+        } else {
+            return Expr(new MultVar(parameters));
+        }
+    } else if (op_type == E_DIV) {
+        //TO COMPLETE THE LOGIC
+        if (parameters.size() == 0) {
+            throw RuntimeError("Wrong number of arguments for /");
+        }
+        if (parameters.size() == 2) {
+            return Expr(new Div(parameters[0], parameters[1])); 
+        } else {
+            return Expr(new DivVar(parameters));
+        }
+    } else if (op_type == E_MODULO) {
+        if (parameters.size() != 2) {
+            throw RuntimeError("Wrong number of arguments for modulo");
+        }
+        return Expr(new Modulo(parameters[0], parameters[1]));
+    } else if (op_type == E_EXPT) {
+        if (parameters.size() == 2){
+            return Expr(new Expt(parameters[0], parameters[1])); 
+        } else {
+            throw RuntimeError("Wrong number of arguments for expt");
+        }
+    } else if (op_type == E_EXACT_TO_INEXACT) {
+        if (parameters.size() == 1) {
+            return Expr(new ExactToInexact(parameters[0]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for exact->inexact");
+        }
+    } else if (op_type == E_INEXACT_TO_EXACT) {
+        if (parameters.size() == 1) {
+            return Expr(new InexactToExact(parameters[0]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for inexact->exact");
+        }
+    } else if (op_type == E_LIST) {
+        return Expr(new ListFunc(parameters));
+    } else if (op_type == E_SETCAR) {
+        if (parameters.size() == 2) {
+            return Expr(new SetCar(parameters[0], parameters[1]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for set-car!");
+        }
+    } else if (op_type == E_SETCDR) {
+        if (parameters.size() == 2) {
+            return Expr(new SetCdr(parameters[0], parameters[1]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for set-cdr!");
+        }
+    } else if (op_type == E_CONS) {
+        if (parameters.size() == 2) {
+            return Expr(new Cons(parameters[0], parameters[1]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for cons");
+        }
+    } else if (op_type == E_CAR) {
+        if (parameters.size() == 1) {
+            return unaryNode<Car>(op, parameters[0]);
+        } else {
+            throw RuntimeError("Wrong number of arguments for car");
+        }
+    } else if (op_type == E_CDR) {
+        if (parameters.size() == 1) {
+            return unaryNode<Cdr>(op, parameters[0]);
+        } else {
+            throw RuntimeError("Wrong number of arguments for cdr");
+        }
+    } else if (op_type == E_LT) {
+        //TO COMPLETE THE LOGIC
+        if (parameters.size() < 2) {
+            throw RuntimeError("Wrong number of arguments for <");
+        }
+        if (parameters.size() == 2) {
+            return binaryNode<Less>(op, parameters[0], parameters[1]); 
+        } else {
+            return Expr(new LessVar(parameters));
+        }
+    } else if (op_type == E_LE) {
+        //TO COMPLETE THE LOGIC
+        if (parameters.size() < 2) {
+            throw RuntimeError("Wrong number of arguments for <=");
+        }
+        if (parameters.size() == 2) {
+            return binaryNode<LessEq>(op, parameters[0], parameters[1]); 
+        } else {
+            return Expr(new LessEqVar(parameters));
+        }
+    } else if (op_type == E_EQ) {
+        //TO COMPLETE THE LOGIC
+        if (parameters.size() < 2) {
+            throw RuntimeError("Wrong number of arguments for =");
+        }
+        if (parameters.size() == 2) {
+            return binaryNode<Equal>(op, parameters[0], parameters[1]); 
+        } else {
+            return Expr(new EqualVar(parameters));
+        }
+    } else if (op_type == E_GE) {
+        //TO COMPLETE THE LOGIC
+        if (parameters.size() < 2) {
+            throw RuntimeError("Wrong number of arguments for >=");
+        }
+        if (parameters.size() == 2) {
+            return binaryNode<GreaterEq>(op, parameters[0], parameters[1]); 
+        } else {
+            return Expr(new GreaterEqVar(parameters));
+        }
+    } else if (op_type == E_GT) {
+        //TO COMPLETE THE LOGIC
+        if (parameters.size() < 2) {
+            throw RuntimeError("Wrong number of arguments for >");
+        }
+        if (parameters.size() == 2) {
+            return binaryNode<Greater>(op, parameters[0], parameters[1]); 
+        } else {
+            return Expr(new GreaterVar(parameters));
+        }
+    } else if (op_type == E_NOT){
+        if (parameters.size() == 1) {
+            return Expr(new Not(parameters[0]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for not");
+        }
+    } else if (op_type == E_AND) {
+        return Expr(new AndVar(parameters));
+    } else if (op_type == E_OR) {
+        return Expr(new OrVar(parameters));
+    } else if (op_type == E_EQQ) {
+        if (parameters.size() == 2) {
+            return Expr(new IsEq(parameters[0], parameters[1]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for eq?");
+        }
+    } else if (op_type == E_BOOLQ) {
+        if (parameters.size() == 1) {
+            return Expr(new IsBoolean(parameters[0]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for boolean?");
+        }
+    } else if (op_type == E_INTQ) {
+        if (parameters.size() == 1) {
+            return Expr(new IsFixnum(parameters[0]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for number?");
+        }
+    } else if (op_type == E_NULLQ) {
+        if (parameters.size() == 1) {
+            return unaryNode<IsNull>(op, parameters[0]);
+        } else {
+            throw RuntimeError("Wrong number of arguments for null?");
+        }
+    } else if (op_type == E_PAIRQ) {
+        if (parameters.size() == 1) {
+            return Expr(new IsPair(parameters[0]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for pair?");
+        }
+    } else if (op_type == E_PROCQ) {
+        if (parameters.size() == 1) {
+            return Expr(new IsProcedure(parameters[0]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for procedure?");
+        }
+    } else if (op_type == E_SYMBOLQ) {
+        if (parameters.size() == 1) {
+            return Expr(new IsSymbol(parameters[0]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for symbol?");
+        }
+    } else if (op_type == E_LISTQ) {
+        if (parameters.size() == 1) {
+            return Expr(new IsList(parameters[0]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for list?");
+        }
+    } else if (op_type == E_STRINGQ) {
+        if (parameters.size() == 1) {
+            return Expr(new IsString(parameters[0]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for string?");
+        }
+    } else if (op_type == E_DISPLAY) {
+        if (parameters.size() == 1) {
+            return Expr(new Display(parameters[0]));
+        } else {
+            throw RuntimeError("Wrong number of arguments for display");
+        }
+    } else if (op_type == E_VOID) {
+        if (parameters.size() != 0) {
+            throw RuntimeError("Wrong number of arguments for void");
+        }
+        return Expr(new MakeVoid());
+    } else if (op_type == E_EXIT) {
+        if (parameters.size() != 0) {
+            throw RuntimeError("Wrong number of arguments for exit");
+        }
+        return Expr(new Exit());
+    } else {
+        throw RuntimeError("Unknown primitive : " + op);
+    }
+}
+
 /**
  * @brief Default parse method (should be overridden by subclasses)
  */
@@ -35,13 +438,27 @@ Expr Number::parse(Assoc &env) {
     return Expr(new Fixnum(n));
 }
 
+Expr BignumSyntax::parse(Assoc &env) {
+    return Expr(new BignumNum(BigInt::fromString(digits)));
+}
+
+Expr FlonumSyntax::parse(Assoc &env) {
+    return Expr(new FlonumNum(d));
+}
+
 Expr RationalSyntax::parse(Assoc &env) { 
     //complete the rational parser
     return Expr(new RationalNum(numerator, denominator));
 }
 
 Expr SymbolSyntax::parse(Assoc &env) {
-    return Expr(new Var(s));
+    //locals are resolved to (depth, slot) now; anything else is a global
+    int depth, slot;
+    bool boxed;
+    if (resolve(sym, env, depth, slot, boxed)) {
+        return Expr(new Var(sym, depth, slot, boxed));
+    }
+    return Expr(new Var(sym));
 }
 
 Expr StringSyntax::parse(Assoc &env) {
@@ -74,8 +491,11 @@ Expr List::parse(Assoc &env) {
         }
         return Expr(new Apply(rator, rand));
     }else{
-    string op = id->s;
-    if (find(op, env).get() != nullptr) {//a var(a function)(can be used for shadow)
+    SymbolId op_id = id->sym;
+    const string &op = symbolName(op_id);
+    int op_depth, op_slot;
+    bool op_boxed;
+    if (resolve(op_id, env, op_depth, op_slot, op_boxed)) {//a local var(a function)(can be used for shadow)
         //TO COMPLETE THE PARAMETER PARSER LOGIC
         Expr rator = stxs[0]->parse(env);
         vector<Expr> rand;
@@ -90,216 +510,7 @@ Expr List::parse(Assoc &env) {
         for (int i = 1; i < stxs.size(); i++){//call the corresponding parse
             parameters.push_back(stxs[i]->parse(env));
         }
-        ExprType op_type = primitives[op];
-        if (op_type == E_PLUS) {
-            if (parameters.size() == 2) {
-                return Expr(new Plus(parameters[0], parameters[1])); 
-            } else {
-                return Expr(new PlusVar(parameters));
-            }
-        } else if (op_type == E_MINUS) {
-            //TO COMPLETE THE LOGIC
-            if (parameters.size() == 0) {
-                throw RuntimeError("Wrong number of arguments for -");
-            }
-            if (parameters.size() == 2) {
-                return Expr(new Minus(parameters[0], parameters[1])); 
-            } else {
-                return Expr(new MinusVar(parameters));
-            }
-        } else if (op_type == E_MUL) {
-            //TO COMPLETE THE LOGIC
-            if (parameters.size() == 2) {
-                return Expr(new Mult(parameters[0], parameters[1])); 
-            } else {
-                return Expr(new MultVar(parameters));
-            }
-        } else if (op_type == E_DIV) {
-            //TO COMPLETE THE LOGIC
-            if (parameters.size() == 0) {
-                throw RuntimeError("Wrong number of arguments for /");
-            }
-            if (parameters.size() == 2) {
-                return Expr(new Div(parameters[0], parameters[1])); 
-            } else {
-                return Expr(new DivVar(parameters));
-            }
-        } else if (op_type == E_MODULO) {
-            if (parameters.size() != 2) {
-                throw RuntimeError("Wrong number of arguments for modulo");
-            }
-            return Expr(new Modulo(parameters[0], parameters[1]));
-        } else if (op_type == E_EXPT) {
-            if (parameters.size() == 2){
-                return Expr(new Expt(parameters[0], parameters[1])); 
-            } else {
-                throw RuntimeError("Wrong number of arguments for expt");
-            }
-        } else if (op_type == E_LIST) {
-            return Expr(new ListFunc(parameters));
-        } else if (op_type == E_SETCAR) {
-            if (parameters.size() == 2) {
-                return Expr(new SetCar(parameters[0], parameters[1]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for set-car!");
-            }
-        } else if (op_type == E_SETCDR) {
-            if (parameters.size() == 2) {
-                return Expr(new SetCdr(parameters[0], parameters[1]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for set-cdr!");
-            }
-        } else if (op_type == E_CONS) {
-            if (parameters.size() == 2) {
-                return Expr(new Cons(parameters[0], parameters[1]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for cons");
-            }
-        } else if (op_type == E_CAR) {
-            if (parameters.size() == 1) {
-                return Expr(new Car(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for car");
-            }
-        } else if (op_type == E_CDR) {
-            if (parameters.size() == 1) {
-                return Expr(new Cdr(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for cdr");
-            }
-        } else if (op_type == E_LT) {
-            //TO COMPLETE THE LOGIC
-            if (parameters.size() < 2) {
-                throw RuntimeError("Wrong number of arguments for <");
-            }
-            if (parameters.size() == 2) {
-                return Expr(new Less(parameters[0], parameters[1])); 
-            } else {
-                return Expr(new LessVar(parameters));
-            }
-        } else if (op_type == E_LE) {
-            //TO COMPLETE THE LOGIC
-            if (parameters.size() < 2) {
-                throw RuntimeError("Wrong number of arguments for <=");
-            }
-            if (parameters.size() == 2) {
-                return Expr(new LessEq(parameters[0], parameters[1])); 
-            } else {
-                return Expr(new LessEqVar(parameters));
-            }
-        } else if (op_type == E_EQ) {
-            //TO COMPLETE THE LOGIC
-            if (parameters.size() < 2) {
-                throw RuntimeError("Wrong number of arguments for =");
-            }
-            if (parameters.size() == 2) {
-                return Expr(new Equal(parameters[0], parameters[1])); 
-            } else {
-                return Expr(new EqualVar(parameters));
-            }
-        } else if (op_type == E_GE) {
-            //TO COMPLETE THE LOGIC
-            if (parameters.size() < 2) {
-                throw RuntimeError("Wrong number of arguments for >=");
-            }
-            if (parameters.size() == 2) {
-                return Expr(new GreaterEq(parameters[0], parameters[1])); 
-            } else {
-                return Expr(new GreaterEqVar(parameters));
-            }
-        } else if (op_type == E_GT) {
-            //TO COMPLETE THE LOGIC
-            if (parameters.size() < 2) {
-                throw RuntimeError("Wrong number of arguments for >");
-            }
-            if (parameters.size() == 2) {
-                return Expr(new Greater(parameters[0], parameters[1])); 
-            } else {
-                return Expr(new GreaterVar(parameters));
-            }
-        } else if (op_type == E_NOT){
-            if (parameters.size() == 1) {
-                return Expr(new Not(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for not");
-            }
-        } else if (op_type == E_AND) {
-            return Expr(new AndVar(parameters));
-        } else if (op_type == E_OR) {
-            return Expr(new OrVar(parameters));
-        } else if (op_type == E_EQQ) {
-            if (parameters.size() == 2) {
-                return Expr(new IsEq(parameters[0], parameters[1]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for eq?");
-            }
-        } else if (op_type == E_BOOLQ) {
-            if (parameters.size() == 1) {
-                return Expr(new IsBoolean(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for boolean?");
-            }
-        } else if (op_type == E_INTQ) {
-            if (parameters.size() == 1) {
-                return Expr(new IsFixnum(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for number?");
-            }
-        } else if (op_type == E_NULLQ) {
-            if (parameters.size() == 1) {
-                return Expr(new IsNull(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for null?");
-            }
-        } else if (op_type == E_PAIRQ) {
-            if (parameters.size() == 1) {
-                return Expr(new IsPair(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for pair?");
-            }
-        } else if (op_type == E_PROCQ) {
-            if (parameters.size() == 1) {
-                return Expr(new IsProcedure(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for procedure?");
-            }
-        } else if (op_type == E_SYMBOLQ) {
-            if (parameters.size() == 1) {
-                return Expr(new IsSymbol(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for symbol?");
-            }
-        } else if (op_type == E_LISTQ) {
-            if (parameters.size() == 1) {
-                return Expr(new IsList(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for list?");
-            }
-        } else if (op_type == E_STRINGQ) {
-            if (parameters.size() == 1) {
-                return Expr(new IsString(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for string?");
-            }
-        } else if (op_type == E_DISPLAY) {
-            if (parameters.size() == 1) {
-                return Expr(new Display(parameters[0]));
-            } else {
-                throw RuntimeError("Wrong number of arguments for display");
-            }
-        } else if (op_type == E_VOID) {
-            if (parameters.size() != 0) {
-                throw RuntimeError("Wrong number of arguments for void");
-            }
-            return Expr(new MakeVoid());
-        } else if (op_type == E_EXIT) {
-            if (parameters.size() != 0) {
-                throw RuntimeError("Wrong number of arguments for exit");
-            }
-            return Expr(new Exit());
-        } else {
-            throw RuntimeError("Unknown primitive : " + op);
-        }
+        return primitiveNode(primitives[op], op, parameters);
     }
     if (reserved_words.count(op) != 0) {//a reserved word
     	switch (reserved_words[op]) {
@@ -337,7 +548,8 @@ Expr List::parse(Assoc &env) {
                         throw RuntimeError("Wrong type of clause in cond");
                     }
                     if (auto else_symbol = dynamic_cast<SymbolSyntax*>(clause->stxs[0].get())) {
-                        if (else_symbol->s == "else") {
+                        static const SymbolId else_id = intern("else");
+                        if (else_symbol->sym == else_id) {
                             if (clause->stxs.size() == 1) {
                                 throw RuntimeError("No expressions in else clause");
                             }
@@ -359,24 +571,17 @@ Expr List::parse(Assoc &env) {
             }
             case E_LAMBDA:{
                 if (stxs.size() >= 3){
-                    Assoc lambda_parse_env = env;
                     //stxs[1]: parameter list. 
-                    vector<string> x;
+                    vector<SymbolId> x;
                     List* param_list = dynamic_cast<List*>(stxs[1].get());
                     if (param_list == nullptr) throw RuntimeError("Wrong type of parameter list");
                     for (int i = 0; i < param_list->stxs.size(); i++) {
                         SymbolSyntax* p = dynamic_cast<SymbolSyntax*>(param_list->stxs[i].get());
                         if (p == nullptr) throw RuntimeError("Wrong type of parameter");
-                        x.push_back(p->s);
-                        lambda_parse_env = extend(p->s, VoidV(), lambda_parse_env);
+                        x.push_back(p->sym);
                     }
                     //stxs[2...]: procedure
-                    vector<Expr> es;
-                    for (int i = 2; i < stxs.size(); i++){
-                        es.push_back(stxs[i]->parse(lambda_parse_env));
-                    }
-
-                    return Expr(new Lambda(x, Expr(new Begin(es))));
+                    return parseLambda(x, stxs, env);
                 }else{
                     throw RuntimeError("Wrong number of arguments for lambda");
                 }
@@ -387,11 +592,16 @@ Expr List::parse(Assoc &env) {
                         if (stxs.size() != 3) {
                             throw RuntimeError("Wrong number of arguments for variable define");
                         }
-                        string var = p->s;
-                        if (primitives.count(var) || reserved_words.count(var)) {
+                        SymbolId var = p->sym;
+                        if (primitives.count(symbolName(var)) || reserved_words.count(symbolName(var))) {
                             throw RuntimeError("Invalid variable name in define");
                         }
                         Expr e = stxs[2]->parse(env);
+                        int depth, slot;
+                        bool boxed;
+                        if (resolve(var, env, depth, slot, boxed)) {//defining a local assigns it
+                            return Expr(new Define(var, depth, slot, boxed, e));
+                        }
                         return Expr(new Define(var, e));
                     } else if (auto p = dynamic_cast<List*>(stxs[1].get())) {
                         //turn the simple form into name and lambda
@@ -400,19 +610,20 @@ Expr List::parse(Assoc &env) {
                         }
                         auto p_name = dynamic_cast<SymbolSyntax*>(p->stxs[0].get());
                         if (p_name == nullptr) throw RuntimeError("Invalid function name in define");
-                        string name = p_name->s;
-                        vector<string> x;
+                        SymbolId name = p_name->sym;
+                        vector<SymbolId> x;
                         for (int i = 1; i < p->stxs.size(); i++){
                             auto p_param = dynamic_cast<SymbolSyntax*>(p->stxs[i].get());
                             if (p_param == nullptr) throw RuntimeError("Invalid parameter name in define");
-                            x.push_back(p_param->s);
+                            x.push_back(p_param->sym);
                         }
-                        vector<Expr> es;
-                        for (int i = 2; i < stxs.size(); i++){
-                            es.push_back(stxs[i]->parse(env));
+                        Expr e = parseLambda(x, stxs, env);
+                        int depth, slot;
+                        bool boxed;
+                        if (resolve(name, env, depth, slot, boxed)) {
+                            return Expr(new Define(name, depth, slot, boxed, e));
                         }
-                        Expr e = Expr(new Begin(es));
-                        return Expr(new Define(name, Expr(new Lambda(x, e))));
+                        return Expr(new Define(name, e));
                     } else {
                         throw RuntimeError("Wrong type of variable in define");
                     }
@@ -422,12 +633,42 @@ Expr List::parse(Assoc &env) {
                 
             }
             case E_LET:{
+                if (auto p_name = dynamic_cast<SymbolSyntax*>(stxs.size() > 1 ? stxs[1].get() : nullptr)) {
+                    //named let: (let name ((x init) ...) body ...)
+                    if (stxs.size() < 4) throw RuntimeError("Wrong number of arguments for named let");
+                    List* bind_list = dynamic_cast<List*>(stxs[2].get());
+                    if (bind_list == nullptr) throw RuntimeError("Wrong type of binding list in let");
+                    vector<SymbolId> names;
+                    vector<Expr> inits;
+                    for (int i = 0; i < bind_list->stxs.size(); i++) {
+                        List* bind_pair = dynamic_cast<List*>(bind_list->stxs[i].get());
+                        if (bind_pair == nullptr || bind_pair->stxs.size() != 2) {
+                            throw RuntimeError("Wrong type of binding pair in let");
+                        }
+                        auto p_var = dynamic_cast<SymbolSyntax*>(bind_pair->stxs[0].get());
+                        if (p_var == nullptr) throw RuntimeError("Wrong type of variable in let binding");
+                        names.push_back(p_var->sym);
+                        inits.push_back(bind_pair->stxs[1]->parse(env));
+                    }
+                    std::set<SymbolId> assigned;
+                    for (int i = 3; i < stxs.size(); i++) {
+                        scanAssigned(stxs[i], assigned, nullptr);
+                    }
+                    vector<bool> boxed = boxFlags(names, assigned);
+                    Assoc captured = empty();
+                    Assoc loop_parse_env = loopScope(p_name->sym, names, boxed, env, captured);
+                    vector<Expr> es;
+                    for (int i = 3; i < stxs.size(); i++) {
+                        es.push_back(stxs[i]->parse(loop_parse_env));
+                    }
+                    return finishLoop(p_name->sym, names, boxed, captured, Expr(new Begin(es)), inits, assigned);
+                }
                 if (stxs.size() < 3) throw RuntimeError("Wrong number of arguments for let");
-                Assoc let_parse_env = env;
                 //stxs[1]: bind
                 List* bind_list = dynamic_cast<List*>(stxs[1].get());
                 if (bind_list == nullptr) throw RuntimeError("Wrong type of binding list in let");
-                vector<pair<string, Expr>> bind;
+                vector<pair<SymbolId, Expr>> bind;
+                vector<SymbolId> names;
                 for (int i = 0; i < bind_list->stxs.size(); i++) {
                     List* bind_pair = dynamic_cast<List*>(bind_list->stxs[i].get());
                     if (bind_pair == nullptr || bind_pair->stxs.size() != 2) {
@@ -435,25 +676,31 @@ Expr List::parse(Assoc &env) {
                     }
                     auto p_var = dynamic_cast<SymbolSyntax*>(bind_pair->stxs[0].get());
                     if (p_var == nullptr) throw RuntimeError("Wrong type of variable in let binding");
-                    string var = p_var->s;
+                    SymbolId var = p_var->sym;
                     Expr e = bind_pair->stxs[1]->parse(env);
                     bind.push_back({var, e});
-                    let_parse_env = extend(var, VoidV(), let_parse_env);
+                    names.push_back(var);
+                }
+                std::set<SymbolId> assigned;
+                for (int i = 2; i < stxs.size(); i++) {
+                    scanAssigned(stxs[i], assigned, nullptr);
                 }
+                vector<bool> boxed = boxFlags(names, assigned);
+                Assoc let_parse_env = extendScope(names, boxed, env);
                 //stxs[2...]: body
                 vector<Expr> es;
                 for (int i = 2; i < stxs.size(); i++){
                     es.push_back(stxs[i]->parse(let_parse_env));
                 }
-                return Expr(new Let(bind, Expr(new Begin(es))));
+                return Expr(new Let(bind, Expr(new Begin(es)), boxed));
             }
             case E_LETREC:{
                 if (stxs.size() < 3) throw RuntimeError("Wrong number of arguments for letrec");
-                Assoc letrec_parse_env = env;
                 //stxs[1]: bind
                 List* bind_list = dynamic_cast<List*>(stxs[1].get());
                 if (bind_list == nullptr) throw RuntimeError("Wrong type of binding list in letrec");
-                vector<pair<string, Expr>> bind;
+                //collect the names first: the inits are parsed inside the new frame
+                vector<SymbolId> names;
                 for (int i = 0; i < bind_list->stxs.size(); i++) {
                     List* bind_pair = dynamic_cast<List*>(bind_list->stxs[i].get());
                     if (bind_pair == nullptr || bind_pair->stxs.size() != 2) {
@@ -461,24 +708,98 @@ Expr List::parse(Assoc &env) {
                     }
                     auto p_var = dynamic_cast<SymbolSyntax*>(bind_pair->stxs[0].get());
                     if (p_var == nullptr) throw RuntimeError("Wrong type of variable in letrec binding");
-                    string var = p_var->s;
-                    Expr e = bind_pair->stxs[1]->parse(env);
-                    bind.push_back({var, e});
-                    letrec_parse_env = extend(var, VoidV(), letrec_parse_env);
+                    names.push_back(p_var->sym);
+                }
+                //a binding an init refers to is captured before it is assigned, so it is boxed too
+                std::set<SymbolId> assigned, mentioned;
+                for (int i = 0; i < bind_list->stxs.size(); i++) {
+                    scanAssigned(dynamic_cast<List*>(bind_list->stxs[i].get())->stxs[1], assigned, &mentioned);
+                }
+                for (int i = 2; i < stxs.size(); i++) {
+                    scanAssigned(stxs[i], assigned, nullptr);
+                }
+                assigned.insert(mentioned.begin(), mentioned.end());
+                vector<bool> boxed = boxFlags(names, assigned);
+                Assoc letrec_parse_env = extendScope(names, boxed, env);
+                vector<pair<SymbolId, Expr>> bind;
+                for (int i = 0; i < bind_list->stxs.size(); i++) {
+                    List* bind_pair = dynamic_cast<List*>(bind_list->stxs[i].get());
+                    Expr e = bind_pair->stxs[1]->parse(letrec_parse_env);
+                    bind.push_back({names[i], e});
                 }
                 //stxs[2...]: body
                 vector<Expr> es;
                 for (int i = 2; i < stxs.size(); i++){
                     es.push_back(stxs[i]->parse(letrec_parse_env));
                 }
-                return Expr(new Letrec(bind, Expr(new Begin(es))));
+                return Expr(new Letrec(bind, Expr(new Begin(es)), boxed));
+            }
+            case E_DO:{
+                //(do ((x init step) ...) (test result ...) command ...) is a named let
+                //whose name no program can mention
+                if (stxs.size() < 3) throw RuntimeError("Wrong number of arguments for do");
+                List* spec_list = dynamic_cast<List*>(stxs[1].get());
+                if (spec_list == nullptr) throw RuntimeError("Wrong type of binding list in do");
+                List* exit_clause = dynamic_cast<List*>(stxs[2].get());
+                if (exit_clause == nullptr || exit_clause->stxs.empty()) throw RuntimeError("Wrong type of test clause in do");
+                vector<SymbolId> names;
+                vector<Expr> inits;
+                vector<Syntax> steps;
+                for (int i = 0; i < spec_list->stxs.size(); i++) {
+                    List* spec = dynamic_cast<List*>(spec_list->stxs[i].get());
+                    if (spec == nullptr || spec->stxs.size() < 2 || spec->stxs.size() > 3) {
+                        throw RuntimeError("Wrong type of binding in do");
+                    }
+                    auto p_var = dynamic_cast<SymbolSyntax*>(spec->stxs[0].get());
+                    if (p_var == nullptr) throw RuntimeError("Wrong type of variable in do binding");
+                    names.push_back(p_var->sym);
+                    inits.push_back(spec->stxs[1]->parse(env));
+                    //a variable without a step keeps its value
+                    steps.push_back(spec->stxs[spec->stxs.size() == 3 ? 2 : 0]);
+                }
+                static const SymbolId loop_id = intern("(do)");
+                std::set<SymbolId> assigned;
+                for (int i = 0; i < steps.size(); i++) {
+                    scanAssigned(steps[i], assigned, nullptr);
+                }
+                for (int i = 2; i < stxs.size(); i++) {
+                    scanAssigned(stxs[i], assigned, nullptr);
+                }
+                vector<bool> boxed = boxFlags(names, assigned);
+                Assoc captured = empty();
+                Assoc loop_parse_env = loopScope(loop_id, names, boxed, env, captured);
+                Expr test = exit_clause->stxs[0]->parse(loop_parse_env);
+                vector<Expr> results;
+                for (int i = 1; i < exit_clause->stxs.size(); i++) {
+                    results.push_back(exit_clause->stxs[i]->parse(loop_parse_env));
+                }
+                vector<Expr> commands;
+                for (int i = 3; i < stxs.size(); i++) {
+                    commands.push_back(stxs[i]->parse(loop_parse_env));
+                }
+                vector<Expr> next;
+                for (int i = 0; i < steps.size(); i++) {
+                    next.push_back(steps[i]->parse(loop_parse_env));
+                }
+                int depth, slot;
+                bool loop_boxed;
+                resolve(loop_id, loop_parse_env, depth, slot, loop_boxed);
+                commands.push_back(Expr(new Apply(Expr(new Var(loop_id, depth, slot, loop_boxed)), next)));
+                Expr done = results.empty() ? Expr(new MakeVoid()) : Expr(new Begin(results));
+                Expr body(new If(test, done, Expr(new Begin(commands))));
+                return finishLoop(loop_id, names, boxed, captured, body, inits, assigned);
             }
             case E_SET:{
                 if (stxs.size() == 3) {
                     auto p_var = dynamic_cast<SymbolSyntax*>(stxs[1].get());
                     if (p_var == nullptr) throw RuntimeError("Wrong type of variable in set!");
-                    string var = p_var->s;
+                    SymbolId var = p_var->sym;
                     Expr e = stxs[2]->parse(env);
+                    int depth, slot;
+                    bool boxed;
+                    if (resolve(var, env, depth, slot, boxed)) {
+                        return Expr(new Set(var, depth, slot, boxed, e));
+                    }
                     return Expr(new Set(var, e));
                 } else {
                     throw RuntimeError("Wrong number of arguments for set!");
@@ -0,0 +1,73 @@
+/**
+ * @file pool.cpp
+ * @brief Size-class pool allocator implementation
+ *
+ * Pages are never returned to the system; freed cells go back to the free
+ * list of their size class and are reused by the next allocation of that
+ * class.
+ */
+
+#include "pool.hpp"
+#include <new>
+
+namespace {
+
+struct FreeCell {
+    FreeCell *next;
+};
+
+const std::size_t CLASS_COUNT = POOL_MAX_SIZE / POOL_GRANULE;
+
+FreeCell *free_lists[CLASS_COUNT];
+char *bump = nullptr;        ///< Next unused byte in the current page
+char *bump_end = nullptr;    ///< End of the current page
+std::size_t reserved_bytes = 0;
+
+inline std::size_t sizeClass(std::size_t size) {
+    return (size + POOL_GRANULE - 1) / POOL_GRANULE - 1;
+}
+
+void newPage() {
+    bump = static_cast<char *>(::operator new(POOL_PAGE_SIZE));
+    bump_end = bump + POOL_PAGE_SIZE;
+    reserved_bytes += POOL_PAGE_SIZE;
+}
+
+} // namespace
+
+void *poolAllocate(std::size_t size) {
+    if (size == 0) size = 1;
+    if (size > POOL_MAX_SIZE) {
+        return ::operator new(size);
+    }
+    std::size_t cls = sizeClass(size);
+    FreeCell *cell = free_lists[cls];
+    if (cell != nullptr) {
+        free_lists[cls] = cell->next;
+        return cell;
+    }
+    std::size_t rounded = (cls + 1) * POOL_GRANULE;
+    if (bump + rounded > bump_end) {
+        newPage();  // the tail of the old page is simply abandoned
+    }
+    void *p = bump;
+    bump += rounded;
+    return p;
+}
+
+void poolFree(void *p, std::size_t size) {
+    if (p == nullptr) return;
+    if (size == 0) size = 1;
+    if (size > POOL_MAX_SIZE) {
+        ::operator delete(p);
+        return;
+    }
+    std::size_t cls = sizeClass(size);
+    FreeCell *cell = static_cast<FreeCell *>(p);
+    cell->next = free_lists[cls];
+    free_lists[cls] = cell;
+}
+
+std::size_t poolReservedBytes() {
+    return reserved_bytes;
+}
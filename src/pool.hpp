@@ -0,0 +1,26 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
+/**
+ * @file pool.hpp
+ * @brief Size-class pool allocator for small heap objects
+ *
+ * Requests up to POOL_MAX_SIZE bytes are rounded up to a multiple of
+ * POOL_GRANULE and served from a per-size-class free list. When a free list
+ * is empty, cells are bump-allocated from large pages obtained in bulk, so
+ * allocating a long run of cons cells is mostly pointer bumps. Larger
+ * requests fall through to the global operator new.
+ */
+
+#include <cstddef>
+
+const std::size_t POOL_GRANULE = 16;
+const std::size_t POOL_MAX_SIZE = 256;
+const std::size_t POOL_PAGE_SIZE = 256 * 1024;
+
+void *poolAllocate(std::size_t);
+void poolFree(void *, std::size_t);
+
+std::size_t poolReservedBytes();   ///< Bytes obtained from the system in pages
+
+#endif // POOL_HPP
@@ -1,5 +1,9 @@
 #include "syntax.hpp"
+#include "value.hpp"
 #include <cstring>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
 #include <vector>
 
 Syntax::Syntax(SyntaxBase *stx) : ptr(stx) {}
@@ -12,9 +16,19 @@ void Number::show(std::ostream &os) {
   os << "the-number-" << n;
 }
 
-RationalSyntax::RationalSyntax(int num, int den) : numerator(num), denominator(den) {}
+BignumSyntax::BignumSyntax(const std::string &s) : digits(s) {}
+void BignumSyntax::show(std::ostream &os) {
+  os << digits;
+}
+
+FlonumSyntax::FlonumSyntax(double x) : d(x) {}
+void FlonumSyntax::show(std::ostream &os) {
+  FlonumV(d).show(os);
+}
+
+RationalSyntax::RationalSyntax(const BigInt &num, const BigInt &den) : numerator(num), denominator(den) {}
 void RationalSyntax::show(std::ostream &os) {
-  os << numerator << "/" << denominator;
+  os << numerator.toString() << "/" << denominator.toString();
 }
 
 void TrueSyntax::show(std::ostream &os) {
@@ -25,9 +39,9 @@ void FalseSyntax::show(std::ostream &os) {
   os << "#f";
 }
 
-SymbolSyntax::SymbolSyntax(const std::string &s1) : s(s1) {}
+SymbolSyntax::SymbolSyntax(const std::string &s1) : sym(intern(s1)) {}
 void SymbolSyntax::show(std::ostream &os) {
-    os << s;
+    os << symbolName(sym);
 }
 
 StringSyntax::StringSyntax(const std::string &s1) : s(s1) {}
@@ -70,7 +84,7 @@ Syntax readList(std::istream &is);
 // Helper function to try parsing as integer or rational
 bool tryParseNumber(const std::string &s, int &result) {
   bool neg = false;
-  int n = 0;
+  long long n = 0;
   int i = 0;
   
   // Single '+' or '-' are not numbers
@@ -89,17 +103,29 @@ bool tryParseNumber(const std::string &s, int &result) {
   for (; i < s.size(); i++) {
     if ('0' <= s[i] && s[i] <= '9') {
       n = n * 10 + s[i] - '0';
+      if (n > (long long)INT_MAX + 1) return false;  // too large for an int
     } else {
       return false;  // Not a valid number
     }
   }
   
-  result = neg ? -n : n;
+  if (!neg && n > INT_MAX) return false;
+  result = (int)(neg ? -n : n);
+  return true;
+}
+
+// Helper function to check for an integer of any size
+bool isIntegerLiteral(const std::string &s) {
+  int i = (s[0] == '-' || s[0] == '+') ? 1 : 0;
+  if (i == s.size()) return false;
+  for (; i < s.size(); i++) {
+    if (s[i] < '0' || s[i] > '9') return false;
+  }
   return true;
 }
 
 // Helper function to try parsing as rational number
-bool tryParseRational(const std::string &s, int &numerator, int &denominator) {
+bool tryParseRational(const std::string &s, BigInt &numerator, BigInt &denominator) {
   size_t slash_pos = s.find('/');
   if (slash_pos == std::string::npos || slash_pos == 0 || slash_pos == s.size() - 1) {
     return false; // No slash or slash at beginning/end
@@ -109,15 +135,49 @@ bool tryParseRational(const std::string &s, int &numerator, int &denominator) {
   std::string den_str = s.substr(slash_pos + 1);
   
   // Parse numerator (can be negative)
-  if (!tryParseNumber(num_str, numerator)) {
+  if (!isIntegerLiteral(num_str)) {
     return false;
   }
   
   // Parse denominator (must be positive)
-  if (!tryParseNumber(den_str, denominator) || denominator <= 0) {
+  if (!isIntegerLiteral(den_str) || den_str[0] == '-') {
     return false;
   }
   
+  numerator = BigInt::fromString(num_str);
+  denominator = BigInt::fromString(den_str);
+  return !denominator.isZero();
+}
+
+// Helper function to try parsing as a flonum: digits with a point, an exponent or both
+bool tryParseFlonum(const std::string &s, double &result) {
+  if (s == "+inf.0" || s == "-inf.0") {
+    result = s[0] == '+' ? HUGE_VAL : -HUGE_VAL;
+    return true;
+  }
+  if (s == "+nan.0" || s == "-nan.0") {
+    result = NAN;
+    return true;
+  }
+  size_t i = (s[0] == '-' || s[0] == '+') ? 1 : 0;
+  size_t digits = 0;
+  bool point = false, exponent = false;
+  for (; i < s.size() && ('0' <= s[i] && s[i] <= '9'); i++) digits++;
+  if (i < s.size() && s[i] == '.') {
+    point = true;
+    for (i++; i < s.size() && ('0' <= s[i] && s[i] <= '9'); i++) digits++;
+  }
+  if (digits == 0) return false;
+  if (i < s.size() && (s[i] == 'e' || s[i] == 'E')) {
+    exponent = true;
+    i++;
+    if (i < s.size() && (s[i] == '-' || s[i] == '+')) i++;
+    size_t exponent_digits = 0;
+    for (; i < s.size() && ('0' <= s[i] && s[i] <= '9'); i++) exponent_digits++;
+    if (exponent_digits == 0) return false;
+  }
+  if (i != s.size() || (!point && !exponent)) return false;
+  result = std::strtod(s.c_str(), nullptr);
   return true;
 }
 
@@ -191,7 +251,7 @@ Syntax readItem(std::istream &is) {
   } while (true);
   
   // Try parsing as rational first
-  int numerator, denominator;
+  BigInt numerator, denominator;
   if (tryParseRational(s, numerator, denominator)) {
     return Syntax(new RationalSyntax(numerator, denominator));
   }
@@ -201,6 +261,13 @@ Syntax readItem(std::istream &is) {
   if (tryParseNumber(s, number_value)) {
     return Syntax(new Number(number_value));
   }
+  if (isIntegerLiteral(s)) {
+    return Syntax(new BignumSyntax(s));
+  }
+  double flonum_value;
+  if (tryParseFlonum(s, flonum_value)) {
+    return Syntax(new FlonumSyntax(flonum_value));
+  }
   
   // Not a number, treat as identifier/symbol
   return createIdentifierSyntax(s);
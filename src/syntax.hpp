@@ -5,6 +5,7 @@
 #include <memory>
 #include <vector>
 #include "Def.hpp"
+#include "bignum.hpp"
 
 struct SyntaxBase {
     virtual Expr parse(Assoc &) = 0;
@@ -28,10 +29,27 @@ struct Number : SyntaxBase {
     virtual void show(std::ostream &) override;
 };
 
+/**
+ * @brief Integer literal outside the int range, kept as its digits
+ */
+struct BignumSyntax : SyntaxBase {
+    std::string digits;
+    BignumSyntax(const std::string &);
+    virtual Expr parse(Assoc &) override;
+    virtual void show(std::ostream &) override;
+};
+
+struct FlonumSyntax : SyntaxBase {
+    double d;
+    FlonumSyntax(double);
+    virtual Expr parse(Assoc &) override;
+    virtual void show(std::ostream &) override;
+};
+
 struct RationalSyntax : SyntaxBase {
-    int numerator;
-    int denominator;
-    RationalSyntax(int num, int den);
+    BigInt numerator;
+    BigInt denominator;
+    RationalSyntax(const BigInt &num, const BigInt &den);
     virtual Expr parse(Assoc &) override;
     virtual void show(std::ostream &) override;
 };
@@ -49,7 +67,7 @@ struct FalseSyntax : SyntaxBase {
 };
 
 struct SymbolSyntax : SyntaxBase {
-    std::string s;
+    SymbolId sym;
     SymbolSyntax(const std::string &);
     virtual Expr parse(Assoc &) override;
     virtual void show(std::ostream &) override;
@@ -69,6 +87,7 @@ struct List : SyntaxBase {
     virtual void show(std::ostream &) override;
 };
 
+std::istream &readSpace(std::istream &);    ///< Skips whitespace and comments
 Syntax readSyntax(std::istream &);
 
 std::istream &operator>>(std::istream &, Syntax);
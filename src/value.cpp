@@ -7,12 +7,21 @@
  */
 
 #include "value.hpp"
+#include "pool.hpp"
+#include "jit.hpp"
+#include <new>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <unordered_map>
 
 // ============================================================================
 // Base ValueBase Implementation
 // ============================================================================
 
-ValueBase::ValueBase(ValueType vt) : v_type(vt) {}
+ValueBase::ValueBase(ValueType vt) : constant(false), v_type(vt) {}
 
 void ValueBase::showCdr(std::ostream &os) {
     os << " . ";
@@ -20,39 +29,136 @@ void ValueBase::showCdr(std::ostream &os) {
     os << ')';
 }
 
+// Shortest decimal that reads back as d, always with a '.' or an exponent
+static void showFlonum(std::ostream &os, double d) {
+    if (std::isnan(d)) {
+        os << "+nan.0";
+        return;
+    }
+    if (std::isinf(d)) {
+        os << (d > 0 ? "+inf.0" : "-inf.0");
+        return;
+    }
+    char buf[64];
+    int precision = 1;
+    for (; precision < 17; precision++) {
+        std::snprintf(buf, sizeof buf, "%.*e", precision - 1, d);
+        if (std::strtod(buf, nullptr) == d) break;
+    }
+    std::snprintf(buf, sizeof buf, "%.*e", precision - 1, d);
+    char *e = std::strchr(buf, 'e');
+    int exponent = std::atoi(e + 1);
+    std::string s;
+    if (exponent >= -7 && exponent < 21) {
+        std::snprintf(buf, sizeof buf, "%.*f", std::max(0, precision - 1 - exponent), d);
+        s = buf;
+        if (s.find('.') == std::string::npos) s += ".0";
+    } else {
+        *e = '\0';
+        s = std::string(buf) + "e" + std::to_string(exponent);
+    }
+    os << s;
+}
+
 // ============================================================================
-// Value Smart Pointer Implementation
+// Value Tagged Word Implementation
 // ============================================================================
 
-Value::Value(ValueBase *ptr) : ptr(ptr) {}
+ValueType Value::type() const {
+    if (isFixnum()) return V_INT;
+    if (isSymbol()) return V_SYM;
+    if (isFlonum()) return V_FLONUM;
+    switch (bits) {
+        case FALSE_BITS:
+        case TRUE_BITS:
+            return V_BOOL;
+        case NULL_BITS:
+            return V_NULL;
+        case VOID_BITS:
+            return V_VOID;
+    }
+    return get()->v_type;
+}
 
 ValueBase* Value::operator->() const { 
-    return ptr.get(); 
+    return get(); 
 }
 
 ValueBase& Value::operator*() { 
-    return *ptr; 
+    return *get(); 
 }
 
 ValueBase* Value::get() const { 
-    return ptr.get(); 
+    return isHeap() ? reinterpret_cast<ValueBase *>(bits) : nullptr; 
 }
 
-void Value::show(std::ostream &os) {
-    ptr->show(os);
+void Value::show(std::ostream &os) const {
+    if (isFixnum()) {
+        os << fixnum();
+        return;
+    }
+    if (isSymbol()) {
+        os << symbolName(symbol());
+        return;
+    }
+    if (isFlonum()) {
+        showFlonum(os, flonum());
+        return;
+    }
+    switch (bits) {
+        case FALSE_BITS: os << "#f"; return;
+        case TRUE_BITS:  os << "#t"; return;
+        case NULL_BITS:  os << "()"; return;
+        case VOID_BITS:  os << "#<void>"; return;
+    }
+    get()->show(os);
+}
+
+void Value::showCdr(std::ostream &os) const {
+    if (isNull()) {
+        os << ')';
+    } else if (isHeap()) {
+        get()->showCdr(os);
+    } else {
+        os << " . ";
+        show(os);
+        os << ')';
+    }
 }
 
 // ============================================================================
 // Environment (Association List) Implementation
 // ============================================================================
 
-AssocList::AssocList(const std::string &x, const Value &v, Assoc &next)
-    : x(x), v(v), next(next) {}
+static Value *allocateSlots(std::size_t n) {
+    Value *slots = static_cast<Value *>(poolAllocate(n * sizeof(Value)));
+    for (std::size_t i = 0; i < n; i++) new (&slots[i]) Value(nullptr);
+    return slots;
+}
+
+AssocList::AssocList(std::size_t n, const Assoc &next)
+    : slots(allocateSlots(n)), size(n), next(next), scope(nullptr) {}
+
+AssocList::AssocList(Value *slots, std::size_t n, const Assoc &next)
+    : GCObject(Unmanaged()), slots(slots), size(n), next(next), scope(nullptr) {}
+
+AssocList::AssocList(Scope *s, const Assoc &next)
+    : slots(nullptr), size(0), next(next), scope(s) {}
+
+AssocList::~AssocList() {
+    if (slots != nullptr) poolFree(slots, size * sizeof(Value));
+    delete scope;
+}
+
+void AssocList::trace() {
+    for (std::size_t i = 0; i < size; i++) gcMark(slots[i].get());
+    gcMark(next.get());
+}
 
 Assoc::Assoc(AssocList *x) : ptr(x) {}
 
 AssocList* Assoc::operator->() const { 
-    return ptr.get(); 
+    return ptr; 
 }
 
 AssocList& Assoc::operator*() { 
@@ -60,123 +166,317 @@ AssocList& Assoc::operator*() {
 }
 
 AssocList* Assoc::get() const { 
-    return ptr.get(); 
+    return ptr; 
 }
 
 Assoc empty() {
     return Assoc(nullptr);
 }
 
-Assoc extend(const std::string &x, const Value &v, Assoc &lst) {
-    return Assoc(new AssocList(x, v, lst));
+// Runtime frame with n unbound slots
+Assoc extend(std::size_t n, const Assoc &env) {
+    return Assoc(new AssocList(n, env));
 }
 
-void modify(const std::string &x, const Value &v, Assoc &lst) {
-    for (auto i = lst; i.get() != nullptr; i = i->next) {
-        if (x == i->x) {
-            i->v = v;
-            return;
-        }
+static const std::size_t FRAME_STACK_BYTES = 16 << 20;
+static char *frame_stack = nullptr;     ///< Allocated on first use
+static std::size_t frame_top = 0;       ///< Bytes in use
+static std::size_t frame_base = 0;      ///< Base of the innermost trampoline
+
+static const std::size_t FRAME_HEADER = (sizeof(AssocList) + sizeof(Value) - 1) / sizeof(Value) * sizeof(Value);
+
+static bool onFrameStack(AssocList *f) {
+    char *p = reinterpret_cast<char *>(f);
+    return frame_stack != nullptr && p >= frame_stack && p < frame_stack + FRAME_STACK_BYTES;
+}
+
+Assoc pushFrame(std::size_t n, const Assoc &env) {
+    if (frame_stack == nullptr) {//the pages are only touched as it grows
+        frame_stack = static_cast<char *>(std::malloc(FRAME_STACK_BYTES));
+        if (frame_stack == nullptr) throw std::bad_alloc();
+    }
+    std::size_t bytes = FRAME_HEADER + n * sizeof(Value);
+    if (FRAME_STACK_BYTES - frame_top < bytes) return extend(n, env);
+    char *at = frame_stack + frame_top;
+    frame_top += bytes;
+    Value *slots = reinterpret_cast<Value *>(at + FRAME_HEADER);
+    for (std::size_t i = 0; i < n; i++) new (&slots[i]) Value(nullptr);
+    return Assoc(::new (at) AssocList(slots, n, env));
+}
+
+Assoc tailFrame(const Assoc &frame) {
+    AssocList *f = frame.get();
+    char *to = frame_stack + frame_base;
+    if (!onFrameStack(f) || reinterpret_cast<char *>(f) == to) return frame;
+    //the old frames may overlap the new place: slots first, as the header goes below them
+    std::size_t n = f->size;
+    Assoc next = f->next;
+    Value *slots = reinterpret_cast<Value *>(to + FRAME_HEADER);
+    std::memmove(slots, f->slots, n * sizeof(Value));
+    frame_top = frame_base + FRAME_HEADER + n * sizeof(Value);
+    return Assoc(::new (to) AssocList(slots, n, next));
+}
+
+std::size_t frameStackTop() {
+    return frame_top;
+}
+
+void popFrames(std::size_t top) {
+    frame_top = top;
+}
+
+void popFramesAbove(const Assoc &frame) {
+    AssocList *f = frame.get();
+    std::size_t top = frame_base;
+    if (onFrameStack(f)) {//a frame below the base belongs to an enclosing trampoline
+        std::size_t end = reinterpret_cast<char *>(f->slots + f->size) - frame_stack;
+        if (end > top) top = end;
     }
+    if (top < frame_top) frame_top = top;
+}
+
+// Frames on the frame stack are roots for the collector. As they are never
+// swept, their marks are cleared here, before marking starts over.
+void markFrameStack() {
+    std::size_t at = 0;
+    while (at < frame_top) {
+        AssocList *f = reinterpret_cast<AssocList *>(frame_stack + at);
+        f->gc_marked = false;
+        gcMark(f);
+        at += FRAME_HEADER + f->size * sizeof(Value);
+    }
+}
+
+FrameScope::FrameScope() : base(frame_top), outer(frame_base) {
+    frame_base = frame_top;
+}
+
+FrameScope::~FrameScope() {
+    frame_top = base;
+    frame_base = outer;
+}
+
+// Parse-time frame binding xs; boxed marks the assigned ones
+Assoc extendScope(const std::vector<SymbolId> &xs, const std::vector<bool> &boxed, const Assoc &env) {
+    Scope *s = new Scope();
+    s->names = xs;
+    s->boxed = boxed;
+    s->closure = false;
+    return Assoc(new AssocList(s, env));
+}
+
+// Parse-time captured-variable frame of a lambda, filled in by resolve
+Assoc closureScope(const Assoc &env) {
+    Scope *s = new Scope();
+    s->closure = true;
+    return Assoc(new AssocList(s, env));
 }
 
-Value find(const std::string &x, Assoc &l) {
-    for (auto i = l; i.get() != nullptr; i = i->next) {
-        if (x == i->x) {
-            return i->v;
+// Find x in the frames of a parse-time scope. A variable found outside a
+// lambda is added to the lambda's captures, and the reference points there.
+bool resolve(SymbolId x, Assoc &scope, int &depth, int &slot, bool &boxed) {
+    depth = 0;
+    for (AssocList *f = scope.get(); f != nullptr; f = f->next.get(), depth++) {
+        Scope *s = f->scope;
+        // the latest binding of a repeated name wins, as with nested extends
+        for (int i = (int)s->names.size() - 1; i >= 0; i--) {
+            if (s->names[i] == x) {
+                slot = i;
+                boxed = s->boxed[i];
+                return true;
+            }
+        }
+        if (s->closure) {
+            int outer_depth, outer_slot;
+            if (!resolve(x, f->next, outer_depth, outer_slot, boxed)) {
+                return false;
+            }
+            slot = (int)s->names.size();
+            s->names.push_back(x);
+            s->boxed.push_back(boxed);
+            s->captures.push_back({outer_depth, outer_slot});
+            return true;
         }
     }
-    return Value(nullptr);
+    return false;
+}
+
+Value &frameSlot(Assoc &env, int depth, int slot) {
+    AssocList *f = env.get();
+    while (depth-- > 0) f = f->next.get();
+    return f->slots[slot];
 }
 
 // ============================================================================
-// Simple Value Types Implementation
+// Global Environment Implementation
 // ============================================================================
 
-// Void
-Void::Void() : ValueBase(V_VOID) {}
+GlobalCell::GlobalCell(SymbolId x) : name(x), v(nullptr), assigned(false) {}
+
+static std::unordered_map<SymbolId, GlobalCell *> &globalTable() {
+    static std::unordered_map<SymbolId, GlobalCell *> table;
+    return table;
+}
 
-void Void::show(std::ostream &os) {
-    os << "#<void>";
+// The cell for x, created unbound on first use
+GlobalCell *globalCell(SymbolId x) {
+    auto &table = globalTable();
+    auto it = table.find(x);
+    if (it != table.end()) {
+        return it->second;
+    }
+    GlobalCell *cell = new GlobalCell(x);
+    table.emplace(x, cell);
+    return cell;
 }
 
+// Global cells are roots for the collector
+void markGlobals() {
+    for (auto &entry : globalTable()) {
+        gcMark(entry.second->v.get());
+    }
+}
+
+void ValueRoot::trace() {
+    for (std::size_t i = 0; i < count; i++) gcMark(values[i].get());
+}
+
+void VectorRoot::trace() {
+    for (std::size_t i = 0; i < values.size(); i++) gcMark(values[i].get());
+}
+
+void EnvRoot::trace() {
+    //live frames on the frame stack are marked by markFrameStack; one that was moved or popped is garbage
+    if (!onFrameStack(env.get())) gcMark(env.get());
+}
+
+// ============================================================================
+// Simple Value Types Implementation
+// ============================================================================
+
+// Void
 Value VoidV() {
-    return Value(new Void());
+    return Value::fromBits(Value::VOID_BITS);
 }
 
 // Integer
-Integer::Integer(int n) : ValueBase(V_INT), n(n) {}
+Value IntegerV(int n) {
+    return Value::fromBits(((uintptr_t)(intptr_t)n << 1) | Value::FIXNUM_TAG);
+}
 
-void Integer::show(std::ostream &os) {
-    os << n;
+Bignum::Bignum(const BigInt &n) : ValueBase(V_BIGNUM), n(n) {}
+
+void Bignum::show(std::ostream &os) {
+    os << n.toString();
 }
 
-Value IntegerV(int n) {
-    return Value(new Integer(n));
+Value IntegerV(long long n) {
+    if (n >= INT_MIN && n <= INT_MAX) return IntegerV((int)n);
+    return Value(new Bignum(BigInt(n)));
 }
 
-// Rational
-// Helper function to calculate greatest common divisor
-static int gcd(int a, int b) {
-    if (a < 0) a = -a;
-    if (b < 0) b = -b;
-    while (b != 0) {
-        int temp = b;
-        b = a % b;
-        a = temp;
-    }
-    return a;
+Value IntegerV(const BigInt &n) {
+    if (n.fitsInt()) return IntegerV(n.toInt());
+    return Value(new Bignum(n));
 }
 
-Rational::Rational(int num, int den) : ValueBase(V_RATIONAL) {
-    if (den == 0) {
-        throw std::runtime_error("Division by zero");
+bool isInteger(const Value &v) {
+    return v.isFixnum() || (v.isHeap() && v.get()->v_type == V_BIGNUM);
+}
+
+BigInt integerValue(const Value &v) {
+    if (v.isFixnum()) return BigInt(v.fixnum());
+    return static_cast<Bignum*>(v.get())->n;
+}
+
+// Flonum
+Flonum::Flonum(double d) : ValueBase(V_FLONUM), d(d) {}
+
+void Flonum::show(std::ostream &os) {
+    showFlonum(os, d);
+}
+
+Value FlonumV(double d) {
+    uint64_t b;
+    std::memcpy(&b, &d, sizeof b);
+    if (b == 0) return Value::fromBits(Value::FLONUM_TAG);
+    uint64_t top = b >> 59 & 0xF;
+    // 2^-127 would pack to the same word as zero
+    if ((top == 0x7 || top == 0x8) && b != 0x3800000000000000ULL) {
+        return Value::fromBits((b & 0xC000000000000000ULL) | (b & 0x07FFFFFFFFFFFFFFULL) << 3 | Value::FLONUM_TAG);
     }
-    
-    // Simplify the fraction
-    int g = gcd(num, den);
-    numerator = num / g;
-    denominator = den / g;
-    
-    // Ensure denominator is positive
-    if (denominator < 0) {
-        numerator = -numerator;
-        denominator = -denominator;
+    return Value(new Flonum(d));
+}
+
+double flonumValue(const Value &v) {
+    if (v.isFlonum()) return v.flonum();
+    return static_cast<Flonum*>(v.get())->d;
+}
+
+// Rational
+Rational::Rational(long long num, long long den)
+    : ValueBase(V_RATIONAL), numerator(num), denominator(den), big(false) {}
+
+Rational::Rational(const BigInt &num, const BigInt &den)
+    : ValueBase(V_RATIONAL), numerator(0), denominator(1), big(!num.fitsLong() || !den.fitsLong()) {
+    if (big) {
+        big_numerator = num;
+        big_denominator = den;
+    } else {
+        numerator = num.toLong();
+        denominator = den.toLong();
     }
 }
 
 void Rational::show(std::ostream &os) {
-    if (denominator == 1) {
+    if (big) {
+        os << big_numerator.toString() << "/" << big_denominator.toString();
+    } else if (denominator == 1) {
         os << numerator;
     } else {
         os << numerator << "/" << denominator;
     }
 }
 
-Value RationalV(int num, int den) {
+Value RationalV(long long num, long long den) {
+    if (den == 0) {
+        throw std::runtime_error("Division by zero");
+    }
+    if (num == LLONG_MIN || den == LLONG_MIN) return RationalV(BigInt(num), BigInt(den));
+    if (den < 0) {
+        num = -num;
+        den = -den;
+    }
+    long long g = (long long)binaryGcd(num < 0 ? -num : num, den);
+    num /= g;
+    den /= g;
+    if (den == 1) return IntegerV(num);
     return Value(new Rational(num, den));
 }
 
-// Boolean
-Boolean::Boolean(bool b) : ValueBase(V_BOOL), b(b) {}
-
-void Boolean::show(std::ostream &os) {
-    os << (b ? "#t" : "#f");
+Value RationalV(const BigInt &num, const BigInt &den) {
+    if (den.isZero()) {
+        throw std::runtime_error("Division by zero");
+    }
+    BigInt g = gcd(num, den), n, d, rem;
+    divide(num, g, n, rem);
+    divide(den, g, d, rem);
+    if (d.negative) {
+        n = -n;
+        d = -d;
+    }
+    if (compare(d, BigInt(1)) == 0) return IntegerV(n);
+    return Value(new Rational(n, d));
 }
 
+// Boolean
 Value BooleanV(bool b) {
-    return Value(new Boolean(b));
+    return Value::fromBits(b ? Value::TRUE_BITS : Value::FALSE_BITS);
 }
 
 // Symbol
-Symbol::Symbol(const std::string &s) : ValueBase(V_SYM), s(s) {}
-
-void Symbol::show(std::ostream &os) {
-    os << s;
-}
-
-Value SymbolV(const std::string &s) {
-    return Value(new Symbol(s));
+Value SymbolV(SymbolId id) {
+    return Value::fromBits(((uintptr_t)id << 3) | Value::SYMBOL_TAG);
 }
 
 // String
@@ -195,18 +495,8 @@ Value StringV(const std::string &s) {
 // ============================================================================
 
 // Null
-Null::Null() : ValueBase(V_NULL) {}
-
-void Null::show(std::ostream &os) {
-    os << "()";
-}
-
-void Null::showCdr(std::ostream &os) {
-    os << ')';
-}
-
 Value NullV() {
-    return Value(new Null());
+    return Value::fromBits(Value::NULL_BITS);
 }
 
 // Terminate
@@ -230,28 +520,87 @@ Pair::Pair(const Value &car, const Value &cdr)
 
 void Pair::show(std::ostream &os) {
     os << '(' << car;
-    cdr->showCdr(os);
+    cdr.showCdr(os);
 }
 
 void Pair::showCdr(std::ostream &os) {
     os << ' ' << car;
-    cdr->showCdr(os);
+    cdr.showCdr(os);
+}
+
+void Pair::trace() {
+    gcMark(car.get());
+    gcMark(cdr.get());
 }
 
 Value PairV(const Value &car, const Value &cdr) {
     return Value(new Pair(car, cdr));
 }
 
+void freezeConstant(const Value &v) {
+    Value rest = v;
+    while (rest.get() != nullptr && !rest.get()->constant) {
+        rest.get()->constant = true;
+        if (rest.type() != V_PAIR) return;
+        freezeConstant(static_cast<Pair*>(rest.get())->car);
+        rest = static_cast<Pair*>(rest.get())->cdr;
+    }
+}
+
 // Procedure
-Procedure::Procedure(const std::vector<std::string> &xs, const Expr &e, const Assoc &env)
-    : ValueBase(V_PROC), parameters(xs), e(e), env(env) {}
+Procedure::Procedure(const std::vector<SymbolId> &xs, const Expr &e, const Assoc &env,
+                     const std::vector<bool> &boxed)
+    : ValueBase(V_PROC), parameters(xs), e(e), env(env), boxed(boxed), code(nullptr), compiled(nullptr), native(nullptr), jit(nullptr) {}
 
 void Procedure::show(std::ostream &os) {
     os << "#<procedure>";
 }
 
-Value ProcedureV(const std::vector<std::string> &xs, const Expr &e, const Assoc &env) {
-    return Value(new Procedure(xs, e, env));
+void Procedure::trace() {
+    gcMark(env.get());
+}
+
+static std::vector<Expr> retired_bodies;   ///< Bodies of collected procedures, maybe still running
+
+Procedure::~Procedure() {
+    if (e.unique()) retired_bodies.push_back(e);
+    if (jit != nullptr) jitRelease(jit);
+}
+
+void releaseBodies() {
+    retired_bodies.clear();
+    jitFreeRetired();
+}
+
+Value ProcedureV(const std::vector<SymbolId> &xs, const Expr &e, const Assoc &env,
+                 const std::vector<bool> &boxed) {
+    return Value(new Procedure(xs, e, env, boxed));
+}
+
+// Primitive
+Primitive::Primitive(Function fn, int arity) : ValueBase(V_PRIMITIVE), fn(fn), arity(arity) {}
+
+void Primitive::show(std::ostream &os) {
+    os << "#<procedure>";
+}
+
+Value PrimitiveV(Primitive::Function fn, int arity) {
+    return Value(new Primitive(fn, arity));
+}
+
+// Box
+Box::Box(const Value &v) : ValueBase(V_BOX), v(v) {}
+
+void Box::show(std::ostream &os) {
+    os << "#<box>";
+}
+
+void Box::trace() {
+    gcMark(v.get());
+}
+
+Value BoxV(const Value &v) {
+    return Value(new Box(v));
 }
 
 // ============================================================================
@@ -259,6 +608,6 @@ Value ProcedureV(const std::vector<std::string> &xs, const Expr &e, const Assoc
 // ============================================================================
 
 std::ostream &operator<<(std::ostream &os, Value &v) {
-    v->show(os);
+    v.show(os);
     return os;
 }
@@ -11,18 +11,26 @@
 
 #include "Def.hpp"
 #include "expr.hpp"
+#include "gc.hpp"
+#include "bignum.hpp"
 #include <memory>
 #include <cstring>
 #include <vector>
+#include <cstdint>
 
 // ============================================================================
 // Base classes and smart pointer wrappers
 // ============================================================================
 
 /**
- * @brief Base class for all values in the Scheme interpreter
+ * @brief Base class for all heap-allocated values in the Scheme interpreter
+ *
+ * Fixnums, booleans, the empty list, void and symbols are immediates stored
+ * directly in a Value word and never have a ValueBase behind them. Heap
+ * values are owned by the garbage collector.
  */
-struct ValueBase {
+struct ValueBase : GCObject {
+    bool constant;      ///< Part of a literal: set-car! and set-cdr! refuse to change it
     ValueType v_type;
     ValueBase(ValueType);
     virtual void show(std::ostream &) = 0;
@@ -31,26 +39,74 @@ struct ValueBase {
 };
 
 /**
- * @brief Smart pointer wrapper for ValueBase objects
+ * @brief Tagged value word
+ *
+ * Layout of bits (heap objects are at least 8-byte aligned):
+ * - xxx...xx1 : fixnum, the integer is stored in the upper bits
+ * - kkk...k010: special immediate (#f, #t, (), #<void>), k selects which
+ * - sss...s110: interned symbol, s is its SymbolId
+ * - fff...f100: flonum, a double with its exponent bits packed (see FlonumV)
+ * - ppp...p000: pointer to a collected ValueBase (0 means "no value")
+ *
+ * A Value is a plain word: copying it never touches the heap.
  */
 struct Value {
-    std::shared_ptr<ValueBase> ptr;
-    Value(ValueBase *);
-    void show(std::ostream &);
+    uintptr_t bits;
+
+    static const uintptr_t FIXNUM_TAG = 1;
+    static const uintptr_t SPECIAL_TAG = 2;
+    static const uintptr_t SYMBOL_TAG = 6;
+    static const uintptr_t FLONUM_TAG = 4;
+    static const uintptr_t TAG_MASK = 7;
+    static const uintptr_t FALSE_BITS = (0 << 3) | SPECIAL_TAG;
+    static const uintptr_t TRUE_BITS  = (1 << 3) | SPECIAL_TAG;
+    static const uintptr_t NULL_BITS  = (2 << 3) | SPECIAL_TAG;
+    static const uintptr_t VOID_BITS  = (3 << 3) | SPECIAL_TAG;
+
+    Value(ValueBase *ptr) : bits(reinterpret_cast<uintptr_t>(ptr)) {}
+
+    static Value fromBits(uintptr_t b) {
+        Value v(nullptr);
+        v.bits = b;
+        return v;
+    }
+
+    bool isFixnum() const { return (bits & FIXNUM_TAG) != 0; }
+    bool isHeap() const { return bits != 0 && (bits & TAG_MASK) == 0; }
+    bool isFalse() const { return bits == FALSE_BITS; }
+    bool isNull() const { return bits == NULL_BITS; }
+    bool isVoid() const { return bits == VOID_BITS; }
+    bool isSymbol() const { return (bits & TAG_MASK) == SYMBOL_TAG; }
+    bool isFlonum() const { return (bits & TAG_MASK) == FLONUM_TAG; }  ///< An immediate flonum only
+    bool empty() const { return bits == 0; }  ///< No value at all (unbound)
+    int fixnum() const { return (int)((intptr_t)bits >> 1); }
+    SymbolId symbol() const { return (SymbolId)(bits >> 3); }
+    double flonum() const {
+        if (bits == FLONUM_TAG) return 0.0;
+        uint64_t b = (bits & 0xC000000000000000ULL) | (bits >> 3 & 0x07FFFFFFFFFFFFFFULL);
+        if ((bits >> 62 & 1) == 0) b |= 0x3800000000000000ULL;
+        double d;
+        std::memcpy(&d, &b, sizeof d);
+        return d;
+    }
+    ValueType type() const;
+
+    void show(std::ostream &) const;
+    void showCdr(std::ostream &) const;
     ValueBase* operator->() const;
     ValueBase& operator*();
-    ValueBase* get() const;
+    ValueBase* get() const;  ///< Heap object, or nullptr for immediates
 };
 
 // ============================================================================
-// Environment (Association Lists)
+// Environment (Frames)
 // ============================================================================
 
 /**
- * @brief Smart pointer wrapper for AssocList (Environment)
+ * @brief Pointer wrapper for AssocList (Environment), owned by the collector
  */
 struct Assoc {
-    std::shared_ptr<AssocList> ptr;
+    AssocList *ptr;
     Assoc(AssocList *);
     AssocList* operator->() const;
     AssocList& operator*();
@@ -58,74 +114,207 @@ struct Assoc {
 };
 
 /**
- * @brief Association list node for variable bindings
+ * @brief Parse-time description of a frame
+ *
+ * A closure scope stands for the captured-variable frame of a lambda: it
+ * starts empty and grows while the lambda body is parsed, each free variable
+ * recording where its value is copied from in the enclosing scope.
+ */
+struct Scope {
+    std::vector<SymbolId> names;    ///< Slot names
+    std::vector<bool> boxed;        ///< Slot holds a Box (the variable is assigned)
+    bool closure;                   ///< Captured-variable frame of a lambda
+    std::vector<std::pair<int, int>> captures;  ///< (depth, slot) of each capture, closure scopes only
+};
+
+/**
+ * @brief Environment frame: an array of variable slots and the enclosing frame
+ *
+ * Every procedure call, let and letrec creates one frame. The parser resolves
+ * local variable references to a (depth, slot) pair, so runtime frames only
+ * hold values. A closure's frame chain ends at its captured-variable frame;
+ * the outermost environment is empty, as globals live in GlobalCells.
  */
-struct AssocList {
-    std::string x;      ///< Variable name
-    Value v;            ///< Variable value
-    Assoc next;         ///< Next binding in the chain
-    AssocList(const std::string &, const Value &, Assoc &);
+struct AssocList : GCObject {
+    Value *slots;                   ///< Variable values, allocated from the pool
+    std::size_t size;               ///< Number of slots
+    Assoc next;                     ///< Enclosing frame
+    Scope *scope;                   ///< Names of the slots (parse-time frames only)
+    AssocList(std::size_t, const Assoc &);
+    AssocList(Value *, std::size_t, const Assoc &);     ///< On the frame stack, slots already in place
+    AssocList(Scope *, const Assoc &);
+    virtual void trace() override;
+    virtual ~AssocList();
+};
+
+/**
+ * @brief Binding cell of a global variable
+ *
+ * Cells are created on first mention (at parse time, possibly still unbound)
+ * and never freed, so compiled Var/Set/Define nodes keep a direct pointer.
+ * Redefining a global just overwrites its cell.
+ */
+struct GlobalCell {
+    SymbolId name;
+    Value v;            ///< Empty while the global is unbound
+    bool assigned;      ///< Some parsed set! targets it; such globals are never inlined
+    GlobalCell(SymbolId);
 };
 
 // Environment operations
 Assoc empty();
-Assoc extend(const std::string&, const Value &, Assoc &);
-void modify(const std::string&, const Value &, Assoc &);
-Value find(const std::string &, Assoc &);
+Assoc extend(std::size_t, const Assoc &);
+
+/**
+ * @brief Frame stack: frames of the tree walker that cannot outlive their call
+ *
+ * Closures are flat (a lambda copies the values, or the boxes, of its free
+ * variables into a frame of its own), so the only frame a value can refer
+ * to is a closure's captured-variable frame. The frames of let, letrec and
+ * procedure calls are reachable only from frames nested inside them and from
+ * the evaluator while it runs them, so the tree walker bumps them off one
+ * contiguous region instead of the collected heap. Each trampoline() owns
+ * the frames pushed above its base and pops them when it returns; a tail
+ * call moves the callee's frame down to the base, as nothing else above it
+ * is live any more, so loops run in a constant amount of it. When the region
+ * is full, frames come from the heap again. These frames are never linked
+ * into the collected heap: every collection marks from all the frames below
+ * the top instead (see markFrameStack).
+ */
+Assoc pushFrame(std::size_t, const Assoc &);    ///< Frame of n unbound slots on the frame stack
+Assoc tailFrame(const Assoc &);     ///< Move the frame just pushed to the current trampoline's base
+std::size_t frameStackTop();
+void popFrames(std::size_t);        ///< Pop back to what frameStackTop() gave
+void popFramesAbove(const Assoc &);  ///< Pop the current trampoline's frames pushed after frame
+
+/**
+ * @brief Frames pushed while it lives belong to one trampoline (see pushFrame)
+ */
+struct FrameScope {
+    std::size_t base;       ///< Top of the frame stack on entry
+    std::size_t outer;      ///< Base of the enclosing trampoline
+    FrameScope();
+    ~FrameScope();
+};
+
+void markFrameStack();
+
+// Parse-time scopes
+Assoc extendScope(const std::vector<SymbolId> &, const std::vector<bool> &, const Assoc &);
+Assoc closureScope(const Assoc &);
+bool resolve(SymbolId, Assoc &, int &, int &, bool &);
+Value &frameSlot(Assoc &, int, int);
+GlobalCell *globalCell(SymbolId);
+void markGlobals();
+
+/**
+ * @brief Roots for the locals of the evaluators (see GCRoot)
+ *
+ * They refer to the local, so it can change while it is registered.
+ */
+struct ValueRoot : GCRoot {
+    const Value *values;
+    std::size_t count;
+    ValueRoot(const Value &v) : values(&v), count(1) {}
+    ValueRoot(const Value *values, std::size_t count) : values(values), count(count) {}
+    virtual void trace() override;
+};
+
+struct VectorRoot : GCRoot {
+    const std::vector<Value> &values;
+    VectorRoot(const std::vector<Value> &values) : values(values) {}
+    virtual void trace() override;
+};
+
+struct EnvRoot : GCRoot {
+    const Assoc &env;
+    EnvRoot(const Assoc &env) : env(env) {}
+    virtual void trace() override;
+};
 
 // ============================================================================
 // Simple Value Types
 // ============================================================================
 
 /**
- * @brief Void value (represents no meaningful return value)
+ * @brief Void value (represents no meaningful return value), an immediate
  */
-struct Void : ValueBase {
-    Void();
-    virtual void show(std::ostream &) override;
-};
 Value VoidV();
 
 /**
- * @brief Integer value
+ * @brief Integer value, an immediate fixnum
  */
-struct Integer : ValueBase {
-    int n;
-    Integer(int);
-    virtual void show(std::ostream &) override;
-};
 Value IntegerV(int);
 
 /**
- * @brief Rational number value
+ * @brief Integer outside the fixnum range
+ *
+ * Integers are always normalized: a value that fits a fixnum is never a
+ * Bignum, so two equal integers have the same type.
  */
-struct Rational : ValueBase {
-    int numerator;
-    int denominator;
-    Rational(int, int);
+struct Bignum : ValueBase {
+    BigInt n;
+    Bignum(const BigInt &);
     virtual void show(std::ostream &) override;
 };
-Value RationalV(int, int);
 
 /**
- * @brief Boolean value
+ * @brief Integer value of n: a fixnum when it fits, a Bignum otherwise
  */
-struct Boolean : ValueBase {
-    bool b;
-    Boolean(bool);
+Value IntegerV(long long);
+Value IntegerV(const BigInt &);
+bool isInteger(const Value &);          ///< A fixnum or a Bignum
+BigInt integerValue(const Value &);     ///< Of a fixnum or a Bignum
+
+/**
+ * @brief Boxed flonum, for doubles that do not fit in an immediate
+ */
+struct Flonum : ValueBase {
+    double d;
+    Flonum(double);
     virtual void show(std::ostream &) override;
 };
-Value BooleanV(bool);
 
 /**
- * @brief Symbol value
+ * @brief Flonum value of d, an immediate unless d is tiny, huge, -0.0, infinite or NaN
+ *
+ * A double whose top four exponent bits are 0111 or 1000 (magnitude between
+ * 2^-127 and 2^129) has three of them implied by the first, which frees
+ * room for the tag; zero gets the all-zero payload. Arithmetic on such
+ * doubles never allocates.
  */
-struct Symbol : ValueBase {
-    std::string s;
-    Symbol(const std::string &);
+Value FlonumV(double);
+double flonumValue(const Value &);      ///< Of an immediate or boxed flonum
+
+/**
+ * @brief Rational number value, in lowest terms with a positive denominator
+ *
+ * The parts are long longs while they fit and BigInts beyond that. The
+ * constructors trust their parts to be normalized already; RationalV
+ * normalizes, and gives an integer when the denominator divides out.
+ */
+struct Rational : ValueBase {
+    long long numerator;            ///< Unless big
+    long long denominator;          ///< Unless big
+    bool big;
+    BigInt big_numerator;           ///< If big
+    BigInt big_denominator;         ///< If big
+    Rational(long long, long long);
+    Rational(const BigInt &, const BigInt &);   ///< Stored small if both parts fit
     virtual void show(std::ostream &) override;
 };
-Value SymbolV(const std::string &);
+Value RationalV(long long, long long);
+Value RationalV(const BigInt &, const BigInt &);
+
+/**
+ * @brief Boolean value, an immediate
+ */
+Value BooleanV(bool);
+
+/**
+ * @brief Symbol value, an immediate holding the interned SymbolId
+ */
+Value SymbolV(SymbolId);
 
 /**
  * @brief String value
@@ -142,13 +331,8 @@ Value StringV(const std::string &);
 // ============================================================================
 
 /**
- * @brief Null value (empty list)
+ * @brief Null value (empty list), an immediate
  */
-struct Null : ValueBase {
-    Null();
-    virtual void show(std::ostream &) override;
-    virtual void showCdr(std::ostream &) override;
-};
 Value NullV();
 
 /**
@@ -173,20 +357,70 @@ struct Pair : ValueBase {
     Pair(const Value &, const Value &);
     virtual void show(std::ostream &) override;
     virtual void showCdr(std::ostream &) override;
+    virtual void trace() override;
 };
 Value PairV(const Value &, const Value &);
+void freezeConstant(const Value &);     ///< Mark v and the pairs it is made of as a literal
 
 /**
  * @brief Procedure (function) value
  */
 struct Procedure : ValueBase {
-    std::vector<std::string> parameters;   ///< Parameter names
+    std::vector<SymbolId> parameters;      ///< Parameter names
     Expr e;                                ///< Function body expression
-    Assoc env;                             ///< Closure environment
-    Procedure(const std::vector<std::string> &, const Expr &, const Assoc &);
+    Assoc env;                             ///< Captured free variables
+    std::vector<bool> boxed;               ///< Parameters to box on entry (empty if none)
+    Chunk *code;                           ///< Bytecode of the body (vm engine), nullptr if none
+    Compiled *compiled;                    ///< Functor tree of the body (closure engine), nullptr if none
+    Value (*native)(Assoc &);              ///< Body compiled ahead of time (--emit-cpp), nullptr if none
+    JitState *jit;                         ///< Call count and native code of its lambda, nullptr if none
+    Procedure(const std::vector<SymbolId> &, const Expr &, const Assoc &, const std::vector<bool> &);
+    virtual void show(std::ostream &) override;
+    virtual void trace() override;
+    virtual ~Procedure();
+};
+Value ProcedureV(const std::vector<SymbolId> &, const Expr &, const Assoc &,
+                 const std::vector<bool> & = std::vector<bool>());
+
+/**
+ * @brief Free the bodies of the procedures collected so far
+ *
+ * A procedure can be collected while its body still runs, once nothing
+ * refers to it any more; a body that was only its own, and the native code
+ * of its lambda, are therefore kept until this is called between top-level
+ * forms, where no body runs.
+ */
+void releaseBodies();
+
+/**
+ * @brief Native primitive procedure: a C++ function plus its arity
+ *
+ * There is one instance per primitive, created on first use and pinned, so
+ * referring to a primitive as a value allocates nothing.
+ */
+struct Primitive : ValueBase {
+    typedef Value (*Function)(const std::vector<Value> &);
+    Function fn;
+    int arity;      ///< Number of arguments, -1 for any number
+    Primitive(Function, int);
+    virtual void show(std::ostream &) override;
+};
+Value PrimitiveV(Primitive::Function, int);
+Value primitiveProcedure(SymbolId);     ///< Empty if the name is no primitive
+
+/**
+ * @brief Mutable cell shared by a frame and the closures capturing it
+ *
+ * Only variables assigned by set! (or an internal define) live in a box;
+ * it is never visible as a Scheme value.
+ */
+struct Box : ValueBase {
+    Value v;
+    Box(const Value &);
     virtual void show(std::ostream &) override;
+    virtual void trace() override;
 };
-Value ProcedureV(const std::vector<std::string> &, const Expr &, const Assoc &);
+Value BoxV(const Value &);
 
 // ============================================================================
 // Utility Functions
@@ -0,0 +1,626 @@
+/**
+ * @file vm.cpp
+ * @brief Bytecode compiler and stack virtual machine
+ *
+ * The compiler walks the Expr tree once and emits instructions that push
+ * and pop an operand stack; jumps are absolute instruction indexes. Calls
+ * push a small frame record instead of recursing in C++, and calls in tail
+ * position reuse the current record, so recursion depth only costs heap.
+ * Environments are the same (depth, slot) frames as the tree walker's.
+ */
+
+#include "vm.hpp"
+#include "RE.hpp"
+#include <vector>
+
+enum OpCode {
+    OP_CONST,               ///< push constants[a]
+    OP_LOCAL,               ///< push slot (a, b)
+    OP_LOCAL_BOX,           ///< push the content of the box in slot (a, b)
+    OP_GLOBAL,              ///< push the global of node (a Var)
+    OP_DEFINE_LOCAL,        ///< pop into slot (a, b), push void
+    OP_DEFINE_LOCAL_BOX,
+    OP_DEFINE_GLOBAL,       ///< pop into the cell of node (a Define), push void
+    OP_CHECK_LOCAL,         ///< set! target must be bound
+    OP_CHECK_LOCAL_BOX,
+    OP_CHECK_GLOBAL,
+    OP_SET_LOCAL,           ///< pop into slot (a, b), push void
+    OP_SET_LOCAL_BOX,
+    OP_SET_GLOBAL,          ///< pop into the cell of node (a Set), push void
+    OP_POP,
+    OP_JUMP,                ///< go to instruction a
+    OP_JUMP_IF_FALSE,       ///< pop, go to a if it is #f
+    OP_JUMP_IF_FALSE_OR_POP,///< go to a keeping the top if it is #f, else pop
+    OP_JUMP_IF_TRUE_OR_POP, ///< go to a keeping the top if it is not #f, else pop
+    OP_CLOSURE,             ///< push a closure of node (a Lambda) running chunk
+    OP_CHECK_PROC,          ///< the top must be a procedure
+    OP_CALL,                ///< call with a arguments
+    OP_TAIL_CALL,           ///< call with a arguments, replacing this call
+    OP_RETURN,
+    OP_LET,                 ///< pop a values into a new frame
+    OP_LETREC,              ///< push a frame of a unbound slots
+    OP_LETREC_INIT,         ///< pop a values into the letrec frame
+    OP_POP_ENV,             ///< leave the innermost let/letrec frame
+    OP_ADD,                 ///< binary primitives with a fixnum fast path
+    OP_SUB,
+    OP_MUL,
+    OP_LT,
+    OP_LE,
+    OP_NUM_EQ,
+    OP_GE,
+    OP_GT,
+    OP_CAR,                 ///< unary primitives with a fast path
+    OP_CDR,
+    OP_NULLQ,
+    OP_PAIRQ,
+    OP_UNARY,               ///< any other primitive node, by its evalRator
+    OP_BINARY,
+    OP_VARIADIC,            ///< with a arguments
+    OP_NODE                 ///< push node->eval(env): left to the tree walker
+};
+
+struct Instr {
+    OpCode op;
+    int a;
+    int b;
+    ExprBase *node;     ///< Source node for variables, primitives and fallbacks
+    Chunk *chunk;       ///< Body of the lambda, OP_CLOSURE only
+};
+
+/**
+ * @brief Compiled code of a top-level expression or a lambda body
+ *
+ * Lambda chunks are kept for the life of the program (like interned symbols,
+ * they grow with the source text, not with the run); each one holds its
+ * source so the nodes it points to stay alive.
+ */
+struct Chunk {
+    std::vector<Instr> code;
+    std::vector<Value> constants;   ///< Immediates only, so chunks hold no GC roots
+    Expr source;
+    Chunk(const Expr &source) : source(source) {}
+};
+
+// ============================================================================
+// Compiler
+// ============================================================================
+
+class Compiler {
+public:
+    explicit Compiler(Chunk *chunk) : chunk(chunk) {}
+    void compile(ExprBase *x, bool tail);
+
+private:
+    Chunk *chunk;
+
+    int emit(OpCode op, int a = 0, int b = 0, ExprBase *node = nullptr, Chunk *body = nullptr) {
+        Instr in = {op, a, b, node, body};
+        chunk->code.push_back(in);
+        return (int)chunk->code.size() - 1;
+    }
+
+    void constant(const Value &v) {
+        chunk->constants.push_back(v);
+        emit(OP_CONST, (int)chunk->constants.size() - 1);
+    }
+
+    // make the jump at `at` land on the next instruction
+    void patch(int at) {
+        chunk->code[at].a = (int)chunk->code.size();
+    }
+
+    void fallback(ExprBase *x) {
+        emit(OP_NODE, 0, 0, x);
+    }
+
+    void compilePrimitive(ExprBase *x);
+};
+
+void Compiler::compile(ExprBase *x, bool tail) {
+    switch (x->e_type) {
+        case E_FIXNUM:
+            constant(IntegerV(static_cast<Fixnum*>(x)->n));
+            return;
+        case E_TRUE:
+            constant(BooleanV(true));
+            return;
+        case E_FALSE:
+            constant(BooleanV(false));
+            return;
+        case E_VOID:
+            constant(VoidV());
+            return;
+        case E_VAR: {
+            Var *var = static_cast<Var*>(x);
+            if (!validName(var->x)) {//let the tree walker raise the error when reached
+                fallback(x);
+            } else if (var->depth >= 0) {
+                emit(var->boxed ? OP_LOCAL_BOX : OP_LOCAL, var->depth, var->slot, x);
+            } else {
+                emit(OP_GLOBAL, 0, 0, x);
+            }
+            return;
+        }
+        case E_BEGIN: {
+            Begin *begin = static_cast<Begin*>(x);
+            if (begin->es.empty()) {
+                constant(VoidV());
+                return;
+            }
+            for (int i = 0; i + 1 < begin->es.size(); i++) {
+                compile(begin->es[i].get(), false);
+                emit(OP_POP);
+            }
+            compile(begin->es.back().get(), tail);
+            return;
+        }
+        case E_IF: {
+            If *node = static_cast<If*>(x);
+            compile(node->cond.get(), false);
+            int to_alter = emit(OP_JUMP_IF_FALSE);
+            compile(node->conseq.get(), tail);
+            int to_end = emit(OP_JUMP);
+            patch(to_alter);
+            compile(node->alter.get(), tail);
+            patch(to_end);
+            return;
+        }
+        case E_COND: {
+            Cond *node = static_cast<Cond*>(x);
+            std::vector<int> to_end;
+            for (const auto &clause : node->clauses) {
+                compile(clause[0].get(), false);
+                if (clause.size() == 1) {//the test value is the result
+                    to_end.push_back(emit(OP_JUMP_IF_TRUE_OR_POP));
+                    continue;
+                }
+                int to_next = emit(OP_JUMP_IF_FALSE);
+                for (int i = 1; i + 1 < clause.size(); i++) {
+                    compile(clause[i].get(), false);
+                    emit(OP_POP);
+                }
+                compile(clause.back().get(), tail);
+                to_end.push_back(emit(OP_JUMP));
+                patch(to_next);
+            }
+            constant(VoidV());
+            for (int i = 0; i < to_end.size(); i++) patch(to_end[i]);
+            return;
+        }
+        case E_AND:
+        case E_OR: {
+            std::vector<Expr> &rands = x->e_type == E_AND ? static_cast<AndVar*>(x)->rands
+                                                          : static_cast<OrVar*>(x)->rands;
+            if (rands.empty()) {
+                constant(BooleanV(x->e_type == E_AND));
+                return;
+            }
+            OpCode exit_op = x->e_type == E_AND ? OP_JUMP_IF_FALSE_OR_POP : OP_JUMP_IF_TRUE_OR_POP;
+            std::vector<int> to_end;
+            for (int i = 0; i + 1 < rands.size(); i++) {
+                compile(rands[i].get(), false);
+                to_end.push_back(emit(exit_op));
+            }
+            compile(rands.back().get(), tail);
+            for (int i = 0; i < to_end.size(); i++) patch(to_end[i]);
+            return;
+        }
+        case E_APPLY: {
+            Apply *apply = static_cast<Apply*>(x);
+            compile(apply->rator.get(), false);
+            emit(OP_CHECK_PROC);
+            for (int i = 0; i < apply->rand.size(); i++) {
+                compile(apply->rand[i].get(), false);
+            }
+            emit(tail ? OP_TAIL_CALL : OP_CALL, (int)apply->rand.size());
+            return;
+        }
+        case E_LAMBDA: {
+            Lambda *lambda = static_cast<Lambda*>(x);
+            Chunk *body = new Chunk(lambda->e);
+            Compiler(body).compile(lambda->e.get(), true);
+            body->code.push_back(Instr{OP_RETURN, 0, 0, nullptr, nullptr});
+            emit(OP_CLOSURE, 0, 0, x, body);
+            return;
+        }
+        case E_DEFINE: {
+            Define *define = static_cast<Define*>(x);
+            if (!validName(define->var)) {
+                fallback(x);
+                return;
+            }
+            compile(define->e.get(), false);
+            if (define->depth >= 0) {
+                emit(define->boxed ? OP_DEFINE_LOCAL_BOX : OP_DEFINE_LOCAL, define->depth, define->slot);
+            } else {
+                emit(OP_DEFINE_GLOBAL, 0, 0, x);
+            }
+            return;
+        }
+        case E_SET: {
+            Set *set = static_cast<Set*>(x);
+            if (set->depth >= 0) {
+                emit(set->boxed ? OP_CHECK_LOCAL_BOX : OP_CHECK_LOCAL, set->depth, set->slot);
+                compile(set->e.get(), false);
+                emit(set->boxed ? OP_SET_LOCAL_BOX : OP_SET_LOCAL, set->depth, set->slot);
+            } else {
+                emit(OP_CHECK_GLOBAL, 0, 0, x);
+                compile(set->e.get(), false);
+                emit(OP_SET_GLOBAL, 0, 0, x);
+            }
+            return;
+        }
+        case E_LET: {
+            Let *let = static_cast<Let*>(x);
+            for (int i = 0; i < let->bind.size(); i++) {
+                if (!validName(let->bind[i].first)) {
+                    fallback(x);
+                    return;
+                }
+            }
+            for (int i = 0; i < let->bind.size(); i++) {
+                compile(let->bind[i].second.get(), false);
+            }
+            emit(OP_LET, (int)let->bind.size(), 0, x);
+            compile(let->body.get(), tail);
+            if (!tail) emit(OP_POP_ENV);
+            return;
+        }
+        case E_LETREC: {
+            Letrec *letrec = static_cast<Letrec*>(x);
+            for (int i = 0; i < letrec->bind.size(); i++) {
+                if (!validName(letrec->bind[i].first)) {
+                    fallback(x);
+                    return;
+                }
+            }
+            emit(OP_LETREC, (int)letrec->bind.size(), 0, x);
+            for (int i = 0; i < letrec->bind.size(); i++) {
+                compile(letrec->bind[i].second.get(), false);
+            }
+            emit(OP_LETREC_INIT, (int)letrec->bind.size(), 0, x);
+            compile(letrec->body.get(), tail);
+            if (!tail) emit(OP_POP_ENV);
+            return;
+        }
+        default:
+            compilePrimitive(x);
+            return;
+    }
+}
+
+void Compiler::compilePrimitive(ExprBase *x) {
+    if (Unary *unary = dynamic_cast<Unary*>(x)) {
+        compile(unary->rand.get(), false);
+        switch (x->e_type) {
+            case E_CAR:   emit(OP_CAR, 0, 0, x); break;
+            case E_CDR:   emit(OP_CDR, 0, 0, x); break;
+            case E_NULLQ: emit(OP_NULLQ, 0, 0, x); break;
+            case E_PAIRQ: emit(OP_PAIRQ, 0, 0, x); break;
+            default:      emit(OP_UNARY, 0, 0, x); break;
+        }
+    } else if (Binary *binary = dynamic_cast<Binary*>(x)) {
+        compile(binary->rand1.get(), false);
+        compile(binary->rand2.get(), false);
+        switch (x->e_type) {
+            case E_PLUS:  emit(OP_ADD, 0, 0, x); break;
+            case E_MINUS: emit(OP_SUB, 0, 0, x); break;
+            case E_MUL:   emit(OP_MUL, 0, 0, x); break;
+            case E_LT:    emit(OP_LT, 0, 0, x); break;
+            case E_LE:    emit(OP_LE, 0, 0, x); break;
+            case E_EQ:    emit(OP_NUM_EQ, 0, 0, x); break;
+            case E_GE:    emit(OP_GE, 0, 0, x); break;
+            case E_GT:    emit(OP_GT, 0, 0, x); break;
+            default:      emit(OP_BINARY, 0, 0, x); break;
+        }
+    } else if (Variadic *variadic = dynamic_cast<Variadic*>(x)) {
+        for (int i = 0; i < variadic->rands.size(); i++) {
+            compile(variadic->rands[i].get(), false);
+        }
+        emit(OP_VARIADIC, (int)variadic->rands.size(), 0, x);
+    } else {//quote, strings, rationals, exit
+        fallback(x);
+    }
+}
+
+// ============================================================================
+// Virtual machine
+// ============================================================================
+
+/**
+ * @brief Saved state of a caller
+ */
+struct CallFrame {
+    Chunk *chunk;
+    const Instr *ip;
+    Assoc env;
+    std::size_t base;   ///< Operand stack height at the caller's entry
+};
+
+static void undefinedVariable(ExprBase *node) {
+    throw RuntimeError("Undefined variable:" + symbolName(static_cast<Var*>(node)->x));
+}
+
+/**
+ * @brief Registers of a running machine, as a root for the collector
+ */
+struct MachineRoot : GCRoot {
+    const std::vector<Value> &stack;
+    const std::vector<CallFrame> &frames;
+    const Assoc &env;
+    MachineRoot(const std::vector<Value> &stack, const std::vector<CallFrame> &frames, const Assoc &env)
+        : stack(stack), frames(frames), env(env) {}
+    virtual void trace() override {
+        for (std::size_t i = 0; i < stack.size(); i++) gcMark(stack[i].get());
+        for (std::size_t i = 0; i < frames.size(); i++) gcMark(frames[i].env.get());
+        gcMark(env.get());
+    }
+};
+
+// drop the operand stack down to height n
+static inline void truncate(std::vector<Value> &stack, std::size_t n) {
+    stack.erase(stack.begin() + n, stack.end());
+}
+
+static Value run(Chunk *entry, Assoc env) {
+    std::vector<Value> stack;
+    std::vector<CallFrame> frames;
+    stack.reserve(256);
+    Chunk *chunk = entry;
+    const Instr *ip = chunk->code.data();
+    std::size_t base = 0;
+    MachineRoot root(stack, frames, env);
+
+    for (;;) {
+        const Instr &in = *ip++;
+        switch (in.op) {
+            case OP_CONST:
+                stack.push_back(chunk->constants[in.a]);
+                break;
+            case OP_LOCAL: {
+                Value v = frameSlot(env, in.a, in.b);
+                if (v.empty()) undefinedVariable(in.node);
+                stack.push_back(v);
+                break;
+            }
+            case OP_LOCAL_BOX: {
+                Value v = static_cast<Box*>(frameSlot(env, in.a, in.b).get())->v;
+                if (v.empty()) undefinedVariable(in.node);
+                stack.push_back(v);
+                break;
+            }
+            case OP_GLOBAL: {
+                Var *var = static_cast<Var*>(in.node);
+                Value v = var->cell->v;
+                if (v.empty()) {
+                    if (var->prim == nullptr) undefinedVariable(in.node);
+                    v = Value(var->prim);
+                }
+                stack.push_back(v);
+                break;
+            }
+            case OP_DEFINE_LOCAL:
+            case OP_SET_LOCAL:
+                frameSlot(env, in.a, in.b) = stack.back();
+                stack.back() = VoidV();
+                break;
+            case OP_DEFINE_LOCAL_BOX:
+            case OP_SET_LOCAL_BOX:
+                static_cast<Box*>(frameSlot(env, in.a, in.b).get())->v = stack.back();
+                stack.back() = VoidV();
+                break;
+            case OP_DEFINE_GLOBAL:
+                static_cast<Define*>(in.node)->cell->v = stack.back();
+                stack.back() = VoidV();
+                break;
+            case OP_SET_GLOBAL:
+                static_cast<Set*>(in.node)->cell->v = stack.back();
+                stack.back() = VoidV();
+                break;
+            case OP_CHECK_LOCAL:
+                if (frameSlot(env, in.a, in.b).empty()) throw RuntimeError("Unbound variable in set!");
+                break;
+            case OP_CHECK_LOCAL_BOX:
+                if (static_cast<Box*>(frameSlot(env, in.a, in.b).get())->v.empty()) {
+                    throw RuntimeError("Unbound variable in set!");
+                }
+                break;
+            case OP_CHECK_GLOBAL:
+                if (static_cast<Set*>(in.node)->cell->v.empty()) throw RuntimeError("Unbound variable in set!");
+                break;
+            case OP_POP:
+                stack.pop_back();
+                break;
+            case OP_JUMP:
+                ip = chunk->code.data() + in.a;
+                break;
+            case OP_JUMP_IF_FALSE: {
+                bool jump = stack.back().isFalse();
+                stack.pop_back();
+                if (jump) ip = chunk->code.data() + in.a;
+                break;
+            }
+            case OP_JUMP_IF_FALSE_OR_POP:
+                if (stack.back().isFalse()) ip = chunk->code.data() + in.a;
+                else stack.pop_back();
+                break;
+            case OP_JUMP_IF_TRUE_OR_POP:
+                if (!stack.back().isFalse()) ip = chunk->code.data() + in.a;
+                else stack.pop_back();
+                break;
+            case OP_CLOSURE: {
+                Value closure = static_cast<Lambda*>(in.node)->eval(env);
+                static_cast<Procedure*>(closure.get())->code = in.chunk;
+                stack.push_back(closure);
+                break;
+            }
+            case OP_CHECK_PROC: {
+                ValueType t = stack.back().type();
+                if (t != V_PROC && t != V_PRIMITIVE) throw RuntimeError("Attempt to apply a non-procedure");
+                break;
+            }
+            case OP_CALL:
+            case OP_TAIL_CALL: {
+                int n = in.a;
+                std::size_t at = stack.size() - n - 1;
+                Value f = stack[at];
+                if (f.type() == V_PRIMITIVE) {
+                    Primitive *prim = static_cast<Primitive*>(f.get());
+                    if (prim->arity >= 0 && n != prim->arity) throw RuntimeError("Wrong number of arguments");
+                    std::vector<Value> args(stack.begin() + at + 1, stack.end());
+                    truncate(stack, at);
+                    stack.push_back(prim->fn(args));
+                    if (in.op == OP_TAIL_CALL) goto op_return;
+                    break;
+                }
+                Procedure *clos = static_cast<Procedure*>(f.get());
+                if (n != clos->parameters.size()) throw RuntimeError("Wrong number of arguments");
+                Assoc frame = extend(n, clos->env);
+                for (int i = 0; i < n; i++) {
+                    frame->slots[i] = stack[at + 1 + i];
+                }
+                for (int i = 0; i < clos->boxed.size(); i++) {
+                    if (clos->boxed[i]) frame->slots[i] = BoxV(frame->slots[i]);
+                }
+                truncate(stack, at);
+                if (clos->code == nullptr) {//made by the tree walker
+                    stack.push_back(trampoline(clos->e.get(), frame));
+                    if (in.op == OP_TAIL_CALL) goto op_return;
+                    break;
+                }
+                if (in.op == OP_CALL) {
+                    CallFrame saved = {chunk, ip, env, base};
+                    frames.push_back(saved);
+                    base = at;
+                } else {
+                    truncate(stack, base);
+                }
+                chunk = clos->code;
+                ip = chunk->code.data();
+                env = frame;
+                gcSafePoint(env);
+                break;
+            }
+            case OP_RETURN:
+            op_return: {
+                Value result = stack.back();
+                if (frames.empty()) return result;
+                truncate(stack, base);
+                stack.push_back(result);
+                const CallFrame &caller = frames.back();
+                chunk = caller.chunk;
+                ip = caller.ip;
+                env = caller.env;
+                base = caller.base;
+                frames.pop_back();
+                break;
+            }
+            case OP_LET: {
+                Let *let = static_cast<Let*>(in.node);
+                int n = in.a;
+                Assoc frame = extend(n, env);
+                std::size_t from = stack.size() - n;
+                for (int i = 0; i < n; i++) {
+                    frame->slots[i] = let->boxed[i] ? BoxV(stack[from + i]) : stack[from + i];
+                }
+                truncate(stack, from);
+                env = frame;
+                break;
+            }
+            case OP_LETREC: {
+                Letrec *letrec = static_cast<Letrec*>(in.node);
+                Assoc frame = extend(in.a, env);
+                for (int i = 0; i < in.a; i++) {
+                    if (letrec->boxed[i]) frame->slots[i] = BoxV(Value(nullptr));
+                }
+                env = frame;
+                break;
+            }
+            case OP_LETREC_INIT: {
+                Letrec *letrec = static_cast<Letrec*>(in.node);
+                int n = in.a;
+                std::size_t from = stack.size() - n;
+                for (int i = 0; i < n; i++) {
+                    if (letrec->boxed[i]) static_cast<Box*>(env->slots[i].get())->v = stack[from + i];
+                    else env->slots[i] = stack[from + i];
+                }
+                truncate(stack, from);
+                break;
+            }
+            case OP_POP_ENV:
+                env = env->next;
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_LT:
+            case OP_LE:
+            case OP_NUM_EQ:
+            case OP_GE:
+            case OP_GT: {
+                Value b = stack.back();
+                stack.pop_back();
+                Value &a = stack.back();
+                if (a.isFixnum() && b.isFixnum()) {
+                    int n1 = a.fixnum(), n2 = b.fixnum();
+                    switch (in.op) {
+                        case OP_ADD:    a = IntegerV((long long)n1 + n2); break;
+                        case OP_SUB:    a = IntegerV((long long)n1 - n2); break;
+                        case OP_MUL:    a = IntegerV((long long)n1 * n2); break;
+                        case OP_LT:     a = BooleanV(n1 < n2); break;
+                        case OP_LE:     a = BooleanV(n1 <= n2); break;
+                        case OP_NUM_EQ: a = BooleanV(n1 == n2); break;
+                        case OP_GE:     a = BooleanV(n1 >= n2); break;
+                        default:        a = BooleanV(n1 > n2); break;
+                    }
+                } else {
+                    a = static_cast<Binary*>(in.node)->evalRator(a, b);
+                }
+                break;
+            }
+            case OP_CAR:
+            case OP_CDR: {
+                Value &v = stack.back();
+                if (v.type() == V_PAIR) {
+                    Pair *pair = static_cast<Pair*>(v.get());
+                    v = in.op == OP_CAR ? pair->car : pair->cdr;
+                } else {
+                    v = static_cast<Unary*>(in.node)->evalRator(v);
+                }
+                break;
+            }
+            case OP_NULLQ:
+                stack.back() = BooleanV(stack.back().isNull());
+                break;
+            case OP_PAIRQ:
+                stack.back() = BooleanV(stack.back().type() == V_PAIR);
+                break;
+            case OP_UNARY:
+                stack.back() = static_cast<Unary*>(in.node)->evalRator(stack.back());
+                break;
+            case OP_BINARY: {
+                Value b = stack.back();
+                stack.pop_back();
+                stack.back() = static_cast<Binary*>(in.node)->evalRator(stack.back(), b);
+                break;
+            }
+            case OP_VARIADIC: {
+                std::size_t from = stack.size() - in.a;
+                std::vector<Value> args(stack.begin() + from, stack.end());
+                truncate(stack, from);
+                stack.push_back(static_cast<Variadic*>(in.node)->evalRator(args));
+                break;
+            }
+            case OP_NODE:
+                stack.push_back(in.node->eval(env));
+                break;
+        }
+    }
+}
+
+Value vmEval(const Expr &x, Assoc &env) {
+    Chunk top(x);
+    Compiler(&top).compile(x.get(), true);
+    top.code.push_back(Instr{OP_RETURN, 0, 0, nullptr, nullptr});
+    return run(&top, env);
+}
@@ -0,0 +1,24 @@
+#ifndef VM_HPP
+#define VM_HPP
+
+/**
+ * @file vm.hpp
+ * @brief Bytecode compiler and stack virtual machine (--engine=vm)
+ *
+ * An alternative to the tree-walking eval: each top-level expression is
+ * compiled into a flat instruction sequence and run by a single dispatch
+ * loop over an operand stack. Environments, closures and values are shared
+ * with the tree walker, so nodes the compiler does not handle are simply
+ * evaluated by it, and procedures made by either engine run in both.
+ */
+
+#include "Def.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+
+/**
+ * @brief Compile x and run it on the virtual machine
+ */
+Value vmEval(const Expr &x, Assoc &env);
+
+#endif // VM_HPP